@@ -699,6 +699,7 @@ usage(int error_code)
 		"  --use-pixman\t\tUse the pixman (CPU) renderer (default: no rendering)\n"
 		"  --use-gl\t\tUse the GL renderer (default: no rendering)\n"
 		"  --no-outputs\t\tDo not create any virtual outputs\n"
+		"  --render-cost=USEC\tAdd a synthetic delay to each output repaint\n"
 		"\n");
 #endif
 
@@ -1086,6 +1087,9 @@ weston_compositor_init_config(struct weston_compositor *ec,
 	struct xkb_rule_names xkb_names;
 	struct weston_config_section *s;
 	int repaint_msec;
+	int damage_max_rects;
+	double damage_max_waste;
+	int damage_history;
 	bool color_management;
 	bool cal;
 
@@ -1126,6 +1130,36 @@ weston_compositor_init_config(struct weston_compositor *ec,
 	weston_log("Output repaint window is %d ms maximum.\n",
 		   ec->repaint_msec);
 
+	weston_config_section_get_bool(s, "adaptive-repaint-window",
+				       &ec->repaint_window_adaptive, false);
+	if (ec->repaint_window_adaptive)
+		weston_log("Output repaint window adapts to repaint times.\n");
+
+	weston_config_section_get_int(s, "damage-max-rects", &damage_max_rects,
+				      ec->damage_max_rects);
+	if (damage_max_rects < 0 || damage_max_rects > 256)
+		weston_log("Invalid damage-max-rects value in config: %d\n",
+			   damage_max_rects);
+	else
+		ec->damage_max_rects = damage_max_rects;
+
+	weston_config_section_get_double(s, "damage-max-waste",
+					 &damage_max_waste,
+					 ec->damage_max_waste);
+	if (damage_max_waste < 0.0 || damage_max_waste > 1.0)
+		weston_log("Invalid damage-max-waste value in config: %f\n",
+			   damage_max_waste);
+	else
+		ec->damage_max_waste = damage_max_waste;
+
+	weston_config_section_get_int(s, "damage-history", &damage_history,
+				      ec->damage_history);
+	if (damage_history < 1 || damage_history > 16)
+		weston_log("Invalid damage-history value in config: %d\n",
+			   damage_history);
+	else
+		ec->damage_history = damage_history;
+
 	weston_config_section_get_bool(s, "color-management",
 				       &color_management, false);
 	if (color_management) {
@@ -2641,6 +2675,8 @@ load_headless_backend(struct weston_compositor *c,
 				       false);
 	weston_config_section_get_bool(section, "use-gl", &config.use_gl,
 				       false);
+	weston_config_section_get_uint(section, "render-cost",
+				       &config.render_cost_usec, 0);
 
 	const struct weston_option options[] = {
 		{ WESTON_OPTION_INTEGER, "width", 0, &parsed_options->width },
@@ -2650,6 +2686,8 @@ load_headless_backend(struct weston_compositor *c,
 		{ WESTON_OPTION_BOOLEAN, "use-gl", 0, &config.use_gl },
 		{ WESTON_OPTION_STRING, "transform", 0, &transform },
 		{ WESTON_OPTION_BOOLEAN, "no-outputs", 0, &no_outputs },
+		{ WESTON_OPTION_UNSIGNED_INTEGER, "render-cost", 0,
+		  &config.render_cost_usec },
 	};
 
 	parse_options(options, ARRAY_LENGTH(options), argc, argv);
@@ -468,6 +468,7 @@ shell_configuration(struct desktop_shell *shell)
 	struct weston_config_section *section;
 	char *s, *client;
 	bool allow_zap;
+	uint32_t interval;
 
 	section = weston_config_get_section(wet_get_config(shell->compositor),
 					    "shell", NULL, NULL);
@@ -508,6 +509,10 @@ shell_configuration(struct desktop_shell *shell)
 	weston_config_section_get_uint(section, "num-workspaces",
 				       &shell->workspaces.num,
 				       DEFAULT_NUM_WORKSPACES);
+	weston_config_section_get_uint(section, "occluded-frame-interval",
+				       &interval, 0);
+	weston_compositor_set_occluded_frame_interval(shell->compositor,
+						      interval);
 }
 
 struct weston_output *
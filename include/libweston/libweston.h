@@ -262,6 +262,35 @@ struct weston_head {
 	enum weston_hdcp_protection current_protection;
 };
 
+/** Number of repaint durations kept per output for adaptive scheduling */
+#define WESTON_REPAINT_HISTORY_LENGTH 32
+
+/** Bump allocator for repaint-scoped memory
+ *
+ * Allocations are served from one block that is reset at the start of
+ * every repaint. When the block runs out, the excess is served from
+ * separate heap chunks and the block is grown to the high-water mark at
+ * the next reset, so with a steady workload the arena stops calling
+ * malloc. Only memory taken through weston_output_frame_alloc() is
+ * covered; other allocations on the repaint path still use the heap.
+ *
+ * \ingroup output
+ */
+struct weston_frame_arena {
+	char *data;
+	size_t size;
+	size_t used;
+	/** bytes served from overflow chunks since the last reset */
+	size_t overflow;
+	/** overflow chunks to free at the next reset */
+	void *chunks;
+	/** arena block growths and overflow chunks in the last frame */
+	uint32_t last_frame_arena_mallocs;
+	uint32_t frame_arena_mallocs;
+	/** arena block growths and overflow chunks since output creation */
+	uint64_t total_arena_mallocs;
+};
+
 /** Content producer for heads
  *
  * \rst
@@ -298,6 +327,14 @@ struct weston_output {
 	 */
 	struct wl_list paint_node_z_order_list;
 
+	/** weston_compositor::view_list_serial the z-order list was built
+	 *  from; the list is rebuilt when this no longer matches. */
+	uint32_t z_order_list_serial;
+
+	/** Frame callbacks of occluded surfaces were held back in the last
+	 *  repaint */
+	bool frame_callbacks_throttled;
+
 	/** Output area in global coordinates, simple rect */
 	pixman_region32_t region;
 
@@ -320,6 +357,31 @@ struct weston_output {
 	 *  next repaint should be run */
 	struct timespec next_repaint;
 
+	/** How long before the predicted vblank next_repaint was set, in
+	 *  nanoseconds. This is weston_compositor::repaint_msec, or less
+	 *  when weston_compositor::repaint_window_adaptive is set. */
+	int64_t repaint_window_nsec;
+
+	/** Durations of recent repaints, from the start of the repaint
+	 *  cycle until the backend flushed it or the renderer reported GPU
+	 *  completion, whichever came last, in nanoseconds */
+	struct {
+		int64_t nsec[WESTON_REPAINT_HISTORY_LENGTH];
+		/** Start of the repaint cycle of each entry */
+		struct timespec start[WESTON_REPAINT_HISTORY_LENGTH];
+		/** Repaint sequence number of each entry */
+		uint64_t seq[WESTON_REPAINT_HISTORY_LENGTH];
+		unsigned int count;
+		unsigned int next;
+		/** Sequence number of the repaint in progress, or of the
+		 *  last one when none is */
+		uint64_t current_seq;
+	} repaint_history;
+
+	/** Scratch memory for allocations that live for one repaint,
+	 *  see weston_output_frame_alloc() */
+	struct weston_frame_arena frame_arena;
+
 	/** For cancelling the idle_repaint callback on output destruction. */
 	struct wl_event_source *idle_repaint_source;
 
@@ -934,11 +996,36 @@ struct weston_plane {
 
 struct weston_drm_format_array;
 
+/** Completion of weston_renderer::read_pixels_async
+ *
+ * \param data The data given to read_pixels_async.
+ * \param pixels The pixels, laid out as read_pixels would write them, or
+ * NULL if reading failed. Only valid for the duration of the call.
+ */
+typedef void (*weston_renderer_read_pixels_done_func_t)(void *data,
+							 const void *pixels);
+
 struct weston_renderer {
 	int (*read_pixels)(struct weston_output *output,
 			       pixman_format_code_t format, void *pixels,
 			       uint32_t x, uint32_t y,
 			       uint32_t width, uint32_t height);
+
+	/** Like read_pixels, but without waiting for rendering to finish
+	 *
+	 * Queues the read and returns. done is called from the event loop
+	 * once the pixels are available, never from within this call, so
+	 * done may queue the next read. Reads on the same output complete
+	 * in the order they were queued. Returns -1 without calling done on
+	 * failure. Optional, may be NULL.
+	 */
+	int (*read_pixels_async)(struct weston_output *output,
+				 pixman_format_code_t format,
+				 uint32_t x, uint32_t y,
+				 uint32_t width, uint32_t height,
+				 weston_renderer_read_pixels_done_func_t done,
+				 void *data);
+
 	void (*repaint_output)(struct weston_output *output,
 			       pixman_region32_t *output_damage);
 	void (*flush_damage)(struct weston_surface *surface);
@@ -1099,6 +1186,29 @@ struct weston_compositor {
 	struct wl_list seat_list;
 	struct wl_list layer_list;	/* struct weston_layer::link */
 	struct wl_list view_list;	/* struct weston_view::link */
+
+	/* Set by changes to layers, layer entries, view mapping and
+	 * sub-surface stacking; view_list is only rebuilt when set.
+	 * view_list_serial is bumped on each rebuild. */
+	bool view_list_dirty;
+	uint32_t view_list_serial;
+
+	/* Views marked by weston_view_geometry_dirty(), updated together
+	 * before repaint; struct weston_view::transform.dirty_link */
+	struct wl_list transform_dirty_list;
+
+	/* Uniform grid over the bounding boxes of view_list, used by
+	 * weston_compositor_pick_view(). Each cell holds the views
+	 * overlapping it in view_list order; rebuilt lazily when dirty. */
+	struct {
+		bool dirty;
+		int32_t x, y;		/* grid origin, global coordinates */
+		int32_t cell_width, cell_height;
+		int32_t columns, rows;
+		struct wl_array cells;	/* uint32_t, columns * rows + 1 */
+		struct wl_array views;	/* struct weston_view * */
+	} pick_grid;
+
 	struct wl_list plane_list;
 	struct wl_list key_binding_list;
 	struct wl_list modifier_binding_list;
@@ -1113,6 +1223,11 @@ struct weston_compositor {
 	int idle_time;			/* timeout, s */
 	struct wl_event_source *repaint_timer;
 
+	/* Minimum interval between frame callbacks of surfaces that are
+	 * fully occluded, in milliseconds; 0 disables throttling. */
+	uint32_t occluded_frame_interval_msec;
+	struct wl_event_source *frame_throttle_timer;
+
 	const struct weston_pointer_grab_interface *default_pointer_grab;
 
 	/* Repaint state. */
@@ -1141,6 +1256,18 @@ struct weston_compositor {
 
 	clockid_t presentation_clock;
 	int32_t repaint_msec;
+	/* Shrink repaint_msec per output to fit measured repaint times */
+	bool repaint_window_adaptive;
+
+	/* Surface and output damage with more rectangles than this is
+	 * merged into fewer, larger boxes; 0 disables simplification.
+	 * Replacing the damage by its extents is allowed when that adds
+	 * at most damage_max_waste (0..1) of the extents' area. */
+	int32_t damage_max_rects;
+	double damage_max_waste;
+	/* Number of frames of output damage renderers keep to redraw only
+	 * the changed parts of older buffers, see EGL_EXT_buffer_age */
+	int32_t damage_history;
 	struct timespec last_repaint_start;
 
 	unsigned int activate_serial;
@@ -1322,6 +1449,8 @@ struct weston_view {
 	 */
 	struct {
 		int dirty;
+		/* weston_compositor::transform_dirty_list, while dirty */
+		struct wl_list dirty_link;
 
 		/* Approximations in global coordinates:
 		 * - boundingbox is guaranteed to include the whole view in
@@ -1480,6 +1609,12 @@ struct weston_surface {
 	struct wl_list frame_callback_list;
 	struct wl_list feedback_list;
 
+	/* Frame callback throttling while fully occluded, see
+	 * weston_compositor_set_occluded_frame_interval() */
+	struct timespec frame_callback_time;	/* last wl_callback.done */
+	struct timespec frame_throttle_time;	/* last throttled repaint */
+	uint32_t frame_callbacks_throttled;	/* repaints held back */
+
 	struct weston_buffer_reference buffer_ref;
 	struct weston_buffer_viewport buffer_viewport;
 	int32_t width_from_buffer; /* before applying viewport */
@@ -1862,6 +1997,9 @@ weston_compositor_exit(struct weston_compositor *ec);
 void *
 weston_compositor_get_user_data(struct weston_compositor *compositor);
 void
+weston_compositor_set_occluded_frame_interval(struct weston_compositor *compositor,
+					      uint32_t msec);
+void
 weston_compositor_exit_with_code(struct weston_compositor *compositor,
 				 int exit_code);
 void
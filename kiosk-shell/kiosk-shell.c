@@ -1084,7 +1084,9 @@ wet_shell_init(struct weston_compositor *ec,
 	struct kiosk_shell *shell;
 	struct weston_seat *seat;
 	struct weston_output *output;
+	struct weston_config_section *section;
 	const char *config_file;
+	uint32_t occluded_frame_interval;
 
 	shell = zalloc(sizeof *shell);
 	if (shell == NULL)
@@ -1105,6 +1107,12 @@ wet_shell_init(struct weston_compositor *ec,
 	config_file = weston_config_get_name_from_env();
 	shell->config = weston_config_parse(config_file);
 
+	section = weston_config_get_section(shell->config, "shell", NULL, NULL);
+	weston_config_section_get_uint(section, "occluded-frame-interval",
+				       &occluded_frame_interval, 0);
+	weston_compositor_set_occluded_frame_interval(ec,
+						      occluded_frame_interval);
+
 	weston_layer_init(&shell->background_layer, ec);
 	weston_layer_init(&shell->normal_layer, ec);
 
@@ -269,6 +269,12 @@ struct drm_backend {
 	bool sprites_are_broken;
 	bool cursors_are_broken;
 
+#if TEST_DRM_PLANE_LIMIT
+	/* TEST_ONLY commits enabling more planes are rejected, -1 for no
+	 * limit; see WESTON_DRM_TEST_MAX_PLANES */
+	int32_t test_max_planes;
+#endif
+
 	bool atomic_modeset;
 
 	bool use_pixman;
@@ -288,6 +294,14 @@ struct drm_backend {
 	bool fb_modifiers;
 
 	struct weston_log_scope *debug;
+	struct weston_log_scope *flip_stats_scope;
+
+	/* TEST_ONLY commits issued so far, see drm_pending_state_test() */
+	uint32_t test_commit_count;
+
+	/* framebuffers kept on client dmabufs, see drm_fb_get_from_dmabuf() */
+	struct wl_list dmabuf_fb_list;
+	uint32_t dmabuf_fb_hits, dmabuf_fb_misses;
 };
 
 struct drm_mode {
@@ -319,8 +333,6 @@ struct drm_fb {
 	uint64_t modifier;
 	int width, height;
 	int fd;
-	struct weston_buffer_reference buffer_ref;
-	struct weston_buffer_release_reference buffer_release_ref;
 
 	/* Used by gbm fbs */
 	struct gbm_bo *bo;
@@ -390,6 +402,9 @@ struct drm_plane_state {
 	struct drm_output_state *output_state;
 
 	struct drm_fb *fb;
+	/* the client buffer scanned out from fb, if any */
+	struct weston_buffer_reference buffer_ref;
+	struct weston_buffer_release_reference buffer_release_ref;
 
 	struct weston_view *ev; /**< maintained for drm_assign_planes only */
 
@@ -496,6 +511,47 @@ struct drm_crtc {
 	struct drm_property_info props_crtc[WDRM_CRTC__COUNT];
 };
 
+enum drm_output_propose_state_mode {
+	DRM_OUTPUT_PROPOSE_STATE_MIXED, /**< mix renderer & planes */
+	DRM_OUTPUT_PROPOSE_STATE_RENDERER_ONLY, /**< only assign to renderer & cursor */
+	DRM_OUTPUT_PROPOSE_STATE_PLANES_ONLY, /**< no renderer use, only planes */
+};
+
+/* quarters of a refresh period, the last one also counts later flips */
+#define DRM_FLIP_LATENCY_BUCKETS 8
+
+/**
+ * Time from committing an output state to its flip event
+ *
+ * This is the slack the commit had before the vblank it made; a latency
+ * of more than a refresh period means it missed the vblank it aimed at.
+ */
+struct drm_flip_stats {
+	struct timespec commit_time; /**< zero when no flip is awaited */
+	uint32_t flips;
+	uint32_t missed_vblanks;
+	int64_t latency_sum_nsec;
+	uint32_t latency_hist[DRM_FLIP_LATENCY_BUCKETS];
+};
+
+/**
+ * The last plane assignment of an output that passed its atomic test
+ *
+ * While the views on the output, their buffers and geometry stay the
+ * same, drm_assign_planes() proposes the same assignment again and tests
+ * it once, instead of searching for one with a test per candidate plane.
+ */
+struct drm_plane_cache {
+	bool valid;
+	enum drm_output_propose_state_mode mode;
+	struct weston_mode *output_mode;
+	struct wl_array entries; /* struct drm_plane_cache_entry */
+	/* drm_output_propose_state() follows the entries */
+	bool replaying;
+	/* a replayed view did not get the plane it had in the entries */
+	bool replay_missed;
+};
+
 struct drm_output {
 	struct weston_output base;
 	struct drm_backend *backend;
@@ -537,6 +593,10 @@ struct drm_output {
 
 	struct wl_event_source *pageflip_timer;
 
+	struct drm_flip_stats flip_stats;
+
+	struct drm_plane_cache plane_cache;
+
 	bool virtual;
 
 	submit_frame_cb virtual_submit_frame;
@@ -672,6 +732,10 @@ drm_output_set_gamma(struct weston_output *output_base,
 void
 drm_output_update_msc(struct drm_output *output, unsigned int seq);
 void
+drm_output_flip_stats_commit(struct drm_output *output);
+void
+drm_flip_stats_subscribe(struct weston_log_subscription *sub, void *data);
+void
 drm_output_update_complete(struct drm_output *output, uint32_t flags,
 			   unsigned int sec, unsigned int usec);
 int
@@ -698,6 +762,8 @@ drm_fb_get_from_view(struct drm_output_state *state, struct weston_view *ev);
 extern bool
 drm_can_scanout_dmabuf(struct weston_compositor *ec,
 		       struct linux_dmabuf_buffer *dmabuf);
+void
+drm_fb_release_dmabuf_fbs(struct drm_backend *b);
 #else
 static inline struct drm_fb *
 drm_fb_get_from_view(struct drm_output_state *state, struct weston_view *ev)
@@ -710,6 +776,10 @@ drm_can_scanout_dmabuf(struct weston_compositor *ec,
 {
 	return false;
 }
+static inline void
+drm_fb_release_dmabuf_fbs(struct drm_backend *b)
+{
+}
 #endif
 
 struct drm_pending_state *
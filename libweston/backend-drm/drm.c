@@ -641,8 +641,15 @@ drm_repaint_flush(struct weston_compositor *compositor, void *repaint_data)
 {
 	struct drm_backend *b = to_drm_backend(compositor);
 	struct drm_pending_state *pending_state = repaint_data;
+	struct drm_output_state *output_state;
 	int ret;
 
+	wl_list_for_each(output_state, &pending_state->output_list, link) {
+		if (output_state->dpms == WESTON_DPMS_ON &&
+		    !output_state->output->virtual)
+			drm_output_flip_stats_commit(output_state->output);
+	}
+
 	ret = drm_pending_state_apply(pending_state);
 	if (ret != 0)
 		weston_log("repaint-flush failed: %s\n", strerror(errno));
@@ -1808,6 +1815,8 @@ drm_output_destroy(struct weston_output *base)
 	assert(!output->state_last);
 	drm_output_state_free(output->state_cur);
 
+	wl_array_release(&output->plane_cache.entries);
+
 	free(output);
 }
 
@@ -2161,6 +2170,8 @@ drm_output_create(struct weston_compositor *compositor, const char *name)
 
 	output->state_cur = drm_output_state_alloc(output, NULL);
 
+	wl_array_init(&output->plane_cache.entries);
+
 	weston_compositor_add_pending_output(&output->base, b->compositor);
 
 	return &output->base;
@@ -2495,6 +2506,8 @@ drm_destroy(struct weston_compositor *ec)
 
 	weston_log_scope_destroy(b->debug);
 	b->debug = NULL;
+	weston_log_scope_destroy(b->flip_stats_scope);
+	b->flip_stats_scope = NULL;
 	weston_compositor_shutdown(ec);
 
 	wl_list_for_each_safe(crtc, crtc_tmp, &b->crtc_list, link)
@@ -2507,6 +2520,8 @@ drm_destroy(struct weston_compositor *ec)
 			      &b->writeback_connector_list, link)
 		drm_writeback_destroy(writeback);
 
+	drm_fb_release_dmabuf_fbs(b);
+
 #ifdef BUILD_DRM_GBM
 	if (b->gbm)
 		gbm_device_destroy(b->gbm);
@@ -2935,10 +2950,17 @@ drm_backend_create(struct weston_compositor *compositor,
 	b->use_pixman = config->use_pixman;
 	b->pageflip_timeout = config->pageflip_timeout;
 	b->use_pixman_shadow = config->use_pixman_shadow;
+	wl_list_init(&b->dmabuf_fb_list);
 
 	b->debug = weston_compositor_add_log_scope(compositor, "drm-backend",
 						   "Debug messages from DRM/KMS backend\n",
 						   NULL, NULL, NULL);
+	b->flip_stats_scope =
+		weston_compositor_add_log_scope(compositor, "drm-flip-stats",
+						"Commit to page flip latency and "
+						"missed vblanks per output\n",
+						drm_flip_stats_subscribe, NULL,
+						b);
 
 	compositor->backend = &b->base;
 
@@ -48,8 +48,6 @@ drm_fb_destroy(struct drm_fb *fb)
 {
 	if (fb->fb_id != 0)
 		drmModeRmFB(fb->fd, fb->fb_id);
-	weston_buffer_reference(&fb->buffer_ref, NULL);
-	weston_buffer_release_reference(&fb->buffer_release_ref, NULL);
 	free(fb);
 }
 
@@ -219,8 +217,8 @@ drm_fb_destroy_dmabuf(struct drm_fb *fb)
 }
 
 static struct drm_fb *
-drm_fb_get_from_dmabuf(struct linux_dmabuf_buffer *dmabuf,
-		       struct drm_backend *backend, bool is_opaque)
+drm_fb_import_dmabuf(struct linux_dmabuf_buffer *dmabuf,
+		     struct drm_backend *backend, bool is_opaque)
 {
 #ifndef HAVE_GBM_FD_IMPORT
 	/* Importing a buffer to KMS requires explicit modifiers, so
@@ -324,6 +322,93 @@ err_free:
 #endif
 }
 
+/**
+ * The framebuffers imported from a client dmabuf
+ *
+ * Clients cycle through a small swapchain, so the import is kept as
+ * backend data of the dmabuf until the client destroys it, instead of
+ * importing the buffer and adding a KMS framebuffer on every repaint.
+ */
+struct drm_dmabuf_fb {
+	struct drm_backend *backend;
+	struct linux_dmabuf_buffer *dmabuf;
+	struct wl_list link; /* drm_backend::dmabuf_fb_list */
+
+	/* indexed by is_opaque, which may substitute the format */
+	struct drm_fb *fb[2];
+	bool import_failed[2];
+};
+
+static void
+drm_dmabuf_fb_destroy(struct drm_dmabuf_fb *dmabuf_fb)
+{
+	/* Plane states still scanning out the framebuffers hold their
+	 * own references. */
+	drm_fb_unref(dmabuf_fb->fb[0]);
+	drm_fb_unref(dmabuf_fb->fb[1]);
+	linux_dmabuf_buffer_set_backend_user_data(dmabuf_fb->dmabuf,
+						  NULL, NULL);
+	wl_list_remove(&dmabuf_fb->link);
+	free(dmabuf_fb);
+}
+
+static void
+drm_dmabuf_fb_handle_destroy(struct linux_dmabuf_buffer *dmabuf)
+{
+	drm_dmabuf_fb_destroy(linux_dmabuf_buffer_get_backend_user_data(dmabuf));
+}
+
+static struct drm_fb *
+drm_fb_get_from_dmabuf(struct linux_dmabuf_buffer *dmabuf,
+		       struct drm_backend *backend, bool is_opaque)
+{
+	struct drm_dmabuf_fb *dmabuf_fb;
+	struct drm_fb *fb;
+
+	dmabuf_fb = linux_dmabuf_buffer_get_backend_user_data(dmabuf);
+	if (dmabuf_fb && (dmabuf_fb->fb[is_opaque] ||
+			  dmabuf_fb->import_failed[is_opaque])) {
+		backend->dmabuf_fb_hits++;
+		fb = dmabuf_fb->fb[is_opaque];
+		return fb ? drm_fb_ref(fb) : NULL;
+	}
+
+	if (!dmabuf_fb) {
+		dmabuf_fb = zalloc(sizeof *dmabuf_fb);
+		if (!dmabuf_fb)
+			return drm_fb_import_dmabuf(dmabuf, backend, is_opaque);
+
+		dmabuf_fb->backend = backend;
+		dmabuf_fb->dmabuf = dmabuf;
+		wl_list_insert(&backend->dmabuf_fb_list, &dmabuf_fb->link);
+		linux_dmabuf_buffer_set_backend_user_data(dmabuf, dmabuf_fb,
+							  drm_dmabuf_fb_handle_destroy);
+	}
+
+	backend->dmabuf_fb_misses++;
+	drm_debug(backend, "[dmabuf] importing dmabuf %p\n", dmabuf);
+
+	/* the cache keeps the reference returned by the import */
+	fb = drm_fb_import_dmabuf(dmabuf, backend, is_opaque);
+	dmabuf_fb->fb[is_opaque] = fb;
+	dmabuf_fb->import_failed[is_opaque] = !fb;
+
+	return fb ? drm_fb_ref(fb) : NULL;
+}
+
+/**
+ * Drop the framebuffers kept on client dmabufs, before the GBM device
+ * they were imported into goes away.
+ */
+void
+drm_fb_release_dmabuf_fbs(struct drm_backend *b)
+{
+	struct drm_dmabuf_fb *dmabuf_fb, *tmp;
+
+	wl_list_for_each_safe(dmabuf_fb, tmp, &b->dmabuf_fb_list, link)
+		drm_dmabuf_fb_destroy(dmabuf_fb);
+}
+
 struct drm_fb *
 drm_fb_get_from_bo(struct gbm_bo *bo, struct drm_backend *backend,
 		   bool is_opaque, enum drm_fb_type type)
@@ -402,16 +487,6 @@ err_free:
 	return NULL;
 }
 
-static void
-drm_fb_set_buffer(struct drm_fb *fb, struct weston_buffer *buffer,
-		  struct weston_buffer_release *buffer_release)
-{
-	assert(fb->buffer_ref.buffer == NULL);
-	assert(fb->type == BUFFER_CLIENT || fb->type == BUFFER_DMABUF);
-	weston_buffer_reference(&fb->buffer_ref, buffer);
-	weston_buffer_release_reference(&fb->buffer_release_ref,
-					buffer_release);
-}
 #endif
 
 void
@@ -517,8 +592,6 @@ drm_fb_get_from_view(struct drm_output_state *state, struct weston_view *ev)
 
 	drm_debug(b, "\t\t\t[view] view %p format: %s\n",
 		  ev, fb->format->drm_format_name);
-	drm_fb_set_buffer(fb, buffer,
-			  ev->surface->buffer_release_ref.buffer_release);
 	return fb;
 }
 #endif
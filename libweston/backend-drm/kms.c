@@ -29,6 +29,7 @@
 
 #include "config.h"
 
+#include <inttypes.h>
 #include <stdint.h>
 
 #include <xf86drm.h>
@@ -37,10 +38,13 @@
 #include <libweston/libweston.h>
 #include <libweston/backend-drm.h>
 #include "shared/helpers.h"
+#include "shared/string-helpers.h"
+#include "shared/timespec-util.h"
 #include "shared/weston-drm-fourcc.h"
 #include "drm-internal.h"
 #include "pixel-formats.h"
 #include "presentation-time-server-protocol.h"
+#include "timeline.h"
 
 struct drm_property_enum_info plane_type_enums[] = {
 	[WDRM_PLANE_TYPE_PRIMARY] = {
@@ -1192,6 +1196,40 @@ out:
 	return ret;
 }
 
+#if TEST_DRM_PLANE_LIMIT
+/**
+ * Models a device that can only scan out a limited number of planes at
+ * once, so plane assignment fallbacks can be exercised on devices such as
+ * VKMS which accept any plane configuration. Only built for the test suite.
+ */
+static bool
+drm_pending_state_exceeds_plane_limit(struct drm_pending_state *pending_state)
+{
+	struct drm_backend *b = pending_state->backend;
+	struct drm_output_state *output_state;
+	struct drm_plane_state *plane_state;
+	int32_t n_planes = 0;
+
+	if (b->test_max_planes < 0)
+		return false;
+
+	wl_list_for_each(output_state, &pending_state->output_list, link) {
+		wl_list_for_each(plane_state, &output_state->plane_list, link) {
+			if (plane_state->fb &&
+			    plane_state->plane->type != WDRM_PLANE_TYPE_CURSOR)
+				n_planes++;
+		}
+	}
+
+	if (n_planes <= b->test_max_planes)
+		return false;
+
+	drm_debug(b, "\t\t[atomic] rejecting test commit with %d planes, "
+		     "limit is %d\n", n_planes, b->test_max_planes);
+	return true;
+}
+#endif
+
 /**
  * Tests a pending state, to see if the kernel will accept the update as
  * constructed.
@@ -1215,9 +1253,15 @@ drm_pending_state_test(struct drm_pending_state *pending_state)
 {
 	struct drm_backend *b = pending_state->backend;
 
-	if (b->atomic_modeset)
+	if (b->atomic_modeset) {
+		b->test_commit_count++;
+#if TEST_DRM_PLANE_LIMIT
+		if (drm_pending_state_exceeds_plane_limit(pending_state))
+			return -1;
+#endif
 		return drm_pending_state_apply_atomic(pending_state,
 						      DRM_STATE_TEST_ONLY);
+	}
 
 	/* We have no way to test state before application on the legacy
 	 * modesetting API, so just claim it succeeded. */
@@ -1347,6 +1391,108 @@ drm_output_update_msc(struct drm_output *output, unsigned int seq)
 	output->base.msc = (msc_hi << 32) + seq;
 }
 
+/**
+ * Stamp the commit of an output state whose flip event is awaited
+ *
+ * Called from drm_repaint_flush(), just before the pending state is
+ * applied.
+ */
+void
+drm_output_flip_stats_commit(struct drm_output *output)
+{
+	struct weston_compositor *ec = output->base.compositor;
+
+	weston_compositor_read_presentation_clock(ec,
+						  &output->flip_stats.commit_time);
+	TL_POINT(ec, "drm_commit", TLP_OUTPUT(&output->base), TLP_END);
+}
+
+static void
+drm_output_flip_stats_record(struct drm_output *output,
+			     unsigned int sec, unsigned int usec)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_flip_stats *stats = &output->flip_stats;
+	struct timespec flip_time, target;
+	int64_t refresh_nsec, latency_nsec;
+	uint32_t missed;
+	int bucket;
+
+	if (timespec_is_zero(&stats->commit_time))
+		return;
+
+	flip_time.tv_sec = sec;
+	flip_time.tv_nsec = usec * 1000;
+	latency_nsec = timespec_sub_to_nsec(&flip_time, &stats->commit_time);
+	refresh_nsec = millihz_to_nsec(output->base.current_mode->refresh);
+	stats->commit_time.tv_sec = 0;
+	stats->commit_time.tv_nsec = 0;
+
+	if (latency_nsec < 0 || refresh_nsec <= 0)
+		return;
+
+	missed = latency_nsec / refresh_nsec;
+	bucket = MIN(latency_nsec * 4 / refresh_nsec,
+		     DRM_FLIP_LATENCY_BUCKETS - 1);
+
+	stats->flips++;
+	stats->missed_vblanks += missed;
+	stats->latency_sum_nsec += latency_nsec;
+	stats->latency_hist[bucket]++;
+
+	TL_POINT(output->base.compositor, "drm_flip",
+		 TLP_OUTPUT(&output->base), TLP_VBLANK(&flip_time), TLP_END);
+
+	if (missed > 0) {
+		/* the vblank the commit was in time for */
+		timespec_add_nsec(&target, &flip_time,
+				  -(int64_t) missed * refresh_nsec);
+		TL_POINT(output->base.compositor, "drm_flip_missed_vblank",
+			 TLP_OUTPUT(&output->base), TLP_DEADLINE(&target),
+			 TLP_END);
+	}
+
+	if (weston_log_scope_is_enabled(b->flip_stats_scope)) {
+		weston_log_scope_printf(b->flip_stats_scope,
+					"%s: msc %"PRIu64", commit to flip "
+					"%"PRId64" us, missed %u vblanks\n",
+					output->base.name, output->base.msc,
+					latency_nsec / 1000, missed);
+	}
+}
+
+/**
+ * Print the flip statistics of every output to a new subscriber of the
+ * drm-flip-stats scope, which then receives a line per flip.
+ */
+void
+drm_flip_stats_subscribe(struct weston_log_subscription *sub, void *data)
+{
+	struct drm_backend *b = data;
+	struct weston_output *base;
+	int i;
+
+	wl_list_for_each(base, &b->compositor->output_list, link) {
+		struct drm_flip_stats *stats = &to_drm_output(base)->flip_stats;
+
+		weston_log_subscription_printf(sub,
+					       "%s: %u flips, %u missed vblanks, "
+					       "mean commit to flip %"PRId64" us\n",
+					       base->name, stats->flips,
+					       stats->missed_vblanks,
+					       stats->flips ?
+					       stats->latency_sum_nsec /
+					       stats->flips / 1000 : 0);
+		weston_log_subscription_printf(sub,
+					       "%s: commit to flip in quarter "
+					       "refreshes:", base->name);
+		for (i = 0; i < DRM_FLIP_LATENCY_BUCKETS; i++)
+			weston_log_subscription_printf(sub, " %u",
+						       stats->latency_hist[i]);
+		weston_log_subscription_printf(sub, "\n");
+	}
+}
+
 static void
 page_flip_handler(int fd, unsigned int frame,
 		  unsigned int sec, unsigned int usec, void *data)
@@ -1358,6 +1504,7 @@ page_flip_handler(int fd, unsigned int frame,
 			 WP_PRESENTATION_FEEDBACK_KIND_HW_CLOCK;
 
 	drm_output_update_msc(output, frame);
+	drm_output_flip_stats_record(output, sec, usec);
 
 	assert(!b->atomic_modeset);
 	assert(output->page_flip_pending);
@@ -1389,6 +1536,7 @@ atomic_flip_handler(int fd, unsigned int frame, unsigned int sec,
 		return;
 
 	drm_output_update_msc(output, frame);
+	drm_output_flip_stats_record(output, sec, usec);
 
 	drm_debug(b, "[atomic][CRTC:%u] flip processing started\n", crtc_id);
 	assert(b->atomic_modeset);
@@ -1420,6 +1568,9 @@ int
 init_kms_caps(struct drm_backend *b)
 {
 	uint64_t cap;
+#if TEST_DRM_PLANE_LIMIT
+	const char *max_planes;
+#endif
 	int ret;
 
 	weston_log("using %s\n", b->drm.filename);
@@ -1484,6 +1635,16 @@ init_kms_caps(struct drm_backend *b)
 	if (!b->atomic_modeset || getenv("WESTON_FORCE_RENDERER"))
 		b->sprites_are_broken = true;
 
+#if TEST_DRM_PLANE_LIMIT
+	max_planes = getenv("WESTON_DRM_TEST_MAX_PLANES");
+	if (max_planes && safe_strtoint(max_planes, &b->test_max_planes) &&
+	    b->test_max_planes >= 0)
+		weston_log("DRM: rejecting test commits with more than %d "
+			   "planes\n", b->test_max_planes);
+	else
+		b->test_max_planes = -1;
+#endif
+
 	ret = drmSetClientCap(b->drm.fd, DRM_CLIENT_CAP_ASPECT_RATIO, 1);
 	b->aspect_ratio_supported = (ret == 0);
 	weston_log("DRM: %s picture aspect ratio\n",
@@ -29,6 +29,8 @@
 
 #include "config.h"
 
+#include <string.h>
+
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
@@ -93,6 +95,9 @@ drm_plane_state_free(struct drm_plane_state *state, bool force)
 
 	if (force || state != state->plane->state_cur) {
 		drm_fb_unref(state->fb);
+		weston_buffer_reference(&state->buffer_ref, NULL);
+		weston_buffer_release_reference(&state->buffer_release_ref,
+						NULL);
 		free(state);
 	}
 }
@@ -117,6 +122,9 @@ drm_plane_state_duplicate(struct drm_output_state *state_output,
 	 */
 	dst->damage_blob_id = 0;
 	wl_list_init(&dst->link);
+	/* The buffer references are taken below, not copied. */
+	memset(&dst->buffer_ref, 0, sizeof dst->buffer_ref);
+	memset(&dst->buffer_release_ref, 0, sizeof dst->buffer_release_ref);
 
 	wl_list_for_each_safe(old, tmp, &state_output->plane_list, link) {
 		/* Duplicating a plane state into the same output state, so
@@ -130,6 +138,9 @@ drm_plane_state_duplicate(struct drm_output_state *state_output,
 	wl_list_insert(&state_output->plane_list, &dst->link);
 	if (src->fb)
 		dst->fb = drm_fb_ref(src->fb);
+	weston_buffer_reference(&dst->buffer_ref, src->buffer_ref.buffer);
+	weston_buffer_release_reference(&dst->buffer_release_ref,
+					src->buffer_release_ref.buffer_release);
 	dst->output_state = state_output;
 	dst->complete = false;
 
@@ -29,6 +29,9 @@
 
 #include "config.h"
 
+#include <stddef.h>
+#include <string.h>
+
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
@@ -42,10 +45,29 @@
 #include "linux-dmabuf.h"
 #include "presentation-time-server-protocol.h"
 
-enum drm_output_propose_state_mode {
-	DRM_OUTPUT_PROPOSE_STATE_MIXED, /**< mix renderer & planes */
-	DRM_OUTPUT_PROPOSE_STATE_RENDERER_ONLY, /**< only assign to renderer & cursor */
-	DRM_OUTPUT_PROPOSE_STATE_PLANES_ONLY, /**< no renderer use, only planes */
+/** A view in struct drm_plane_cache, compared up to plane_id */
+struct drm_plane_cache_entry {
+	struct weston_view *view;
+	uint32_t output_mask;
+	pixman_box32_t bbox;
+	bool transform_enabled;
+	struct weston_matrix matrix;
+	struct weston_buffer_viewport viewport;
+	float alpha;
+	bool is_opaque;
+	bool color_transform;
+	enum weston_hdcp_protection protection;
+
+	/* the buffer attached to the surface */
+	bool has_buffer;
+	bool is_shm;
+	uint32_t format;
+	uint64_t modifier;
+	int32_t width, height;
+	bool has_acquire_fence;
+
+	/* the plane the view was assigned to, 0 for the renderer */
+	uint32_t plane_id;
 };
 
 static const char *const drm_output_propose_state_mode_as_string[] = {
@@ -63,6 +85,144 @@ drm_propose_state_mode_to_string(enum drm_output_propose_state_mode mode)
 	return drm_output_propose_state_mode_as_string[mode];
 }
 
+/* The views drm_output_propose_state() considers for planes */
+static bool
+drm_plane_cache_view_is_candidate(struct drm_output *output,
+				  struct weston_paint_node *pnode)
+{
+	return (pnode->view->output_mask & (1u << output->base.id)) &&
+	       pnode->surf_xform_valid &&
+	       !pnode->is_fully_occluded;
+}
+
+static void
+drm_plane_cache_entry_init(struct drm_plane_cache_entry *entry,
+			   struct weston_paint_node *pnode)
+{
+	struct weston_view *ev = pnode->view;
+	struct weston_surface *surface = ev->surface;
+	struct weston_buffer *buffer = surface->buffer_ref.buffer;
+	struct linux_dmabuf_buffer *dmabuf;
+	struct wl_shm_buffer *shmbuf;
+
+	/* clear the padding, entries are compared with memcmp() */
+	memset(entry, 0, sizeof *entry);
+
+	entry->view = ev;
+	entry->output_mask = ev->output_mask;
+	entry->bbox = *pixman_region32_extents(&ev->transform.boundingbox);
+	entry->transform_enabled = ev->transform.enabled;
+	if (ev->transform.enabled)
+		entry->matrix = ev->transform.matrix;
+	entry->viewport = surface->buffer_viewport;
+	entry->alpha = ev->alpha;
+	entry->is_opaque = weston_view_is_opaque(ev,
+						 &ev->transform.boundingbox);
+	entry->color_transform = pnode->surf_xform.transform != NULL ||
+				 !pnode->surf_xform.identity_pipeline;
+	if (surface->protection_mode == WESTON_SURFACE_PROTECTION_MODE_ENFORCED)
+		entry->protection = surface->desired_protection;
+
+	if (!weston_view_has_valid_buffer(ev))
+		return;
+
+	entry->has_buffer = true;
+	entry->width = buffer->width;
+	entry->height = buffer->height;
+	entry->has_acquire_fence = surface->acquire_fence_fd >= 0;
+
+	shmbuf = wl_shm_buffer_get(buffer->resource);
+	dmabuf = linux_dmabuf_buffer_get(buffer->resource);
+	if (shmbuf) {
+		entry->is_shm = true;
+		entry->format = wl_shm_buffer_get_format(shmbuf);
+	} else if (dmabuf) {
+		entry->format = dmabuf->attributes.format;
+		entry->modifier = dmabuf->attributes.modifier[0];
+	}
+}
+
+/* Whether the scene is the one the cached assignment was made for */
+static bool
+drm_plane_cache_matches(struct drm_output *output)
+{
+	struct drm_plane_cache *cache = &output->plane_cache;
+	struct drm_plane_cache_entry *cached = cache->entries.data;
+	struct drm_plane_cache_entry entry;
+	size_t n = cache->entries.size / sizeof *cached;
+	struct weston_paint_node *pnode;
+	size_t i = 0;
+
+	if (!cache->valid || cache->output_mode != output->base.current_mode)
+		return false;
+
+	wl_list_for_each(pnode, &output->base.paint_node_z_order_list,
+			 z_order_link) {
+		if (!drm_plane_cache_view_is_candidate(output, pnode))
+			continue;
+
+		if (i == n)
+			return false;
+
+		drm_plane_cache_entry_init(&entry, pnode);
+		if (memcmp(&entry, &cached[i++],
+			   offsetof(struct drm_plane_cache_entry, plane_id)) != 0)
+			return false;
+	}
+
+	return i == n;
+}
+
+static void
+drm_plane_cache_store(struct drm_output *output,
+		      struct drm_output_state *state,
+		      enum drm_output_propose_state_mode mode)
+{
+	struct drm_plane_cache *cache = &output->plane_cache;
+	struct drm_plane_cache_entry *entry;
+	struct drm_plane_state *ps;
+	struct weston_paint_node *pnode;
+
+	cache->valid = true;
+	cache->mode = mode;
+	cache->output_mode = output->base.current_mode;
+	cache->entries.size = 0;
+
+	wl_list_for_each(pnode, &output->base.paint_node_z_order_list,
+			 z_order_link) {
+		if (!drm_plane_cache_view_is_candidate(output, pnode))
+			continue;
+
+		entry = wl_array_add(&cache->entries, sizeof *entry);
+		if (!entry) {
+			cache->valid = false;
+			return;
+		}
+
+		drm_plane_cache_entry_init(entry, pnode);
+		wl_list_for_each(ps, &state->plane_list, link) {
+			if (ps->ev == pnode->view && ps->fb) {
+				entry->plane_id = ps->plane->plane_id;
+				break;
+			}
+		}
+	}
+}
+
+/* The plane the cached assignment put a view on, 0 for the renderer */
+static uint32_t
+drm_plane_cache_lookup(struct drm_output *output, struct weston_view *ev)
+{
+	struct drm_plane_cache_entry *entry;
+
+	wl_array_for_each(entry, &output->plane_cache.entries) {
+		if (entry->view == ev)
+			return entry->plane_id;
+	}
+
+	return 0;
+}
+
 static void
 drm_output_add_zpos_plane(struct drm_plane *plane, struct wl_list *planes)
 {
@@ -235,6 +395,10 @@ drm_output_prepare_overlay_view(struct drm_plane *plane,
 	 * calling drm_fb_get_from_view() in drm_output_prepare_plane_view(),
 	 * so, we take another reference here to live within the state. */
 	state->fb = drm_fb_ref(fb);
+	weston_buffer_reference(&state->buffer_ref,
+				ev->surface->buffer_ref.buffer);
+	weston_buffer_release_reference(&state->buffer_release_ref,
+					ev->surface->buffer_release_ref.buffer_release);
 
 	state->in_fence_fd = ev->surface->acquire_fence_fd;
 
@@ -247,6 +411,15 @@ drm_output_prepare_overlay_view(struct drm_plane *plane,
 		goto out;
 	}
 
+	/* When replaying a cached assignment, the whole state is tested
+	 * once at the end instead. */
+	if (output->plane_cache.replaying) {
+		drm_debug(b, "\t\t\t[overlay] provisionally placing "
+			     "view %p on overlay %lu from plane cache\n",
+			  ev, (unsigned long) plane->plane_id);
+		goto out;
+	}
+
 	ret = drm_pending_state_test(output_state->pending_state);
 	if (ret == 0) {
 		drm_debug(b, "\t\t\t[overlay] provisionally placing "
@@ -470,6 +643,10 @@ drm_output_prepare_scanout_view(struct drm_output_state *output_state,
 
 	/* take another reference here to live within the state */
 	state->fb = drm_fb_ref(fb);
+	weston_buffer_reference(&state->buffer_ref,
+				ev->surface->buffer_ref.buffer);
+	weston_buffer_release_reference(&state->buffer_release_ref,
+					ev->surface->buffer_release_ref.buffer_release);
 	state->ev = ev;
 	state->output = output;
 	if (!drm_plane_state_coords_for_view(state, ev, zpos)) {
@@ -649,12 +826,15 @@ drm_output_check_zpos_plane_states(struct drm_output_state *state)
 	}
 }
 
+/* \c view_fb, if not NULL, is the framebuffer already imported from the
+ * view's buffer for this state. */
 static struct drm_plane_state *
 drm_output_prepare_plane_view(struct drm_output_state *state,
 			      struct weston_view *ev,
 			      enum drm_output_propose_state_mode mode,
 			      struct drm_plane_state *scanout_state,
-			      uint64_t current_lowest_zpos)
+			      uint64_t current_lowest_zpos,
+			      struct drm_fb *view_fb)
 {
 	struct drm_output *output = state->output;
 	struct drm_backend *b = to_drm_backend(output->base.compositor);
@@ -667,6 +847,7 @@ drm_output_prepare_plane_view(struct drm_output_state *state,
 	struct weston_buffer *buffer;
 	struct wl_shm_buffer *shmbuf;
 	struct drm_fb *fb;
+	uint32_t cached_plane_id = 0;
 
 	wl_list_init(&zpos_candidate_list);
 
@@ -674,15 +855,27 @@ drm_output_prepare_plane_view(struct drm_output_state *state,
 	if (!weston_view_has_valid_buffer(ev))
 		return ps;
 
+	if (output->plane_cache.replaying) {
+		cached_plane_id = drm_plane_cache_lookup(output, ev);
+		if (cached_plane_id == 0)
+			return ps;
+	}
+
 	buffer = ev->surface->buffer_ref.buffer;
 	shmbuf = wl_shm_buffer_get(buffer->resource);
-	fb = drm_fb_get_from_view(state, ev);
+	if (view_fb)
+		fb = drm_fb_ref(view_fb);
+	else
+		fb = drm_fb_get_from_view(state, ev);
 
 	/* assemble a list with possible candidates */
 	wl_list_for_each(plane, &b->plane_list, link) {
 		if (!drm_plane_is_available(plane, output))
 			continue;
 
+		if (cached_plane_id != 0 && plane->plane_id != cached_plane_id)
+			continue;
+
 		if (drm_output_check_plane_has_view_assigned(plane, state)) {
 			drm_debug(b, "\t\t\t\t[plane] not adding plane %d to"
 				     " candidate list: view already assigned "
@@ -774,10 +967,372 @@ drm_output_prepare_plane_view(struct drm_output_state *state,
 	wl_list_for_each_safe(p_zpos, p_zpos_next, &zpos_candidate_list, link)
 		drm_output_destroy_zpos_plane(p_zpos);
 
+	if (!ps && cached_plane_id != 0)
+		output->plane_cache.replay_missed = true;
+
 	drm_fb_unref(fb);
 	return ps;
 }
 
+/* Views considered by the plane plan, one bit each */
+#define DRM_PLANE_PLAN_MAX_VIEWS 32
+/* Assignments the plane plan evaluates before settling on the best one */
+#define DRM_PLANE_PLAN_MAX_STEPS 4096
+/* TEST_ONLY commits one mixed-mode proposal may spend on overlays */
+#define DRM_PLANE_TEST_BUDGET 16
+
+/**
+ * Which views to offer to overlay planes in mixed mode
+ *
+ * With more candidate views than overlay planes, placing views top-down
+ * as they come can spend planes on small views and leave a large one
+ * below them to the renderer. The plan picks the set of views to offer
+ * by the composition cost they would save, under the same constraint the
+ * proposal loop applies: a view below a renderer view it overlaps cannot
+ * go on a plane.
+ */
+struct drm_plane_plan {
+	int n_views;
+	struct weston_view *views[DRM_PLANE_PLAN_MAX_VIEWS];
+	/* imported while judging the views, handed on to the proposal */
+	struct drm_fb *fb[DRM_PLANE_PLAN_MAX_VIEWS];
+	uint64_t cost[DRM_PLANE_PLAN_MAX_VIEWS];
+	/* higher views overlapping each view */
+	uint32_t overlapped_by[DRM_PLANE_PLAN_MAX_VIEWS];
+	/* views which will be composited whatever the plan */
+	uint32_t renderer;
+	/* views which may use a plane without spending an overlay */
+	uint32_t free;
+	int n_overlays;
+
+	/* search state */
+	uint32_t offered;
+	uint64_t offered_cost;
+	uint32_t best;
+	uint64_t best_cost;
+	int steps;
+};
+
+/* Whether a view could be scanned out from an overlay at all: its buffer
+ * imports as a framebuffer, which rules out wl_shm buffers, and an overlay
+ * takes that format and modifier. The framebuffer, if any, is returned in
+ * \c fb_out for the caller to release. */
+static bool
+drm_plane_plan_view_is_candidate(struct drm_output_state *state,
+				 struct weston_paint_node *pnode,
+				 struct drm_fb **fb_out)
+{
+	struct drm_output *output = state->output;
+	struct drm_backend *b = output->backend;
+	struct weston_view *ev = pnode->view;
+	struct drm_plane *plane;
+	struct drm_fb *fb;
+
+	if (ev->output_mask != (1u << output->base.id))
+		return false;
+
+	if (!weston_view_has_valid_buffer(ev))
+		return false;
+
+	if (pnode->surf_xform.transform != NULL ||
+	    !pnode->surf_xform.identity_pipeline)
+		return false;
+
+	fb = drm_fb_get_from_view(state, ev);
+	*fb_out = fb;
+	if (!fb)
+		return false;
+
+	wl_list_for_each(plane, &b->plane_list, link) {
+		if (plane->type == WDRM_PLANE_TYPE_OVERLAY &&
+		    drm_plane_is_available(plane, output) &&
+		    drm_output_plane_view_has_valid_format(plane, state,
+							   ev, fb))
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * Estimates the renderer work a view takes, relative to copying its
+ * visible pixels once: blending reads the destination back, scaling
+ * filters the source, and YUV content needs a colour conversion.
+ */
+static uint64_t
+drm_plane_plan_view_cost(struct weston_view *ev, pixman_region32_t *visible)
+{
+	struct weston_buffer *buffer = ev->surface->buffer_ref.buffer;
+	struct linux_dmabuf_buffer *dmabuf;
+	const struct pixel_format_info *info;
+	pixman_box32_t *boxes, *extents;
+	uint64_t area = 0;
+	int32_t width, height;
+	int n, i;
+	int weight = 1;
+
+	boxes = pixman_region32_rectangles(visible, &n);
+	for (i = 0; i < n; i++)
+		area += (uint64_t) (boxes[i].x2 - boxes[i].x1) *
+			(boxes[i].y2 - boxes[i].y1);
+
+	if (!weston_view_is_opaque(ev, &ev->transform.boundingbox))
+		weight++;
+
+	width = buffer->width;
+	height = buffer->height;
+	switch (ev->surface->buffer_viewport.buffer.transform) {
+	case WL_OUTPUT_TRANSFORM_90:
+	case WL_OUTPUT_TRANSFORM_270:
+	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
+	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
+		width = buffer->height;
+		height = buffer->width;
+		break;
+	default:
+		break;
+	}
+	extents = pixman_region32_extents(&ev->transform.boundingbox);
+	if (extents->x2 - extents->x1 != width ||
+	    extents->y2 - extents->y1 != height)
+		weight++;
+
+	dmabuf = linux_dmabuf_buffer_get(buffer->resource);
+	if (dmabuf) {
+		info = pixel_format_get_info(dmabuf->attributes.format);
+		if (info && (info->hsub > 1 || info->vsub > 1))
+			weight += 2;
+	}
+
+	return area * weight;
+}
+
+/* The most cost the views from i down could save on the overlays left */
+static uint64_t
+drm_plane_plan_bound(struct drm_plane_plan *plan, int i, int n_left)
+{
+	uint64_t top[DRM_PLANE_PLAN_MAX_VIEWS];
+	uint64_t bound = 0;
+	int n_top = 0;
+	int j, k;
+
+	if (n_left == 0)
+		return 0;
+
+	/* keep the n_left highest costs, sorted in decreasing order */
+	for (; i < plan->n_views; i++) {
+		if ((plan->renderer | plan->free) & (1u << i))
+			continue;
+
+		for (j = n_top; j > 0 && top[j - 1] < plan->cost[i]; j--) {
+			if (j < n_left)
+				top[j] = top[j - 1];
+		}
+		if (j < n_left) {
+			top[j] = plan->cost[i];
+			if (n_top < n_left)
+				n_top++;
+		}
+	}
+
+	for (k = 0; k < n_top; k++)
+		bound += top[k];
+
+	return bound;
+}
+
+static void
+drm_plane_plan_search(struct drm_plane_plan *plan, int i, int n_used,
+		      uint32_t rendered)
+{
+	uint32_t bit;
+
+	if (plan->steps++ >= DRM_PLANE_PLAN_MAX_STEPS)
+		return;
+
+	/* Even the best views left cannot beat the best plan. */
+	if (plan->offered_cost +
+	    drm_plane_plan_bound(plan, i, plan->n_overlays - n_used) <=
+	    plan->best_cost)
+		return;
+
+	if (i == plan->n_views) {
+		if (plan->offered_cost > plan->best_cost) {
+			plan->best_cost = plan->offered_cost;
+			plan->best = plan->offered;
+		}
+		return;
+	}
+
+	bit = 1u << i;
+	if (plan->renderer & bit) {
+		drm_plane_plan_search(plan, i + 1, n_used, rendered | bit);
+		return;
+	}
+
+	if (plan->overlapped_by[i] & rendered) {
+		/* forced to the renderer by a view above it */
+		drm_plane_plan_search(plan, i + 1, n_used, rendered | bit);
+		return;
+	}
+
+	if (plan->free & bit) {
+		drm_plane_plan_search(plan, i + 1, n_used, rendered);
+		return;
+	}
+
+	/* Offering the view first makes the first assignment evaluated the
+	 * one the greedy top-down placement would make. */
+	if (n_used < plan->n_overlays) {
+		plan->offered |= bit;
+		plan->offered_cost += plan->cost[i];
+		drm_plane_plan_search(plan, i + 1, n_used + 1, rendered);
+		plan->offered &= ~bit;
+		plan->offered_cost -= plan->cost[i];
+	}
+
+	drm_plane_plan_search(plan, i + 1, n_used, rendered | bit);
+}
+
+/* Returns false if there is nothing to choose, so that every view may try */
+static bool
+drm_plane_plan_build(struct drm_plane_plan *plan,
+		     struct drm_output_state *state)
+{
+	struct drm_output *output = state->output;
+	struct drm_backend *b = output->backend;
+	pixman_region32_t visible[DRM_PLANE_PLAN_MAX_VIEWS];
+	pixman_region32_t overlap;
+	struct weston_paint_node *pnode;
+	struct drm_plane *plane;
+	int n_candidates = 0;
+	int i, j;
+	bool ret;
+
+	memset(plan, 0, sizeof *plan);
+
+	wl_list_for_each(plane, &b->plane_list, link) {
+		if (plane->type == WDRM_PLANE_TYPE_OVERLAY &&
+		    drm_plane_is_available(plane, output))
+			plan->n_overlays++;
+	}
+
+	wl_list_for_each(pnode, &output->base.paint_node_z_order_list,
+			 z_order_link) {
+		struct weston_view *ev = pnode->view;
+		struct weston_buffer *buffer;
+
+		if (!drm_plane_cache_view_is_candidate(output, pnode))
+			continue;
+
+		/* Views further down are offered as they come. */
+		if (plan->n_views == DRM_PLANE_PLAN_MAX_VIEWS)
+			break;
+
+		i = plan->n_views++;
+		plan->views[i] = ev;
+		plan->fb[i] = NULL;
+		pixman_region32_init(&visible[i]);
+		pixman_region32_intersect(&visible[i],
+					  &ev->transform.boundingbox,
+					  &output->base.region);
+
+		buffer = ev->surface->buffer_ref.buffer;
+		if (drm_plane_plan_view_is_candidate(state, pnode,
+						     &plan->fb[i])) {
+			plan->cost[i] = drm_plane_plan_view_cost(ev,
+								 &visible[i]);
+			n_candidates++;
+		} else if (weston_view_has_valid_buffer(ev) &&
+			   wl_shm_buffer_get(buffer->resource)) {
+			/* may still go on the cursor plane */
+			plan->free |= 1u << i;
+		} else {
+			plan->renderer |= 1u << i;
+		}
+	}
+
+	ret = n_candidates > plan->n_overlays;
+	if (ret) {
+		pixman_region32_init(&overlap);
+		for (i = 0; i < plan->n_views; i++) {
+			for (j = 0; j < i; j++) {
+				pixman_region32_intersect(&overlap,
+							  &visible[i],
+							  &visible[j]);
+				if (pixman_region32_not_empty(&overlap))
+					plan->overlapped_by[i] |= 1u << j;
+			}
+		}
+		pixman_region32_fini(&overlap);
+
+		drm_plane_plan_search(plan, 0, 0, 0);
+		drm_debug(b, "\t\t[plan] offering views 0x%x of %d to %d "
+			     "overlays after %d steps, cost saved %"PRIu64"\n",
+			  plan->best, plan->n_views, plan->n_overlays,
+			  plan->steps, plan->best_cost);
+	}
+
+	for (i = 0; i < plan->n_views; i++)
+		pixman_region32_fini(&visible[i]);
+
+	return ret;
+}
+
+static void
+drm_plane_plan_release(struct drm_plane_plan *plan)
+{
+	int i;
+
+	for (i = 0; i < plan->n_views; i++)
+		drm_fb_unref(plan->fb[i]);
+	plan->n_views = 0;
+}
+
+/* The framebuffer the plan imported from a view's buffer, if any */
+static struct drm_fb *
+drm_plane_plan_fb(struct drm_plane_plan *plan, struct weston_view *ev)
+{
+	int i;
+
+	for (i = 0; i < plan->n_views; i++) {
+		if (plan->views[i] == ev)
+			return plan->fb[i];
+	}
+
+	return NULL;
+}
+
+/* Whether the plan lets a view try the planes */
+static bool
+drm_plane_plan_offers(struct drm_plane_plan *plan, struct weston_view *ev)
+{
+	int i;
+
+	for (i = 0; i < plan->n_views; i++) {
+		if (plan->views[i] == ev)
+			return (plan->renderer & (1u << i)) == 0 &&
+			       ((plan->free | plan->best) & (1u << i)) != 0;
+	}
+
+	return true;
+}
+
+/* Whether the plan spent an overlay on a view */
+static bool
+drm_plane_plan_spends_overlay(struct drm_plane_plan *plan,
+			      struct weston_view *ev)
+{
+	int i;
+
+	for (i = 0; i < plan->n_views; i++) {
+		if (plan->views[i] == ev)
+			return (plan->best & (1u << i)) != 0;
+	}
+
+	return false;
+}
+
 static struct drm_output_state *
 drm_output_propose_state(struct weston_output *output_base,
 			 struct drm_pending_state *pending_state,
@@ -790,16 +1345,21 @@ drm_output_propose_state(struct weston_output *output_base,
 	struct drm_plane_state *scanout_state = NULL;
 
 	pixman_region32_t renderer_region;
-	pixman_region32_t occluded_region;
 
 	bool renderer_ok = (mode != DRM_OUTPUT_PROPOSE_STATE_PLANES_ONLY);
 	int ret;
 	uint64_t current_lowest_zpos = DRM_PLANE_ZPOS_INVALID_PLANE;
+	struct drm_plane_plan plan;
+	bool use_plan = false;
+	/* overlays the plan spent on views which then failed to use them */
+	int plan_spare = 0;
+	uint32_t test_commit_count = b->test_commit_count;
 
 	assert(!output->state_last);
 	state = drm_output_state_duplicate(output->state_cur,
 					   pending_state,
 					   DRM_OUTPUT_STATE_CLEAR_PLANES);
+	plan.n_views = 0;
 
 	/* We implement mixed mode by progressively creating and testing
 	 * incremental states, of scanout + overlay + cursor. Since we
@@ -846,28 +1406,26 @@ drm_output_propose_state(struct weston_output *output_base,
 			  (unsigned long) output->base.id);
 		drm_debug(b, "\t\t[state] scanout will use for zpos %"PRIu64"\n",
 				scanout_state->zpos);
+
+		/* A replayed assignment has already been planned. */
+		if (!output->plane_cache.replaying)
+			use_plan = drm_plane_plan_build(&plan, state);
 	}
 
-	/* - renderer_region contains the total region which which will be
-	 *   covered by the renderer
-	 * - occluded_region contains the total region which which will be
-	 *   covered by the renderer and hardware planes, where the view's
-	 *   visible-and-opaque region is added in both cases (the view's
-	 *   opaque region  accumulates there for each view); it is being used
-	 *   to skip the view, if it is completely occluded; includes the
-	 *   situation where occluded_region covers entire output's region.
-	 */
+	/* renderer_region contains the total region which which will be
+	 * covered by the renderer. Views that are completely occluded by
+	 * the views above them, on any plane, have already been marked by
+	 * the core. */
 	pixman_region32_init(&renderer_region);
-	pixman_region32_init(&occluded_region);
 
 	wl_list_for_each(pnode, &output->base.paint_node_z_order_list,
 			 z_order_link) {
 		struct weston_view *ev = pnode->view;
 		struct drm_plane_state *ps = NULL;
 		bool force_renderer = false;
+		bool reoffered = false;
 		pixman_region32_t clipped_view;
 		pixman_region32_t surface_overlap;
-		bool totally_occluded = false;
 
 		drm_debug(b, "\t\t\t[view] evaluating view %p for "
 		             "output %s (%lu)\n",
@@ -891,25 +1449,18 @@ drm_output_propose_state(struct weston_output *output_base,
 		}
 
 		/* Ignore views we know to be totally occluded. */
+		if (pnode->is_fully_occluded) {
+			drm_debug(b, "\t\t\t\t[view] ignoring view %p "
+			             "(occluded on our output)\n", ev);
+			continue;
+		}
+
 		pixman_region32_init(&clipped_view);
 		pixman_region32_intersect(&clipped_view,
 					  &ev->transform.boundingbox,
 					  &output->base.region);
 
 		pixman_region32_init(&surface_overlap);
-		pixman_region32_subtract(&surface_overlap, &clipped_view,
-					 &occluded_region);
-		/* if the view is completely occluded then ignore that
-		 * view; includes the case where occluded_region covers
-		 * the entire output */
-		totally_occluded = !pixman_region32_not_empty(&surface_overlap);
-		if (totally_occluded) {
-			drm_debug(b, "\t\t\t\t[view] ignoring view %p "
-			             "(occluded on our output)\n", ev);
-			pixman_region32_fini(&surface_overlap);
-			pixman_region32_fini(&clipped_view);
-			continue;
-		}
 
 		/* We only assign planes to views which are exclusively present
 		 * on our output. */
@@ -954,13 +1505,49 @@ drm_output_propose_state(struct weston_output *output_base,
 			force_renderer = true;
 		}
 
+		if (!force_renderer && use_plan &&
+		    !drm_plane_plan_offers(&plan, ev)) {
+			if (plan_spare > 0) {
+				drm_debug(b, "\t\t\t\t[view] offering view %p "
+					     "a plane left unused by the "
+					     "plan\n", ev);
+				reoffered = true;
+			} else {
+				drm_debug(b, "\t\t\t\t[view] not assigning view %p "
+					     "to plane (planes saving more "
+					     "composition are used by other "
+					     "views)\n", ev);
+				force_renderer = true;
+			}
+		}
+
+		if (!force_renderer && mode == DRM_OUTPUT_PROPOSE_STATE_MIXED &&
+		    b->test_commit_count - test_commit_count >=
+		    DRM_PLANE_TEST_BUDGET) {
+			drm_debug(b, "\t\t\t\t[view] not assigning view %p to plane "
+				     "(test commit budget spent)\n", ev);
+			force_renderer = true;
+		}
+
 		/* Now try to place it on a plane if we can. */
 		if (!force_renderer) {
+			struct drm_fb *plan_fb = drm_plane_plan_fb(&plan, ev);
+
 			drm_debug(b, "\t\t\t[plane] started with zpos %"PRIu64"\n",
 				      current_lowest_zpos);
 			ps = drm_output_prepare_plane_view(state, ev, mode,
 							   scanout_state,
-							   current_lowest_zpos);
+							   current_lowest_zpos,
+							   plan_fb);
+
+			/* Pass an overlay the plan chose a view for, but
+			 * which that view could not use, on to the next view
+			 * the plan left out. */
+			if (use_plan && ps && reoffered)
+				plan_spare--;
+			else if (use_plan && !ps && !reoffered &&
+				 drm_plane_plan_spends_overlay(&plan, ev))
+				plan_spare++;
 		}
 
 		if (ps) {
@@ -984,24 +1571,11 @@ drm_output_propose_state(struct weston_output *output_base,
 				     "on the renderer\n", ev);
 		}
 
-		/* Opaque areas of our clipped view occlude areas behind it;
-		 * however, anything not in the opaque region (which is the
-		 * entire clipped area if the whole view is known to be
-		 * opaque) does not necessarily occlude what's behind it, as
-		 * it could be alpha-blended. */
-		if (!weston_view_is_opaque(ev, &clipped_view))
-			pixman_region32_intersect(&clipped_view,
-						  &clipped_view,
-						  &ev->transform.opaque);
-		pixman_region32_union(&occluded_region,
-				      &occluded_region,
-				      &clipped_view);
-
 		pixman_region32_fini(&clipped_view);
 	}
 
+	drm_plane_plan_release(&plan);
 	pixman_region32_fini(&renderer_region);
-	pixman_region32_fini(&occluded_region);
 
 	/* In renderer-only mode, we can't test the state as we don't have a
 	 * renderer buffer yet. */
@@ -1031,8 +1605,8 @@ drm_output_propose_state(struct weston_output *output_base,
 	return state;
 
 err_region:
+	drm_plane_plan_release(&plan);
 	pixman_region32_fini(&renderer_region);
-	pixman_region32_fini(&occluded_region);
 err:
 	drm_output_state_free(state);
 	return NULL;
@@ -1049,11 +1623,45 @@ drm_assign_planes(struct weston_output *output_base, void *repaint_data)
 	struct weston_paint_node *pnode;
 	struct weston_plane *primary = &output_base->compositor->primary_plane;
 	enum drm_output_propose_state_mode mode = DRM_OUTPUT_PROPOSE_STATE_PLANES_ONLY;
+	uint32_t test_commit_count = b->test_commit_count;
+	uint32_t fb_hits = b->dmabuf_fb_hits;
+	uint32_t fb_misses = b->dmabuf_fb_misses;
+	bool cache_hit = false;
 
 	drm_debug(b, "\t[repaint] preparing state for output %s (%lu)\n",
 		  output_base->name, (unsigned long) output_base->id);
 
-	if (!b->sprites_are_broken && !output->virtual) {
+	if (!b->sprites_are_broken && !output->virtual &&
+	    drm_plane_cache_matches(output)) {
+		mode = output->plane_cache.mode;
+		drm_debug(b, "\t[repaint] trying cached %s\n",
+			  drm_propose_state_mode_to_string(mode));
+		output->plane_cache.replaying = true;
+		output->plane_cache.replay_missed = false;
+		state = drm_output_propose_state(output_base, pending_state,
+						 mode);
+		output->plane_cache.replaying = false;
+
+		/* A view that lost its plane went to the renderer instead,
+		 * which the full search may well do better than. */
+		if (state && output->plane_cache.replay_missed) {
+			drm_output_state_free(state);
+			state = NULL;
+		}
+
+		if (state) {
+			cache_hit = true;
+		} else {
+			drm_debug(b, "\t[repaint] cached state failed, "
+				     "searching again\n");
+			output->plane_cache.valid = false;
+			mode = DRM_OUTPUT_PROPOSE_STATE_PLANES_ONLY;
+		}
+	}
+
+	if (b->sprites_are_broken || output->virtual) {
+		drm_debug(b, "\t[state] no overlay plane support\n");
+	} else if (!state) {
 		drm_debug(b, "\t[repaint] trying planes-only build state\n");
 		state = drm_output_propose_state(output_base, pending_state, mode);
 		if (!state) {
@@ -1068,8 +1676,6 @@ drm_assign_planes(struct weston_output *output_base, void *repaint_data)
 			drm_debug(b, "\t[repaint] could not build mixed-mode "
 				     "state, trying renderer-only\n");
 		}
-	} else {
-		drm_debug(b, "\t[state] no overlay plane support\n");
 	}
 
 	if (!state) {
@@ -1079,8 +1685,30 @@ drm_assign_planes(struct weston_output *output_base, void *repaint_data)
 	}
 
 	assert(state);
-	drm_debug(b, "\t[repaint] Using %s composition\n",
-		  drm_propose_state_mode_to_string(mode));
+	drm_debug(b, "\t[repaint] Using %s composition, %u test commits, "
+		     "plane cache %s\n",
+		  drm_propose_state_mode_to_string(mode),
+		  b->test_commit_count - test_commit_count,
+		  cache_hit ? "hit" : "miss");
+
+	fb_hits = b->dmabuf_fb_hits - fb_hits;
+	fb_misses = b->dmabuf_fb_misses - fb_misses;
+	if (fb_hits + fb_misses > 0) {
+		uint64_t total = (uint64_t) b->dmabuf_fb_hits +
+				 b->dmabuf_fb_misses;
+
+		drm_debug(b, "\t[repaint] dmabuf fb cache: %u hits, %u misses, "
+			     "%"PRIu64"%% hit rate since start\n",
+			  fb_hits, fb_misses,
+			  (uint64_t) b->dmabuf_fb_hits * 100 / total);
+	}
+
+	/* Renderer-only is not cached: mixed mode may work once the
+	 * renderer has produced a framebuffer. */
+	if (mode == DRM_OUTPUT_PROPOSE_STATE_RENDERER_ONLY)
+		output->plane_cache.valid = false;
+	else if (!cache_hit)
+		drm_plane_cache_store(output, state, mode);
 
 	wl_list_for_each(pnode, &output->base.paint_node_z_order_list,
 			 z_order_link) {
@@ -32,6 +32,7 @@
 #include <string.h>
 #include <sys/time.h>
 #include <stdbool.h>
+#include <time.h>
 
 #include <libweston/libweston.h>
 #include <libweston/backend-headless.h>
@@ -57,6 +58,7 @@ struct headless_backend {
 
 	struct weston_seat fake_seat;
 	enum headless_renderer_type renderer_type;
+	uint32_t render_cost_usec;
 
 	struct gl_renderer_interface *glri;
 };
@@ -127,9 +129,19 @@ headless_output_repaint(struct weston_output *output_base,
 {
 	struct headless_output *output = to_headless_output(output_base);
 	struct weston_compositor *ec = output->base.compositor;
+	struct headless_backend *b = to_headless_backend(ec);
 
 	ec->renderer->repaint_output(&output->base, damage);
 
+	if (b->render_cost_usec > 0) {
+		struct timespec cost = {
+			.tv_sec = b->render_cost_usec / 1000000,
+			.tv_nsec = (b->render_cost_usec % 1000000) * 1000,
+		};
+
+		nanosleep(&cost, NULL);
+	}
+
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
 
@@ -449,6 +461,8 @@ headless_backend_create(struct weston_compositor *compositor,
 	else
 		b->renderer_type = HEADLESS_NOOP;
 
+	b->render_cost_usec = config->render_cost_usec;
+
 	switch (b->renderer_type) {
 	case HEADLESS_GL:
 		ret = headless_gl_renderer_init(b);
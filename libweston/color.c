@@ -83,6 +83,9 @@ weston_color_transform_init(struct weston_color_transform *xform,
 {
 	xform->cm = cm;
 	xform->ref_count = 1;
+	xform->id = ++cm->last_transform_id;
+	if (xform->id == 0)
+		xform->id = ++cm->last_transform_id;
 	wl_signal_init(&xform->destroy_signal);
 }
 
@@ -100,6 +100,11 @@ struct weston_color_transform {
 	struct weston_color_manager *cm;
 	int ref_count;
 
+	/** Nonzero serial number from the color manager. Unlike the pointer,
+	 *  it does not repeat when a transform is destroyed and a new one is
+	 *  allocated at the same address. */
+	uint32_t id;
+
 	/* for renderer or backend to attach their own cached objects */
 	struct wl_signal destroy_signal;
 
@@ -153,6 +158,9 @@ struct weston_color_manager {
 	/** Supports the Wayland CM&HDR protocol extension? */
 	bool supports_client_protocol;
 
+	/** The last weston_color_transform::id handed out */
+	uint32_t last_transform_id;
+
 	/** Initialize color manager */
 	bool
 	(*init)(struct weston_color_manager *cm);
@@ -86,6 +86,18 @@
 
 #define DEFAULT_REPAINT_WINDOW 7 /* milliseconds */
 
+#define DEFAULT_DAMAGE_MAX_RECTS 32
+#define DEFAULT_DAMAGE_MAX_WASTE 0.25
+#define DEFAULT_DAMAGE_HISTORY 4
+#define DAMAGE_MAX_RECTS_LIMIT 256
+
+/* Adaptive repaint window: the window is the given percentile of the
+ * recent repaint durations plus a margin for timer granularity and
+ * jitter, but never longer than repaint_msec. */
+#define ADAPTIVE_REPAINT_MIN_SAMPLES 8
+#define ADAPTIVE_REPAINT_PERCENTILE 95
+#define ADAPTIVE_REPAINT_MARGIN_NSEC 2000000
+
 static void
 weston_output_update_matrix(struct weston_output *output);
 
@@ -100,6 +112,19 @@ weston_compositor_build_view_list(struct weston_compositor *compositor,
 static char *
 weston_output_create_heads_string(struct weston_output *output);
 
+static int
+frame_throttle_timer_handler(void *data);
+
+static void
+weston_compositor_simplify_damage(struct weston_compositor *compositor,
+				  pixman_region32_t *region);
+
+static void
+weston_frame_arena_init(struct weston_frame_arena *arena);
+
+static void
+weston_frame_arena_reset(struct weston_frame_arena *arena);
+
 static struct weston_paint_node *
 weston_paint_node_create(struct weston_surface *surface,
 			 struct weston_view *view,
@@ -409,6 +434,8 @@ weston_view_create(struct weston_surface *surface)
 	pixman_region32_init(&view->geometry.scissor);
 	pixman_region32_init(&view->transform.boundingbox);
 	view->transform.dirty = 1;
+	wl_list_insert(surface->compositor->transform_dirty_list.prev,
+		       &view->transform.dirty_link);
 
 	return view;
 }
@@ -1614,6 +1641,8 @@ weston_view_update_transform(struct weston_view *view)
 		weston_view_update_transform(parent);
 
 	view->transform.dirty = 0;
+	wl_list_remove(&view->transform.dirty_link);
+	wl_list_init(&view->transform.dirty_link);
 
 	weston_view_damage_below(view);
 
@@ -1645,6 +1674,8 @@ weston_view_update_transform(struct weston_view *view)
 
 	weston_view_damage_below(view);
 
+	view->surface->compositor->pick_grid.dirty = true;
+
 	weston_view_assign_output(view);
 
 	wl_signal_emit(&view->surface->compositor->transform_signal,
@@ -1667,12 +1698,49 @@ weston_view_geometry_dirty(struct weston_view *view)
 		return;
 
 	view->transform.dirty = 1;
+	wl_list_insert(view->surface->compositor->transform_dirty_list.prev,
+		       &view->transform.dirty_link);
 
 	wl_list_for_each(child, &view->geometry.child_list,
 			 geometry.parent_link)
 		weston_view_geometry_dirty(child);
 }
 
+/** Update the transforms of all views with dirty geometry
+ *
+ * Walks the views queued by weston_view_geometry_dirty() once, instead of
+ * checking every view in the scene. weston_view_update_transform() brings
+ * parents up to date before their children and dequeues each view it
+ * updates, so every view is computed once.
+ *
+ * Views that are not in a layer are dropped from the queue but keep their
+ * dirty flag: they are updated lazily, or when a layer insertion rebuilds
+ * the view list.
+ */
+static void
+weston_compositor_update_transforms(struct weston_compositor *compositor)
+{
+	struct weston_view *view;
+	struct wl_list worklist;
+
+	/* Views dirtied by transform listeners wait for the next pass. */
+	wl_list_init(&worklist);
+	wl_list_insert_list(&worklist, &compositor->transform_dirty_list);
+	wl_list_init(&compositor->transform_dirty_list);
+
+	while (!wl_list_empty(&worklist)) {
+		view = wl_container_of(worklist.next, view,
+				       transform.dirty_link);
+
+		if (get_view_layer(view)) {
+			weston_view_update_transform(view);
+		} else {
+			wl_list_remove(&view->transform.dirty_link);
+			wl_list_init(&view->transform.dirty_link);
+		}
+	}
+}
+
 WL_EXPORT void
 weston_view_to_global_fixed(struct weston_view *view,
 			    wl_fixed_t vx, wl_fixed_t vy,
@@ -2155,6 +2223,176 @@ weston_compositor_get_time(struct timespec *time)
 	clock_gettime(CLOCK_REALTIME, time);
 }
 
+#define PICK_GRID_MAX_DIM 32	/* cells per axis */
+#define PICK_GRID_MIN_CELL 64	/* pixels */
+
+static bool
+pick_grid_box_is_empty(const pixman_box32_t *box)
+{
+	return box->x1 >= box->x2 || box->y1 >= box->y2;
+}
+
+static void
+pick_grid_cell_range(struct weston_compositor *compositor,
+		     const pixman_box32_t *box,
+		     int32_t *col1, int32_t *row1,
+		     int32_t *col2, int32_t *row2)
+{
+	int32_t x = compositor->pick_grid.x;
+	int32_t y = compositor->pick_grid.y;
+	int32_t cw = compositor->pick_grid.cell_width;
+	int32_t ch = compositor->pick_grid.cell_height;
+
+	*col1 = (box->x1 - x) / cw;
+	*row1 = (box->y1 - y) / ch;
+	*col2 = (box->x2 - 1 - x) / cw;
+	*row2 = (box->y2 - 1 - y) / ch;
+}
+
+/* Rebuild compositor->pick_grid from the current view_list.
+ *
+ * The cells array is laid out so that cells[i] .. cells[i + 1] index the
+ * views overlapping cell i, in the same top-to-bottom order as view_list.
+ * On allocation failure the grid is left with zero columns, which makes
+ * weston_compositor_pick_view() fall back to walking view_list.
+ */
+static void
+pick_grid_rebuild(struct weston_compositor *compositor)
+{
+	struct weston_view *view;
+	pixman_box32_t extents = { 0, 0, 0, 0 };
+	pixman_box32_t *box;
+	struct weston_view **views;
+	uint32_t *cells;
+	uint32_t n_cells;
+	uint32_t i;
+	int32_t col1, row1, col2, row2;
+	int32_t col, row;
+	int32_t columns, rows;
+	bool have_extents = false;
+
+	compositor->pick_grid.dirty = false;
+	compositor->pick_grid.columns = 0;
+	compositor->pick_grid.rows = 0;
+	compositor->pick_grid.cells.size = 0;
+	compositor->pick_grid.views.size = 0;
+
+	wl_list_for_each(view, &compositor->view_list, link) {
+		box = pixman_region32_extents(&view->transform.boundingbox);
+		if (pick_grid_box_is_empty(box))
+			continue;
+
+		if (!have_extents) {
+			extents = *box;
+			have_extents = true;
+			continue;
+		}
+
+		extents.x1 = MIN(extents.x1, box->x1);
+		extents.y1 = MIN(extents.y1, box->y1);
+		extents.x2 = MAX(extents.x2, box->x2);
+		extents.y2 = MAX(extents.y2, box->y2);
+	}
+
+	if (!have_extents)
+		return;
+
+	compositor->pick_grid.x = extents.x1;
+	compositor->pick_grid.y = extents.y1;
+	compositor->pick_grid.cell_width =
+		MAX(PICK_GRID_MIN_CELL,
+		    (extents.x2 - extents.x1 + PICK_GRID_MAX_DIM - 1) /
+		    PICK_GRID_MAX_DIM);
+	compositor->pick_grid.cell_height =
+		MAX(PICK_GRID_MIN_CELL,
+		    (extents.y2 - extents.y1 + PICK_GRID_MAX_DIM - 1) /
+		    PICK_GRID_MAX_DIM);
+
+	pick_grid_cell_range(compositor, &extents, &col1, &row1, &col2, &row2);
+	columns = col2 + 1;
+	rows = row2 + 1;
+	n_cells = columns * rows;
+
+	cells = wl_array_add(&compositor->pick_grid.cells,
+			     (n_cells + 1) * sizeof *cells);
+	if (!cells)
+		return;
+	memset(cells, 0, (n_cells + 1) * sizeof *cells);
+
+	/* First pass: count the views of each cell i into cells[i + 1]. */
+	wl_list_for_each(view, &compositor->view_list, link) {
+		box = pixman_region32_extents(&view->transform.boundingbox);
+		if (pick_grid_box_is_empty(box))
+			continue;
+
+		pick_grid_cell_range(compositor, box,
+				     &col1, &row1, &col2, &row2);
+		for (row = row1; row <= row2; row++)
+			for (col = col1; col <= col2; col++)
+				cells[row * columns + col + 1]++;
+	}
+
+	for (i = 0; i < n_cells; i++)
+		cells[i + 1] += cells[i];
+
+	views = wl_array_add(&compositor->pick_grid.views,
+			     cells[n_cells] * sizeof *views);
+	if (!views)
+		return;
+
+	/* Second pass: fill in, using cells[i] as the write cursor. */
+	wl_list_for_each(view, &compositor->view_list, link) {
+		box = pixman_region32_extents(&view->transform.boundingbox);
+		if (pick_grid_box_is_empty(box))
+			continue;
+
+		pick_grid_cell_range(compositor, box,
+				     &col1, &row1, &col2, &row2);
+		for (row = row1; row <= row2; row++)
+			for (col = col1; col <= col2; col++)
+				views[cells[row * columns + col]++] = view;
+	}
+
+	/* Each cursor now points at the start of the next cell. */
+	memmove(&cells[1], &cells[0], n_cells * sizeof *cells);
+	cells[0] = 0;
+
+	compositor->pick_grid.columns = columns;
+	compositor->pick_grid.rows = rows;
+}
+
+static bool
+view_accepts_input_at(struct weston_view *view,
+		      wl_fixed_t x, wl_fixed_t y,
+		      wl_fixed_t *vx, wl_fixed_t *vy)
+{
+	wl_fixed_t view_x, view_y;
+	int view_ix, view_iy;
+	int ix = wl_fixed_to_int(x);
+	int iy = wl_fixed_to_int(y);
+
+	if (!pixman_region32_contains_point(&view->transform.boundingbox,
+					    ix, iy, NULL))
+		return false;
+
+	weston_view_from_global_fixed(view, x, y, &view_x, &view_y);
+	view_ix = wl_fixed_to_int(view_x);
+	view_iy = wl_fixed_to_int(view_y);
+
+	if (!pixman_region32_contains_point(&view->surface->input,
+					    view_ix, view_iy, NULL))
+		return false;
+
+	if (view->geometry.scissor_enabled &&
+	    !pixman_region32_contains_point(&view->geometry.scissor,
+					    view_ix, view_iy, NULL))
+		return false;
+
+	*vx = view_x;
+	*vy = view_y;
+	return true;
+}
+
 /** weston_compositor_pick_view
  * \ingroup compositor
  */
@@ -2164,35 +2402,46 @@ weston_compositor_pick_view(struct weston_compositor *compositor,
 			    wl_fixed_t *vx, wl_fixed_t *vy)
 {
 	struct weston_view *view;
-	wl_fixed_t view_x, view_y;
-	int view_ix, view_iy;
+	struct weston_view **views;
+	uint32_t *cells;
+	uint32_t i, cell;
+	int32_t col, row;
 	int ix = wl_fixed_to_int(x);
 	int iy = wl_fixed_to_int(y);
 
+	if (compositor->pick_grid.dirty)
+		pick_grid_rebuild(compositor);
+
 	/* Can't use paint node list: occlusion by input regions, not opaque. */
-	wl_list_for_each(view, &compositor->view_list, link) {
-		if (!pixman_region32_contains_point(
-				&view->transform.boundingbox, ix, iy, NULL))
-			continue;
+	if (compositor->pick_grid.columns == 0) {
+		wl_list_for_each(view, &compositor->view_list, link) {
+			if (view_accepts_input_at(view, x, y, vx, vy))
+				return view;
+		}
+		goto miss;
+	}
 
-		weston_view_from_global_fixed(view, x, y, &view_x, &view_y);
-		view_ix = wl_fixed_to_int(view_x);
-		view_iy = wl_fixed_to_int(view_y);
+	if (ix < compositor->pick_grid.x || iy < compositor->pick_grid.y)
+		goto miss;
 
-		if (!pixman_region32_contains_point(&view->surface->input,
-						    view_ix, view_iy, NULL))
-			continue;
+	col = (ix - compositor->pick_grid.x) /
+	      compositor->pick_grid.cell_width;
+	row = (iy - compositor->pick_grid.y) /
+	      compositor->pick_grid.cell_height;
+	if (col >= compositor->pick_grid.columns ||
+	    row >= compositor->pick_grid.rows)
+		goto miss;
 
-		if (view->geometry.scissor_enabled &&
-		    !pixman_region32_contains_point(&view->geometry.scissor,
-						    view_ix, view_iy, NULL))
-			continue;
+	cells = compositor->pick_grid.cells.data;
+	views = compositor->pick_grid.views.data;
+	cell = row * compositor->pick_grid.columns + col;
 
-		*vx = view_x;
-		*vy = view_y;
-		return view;
+	for (i = cells[cell]; i < cells[cell + 1]; i++) {
+		if (view_accepts_input_at(views[i], x, y, vx, vy))
+			return views[i];
 	}
 
+miss:
 	*vx = wl_fixed_from_int(-1000000);
 	*vy = wl_fixed_from_int(-1000000);
 	return NULL;
@@ -2225,6 +2474,8 @@ weston_view_unmap(struct weston_view *view)
 	weston_layer_entry_remove(&view->layer_link);
 	wl_list_remove(&view->link);
 	wl_list_init(&view->link);
+	view->surface->compositor->view_list_dirty = true;
+	view->surface->compositor->pick_grid.dirty = true;
 	view->output_mask = 0;
 	weston_surface_assign_output(view->surface);
 
@@ -2252,6 +2503,7 @@ weston_surface_unmap(struct weston_surface *surface)
 	struct weston_view *view;
 
 	surface->is_mapped = false;
+	surface->compositor->view_list_dirty = true;
 	wl_list_for_each(view, &surface->views, surface_link)
 		weston_view_unmap(view);
 	surface->output = NULL;
@@ -2287,6 +2539,8 @@ weston_view_destroy(struct weston_view *view)
 
 	wl_list_remove(&view->link);
 	weston_layer_entry_remove(&view->layer_link);
+	view->surface->compositor->view_list_dirty = true;
+	view->surface->compositor->pick_grid.dirty = true;
 
 	pixman_region32_fini(&view->clip);
 	pixman_region32_fini(&view->geometry.scissor);
@@ -2296,6 +2550,7 @@ weston_view_destroy(struct weston_view *view)
 	weston_view_set_transform_parent(view, NULL);
 	weston_view_set_output(view, NULL);
 
+	wl_list_remove(&view->transform.dirty_link);
 	wl_list_remove(&view->surface_link);
 
 	free(view);
@@ -2808,6 +3063,23 @@ view_list_add(struct weston_compositor *compositor,
 	}
 }
 
+/* Rebuild the z-order list of an output from an up-to-date view_list,
+ * which is in the same top-to-bottom order. */
+static void
+output_build_z_order_list(struct weston_output *output)
+{
+	struct weston_compositor *compositor = output->compositor;
+	struct weston_view *view;
+
+	wl_list_remove(&output->paint_node_z_order_list);
+	wl_list_init(&output->paint_node_z_order_list);
+
+	wl_list_for_each(view, &compositor->view_list, link)
+		add_to_z_order_list(output, view_ensure_paint_node(view, output));
+
+	output->z_order_list_serial = compositor->view_list_serial;
+}
+
 static void
 weston_compositor_build_view_list(struct weston_compositor *compositor,
 				  struct weston_output *output)
@@ -2815,6 +3087,20 @@ weston_compositor_build_view_list(struct weston_compositor *compositor,
 	struct weston_view *view, *tmp;
 	struct weston_layer *layer;
 
+	/* Nothing was restacked, mapped or unmapped since the last rebuild:
+	 * only views with dirty geometry need updating, and the z-order
+	 * list of an output can be reused if it was built from this
+	 * view_list. */
+	if (!compositor->view_list_dirty) {
+		weston_compositor_update_transforms(compositor);
+
+		if (output &&
+		    output->z_order_list_serial != compositor->view_list_serial)
+			output_build_z_order_list(output);
+
+		return;
+	}
+
 	if (output) {
 		wl_list_remove(&output->paint_node_z_order_list);
 		wl_list_init(&output->paint_node_z_order_list);
@@ -2827,6 +3113,7 @@ weston_compositor_build_view_list(struct weston_compositor *compositor,
 	wl_list_for_each_safe(view, tmp, &compositor->view_list, link)
 		wl_list_init(&view->link);
 	wl_list_init(&compositor->view_list);
+	compositor->pick_grid.dirty = true;
 
 	wl_list_for_each(layer, &compositor->layer_list, link) {
 		wl_list_for_each(view, &layer->view_list.link, layer_link.link) {
@@ -2837,6 +3124,16 @@ weston_compositor_build_view_list(struct weston_compositor *compositor,
 	wl_list_for_each(layer, &compositor->layer_list, link)
 		wl_list_for_each(view, &layer->view_list.link, layer_link.link)
 			surface_free_unused_subsurface_views(view->surface);
+
+	/* Freeing unused views marks the list dirty again, but they were
+	 * never added to it. */
+	compositor->view_list_dirty = false;
+	compositor->view_list_serial++;
+	if (output)
+		output->z_order_list_serial = compositor->view_list_serial;
+
+	/* Views outside of any layer are left for lazy updates. */
+	weston_compositor_update_transforms(compositor);
 }
 
 static void
@@ -2864,6 +3161,99 @@ weston_output_take_feedback_list(struct weston_output *output,
 	wl_list_init(&surface->feedback_list);
 }
 
+/* Walk the z-order list front to back and mark the paint nodes that cannot
+ * contribute anything to the output, so that plane assignment and the
+ * renderers can skip them without doing their own region math.
+ */
+static void
+output_update_occlusion(struct weston_output *output)
+{
+	struct weston_paint_node *pnode;
+	pixman_region32_t occluded;
+	pixman_region32_t clipped;
+	pixman_region32_t visible;
+	pixman_box32_t *extents;
+
+	pixman_region32_init(&occluded);
+	pixman_region32_init(&clipped);
+	pixman_region32_init(&visible);
+
+	wl_list_for_each(pnode, &output->paint_node_z_order_list,
+			 z_order_link) {
+		struct weston_view *view = pnode->view;
+
+		pixman_region32_intersect(&clipped,
+					  &view->transform.boundingbox,
+					  &output->region);
+		extents = pixman_region32_extents(&clipped);
+
+		if (!pixman_region32_not_empty(&clipped) ||
+		    pixman_region32_contains_rectangle(&occluded, extents) ==
+		    PIXMAN_REGION_IN) {
+			pnode->is_fully_occluded = true;
+			continue;
+		}
+
+		pixman_region32_subtract(&visible, &clipped, &occluded);
+		pnode->is_fully_occluded = !pixman_region32_not_empty(&visible);
+		if (pnode->is_fully_occluded)
+			continue;
+
+		/* Views without a color transform are not shown at all. */
+		if (!pnode->surf_xform_valid)
+			continue;
+
+		/* Only the opaque part of the view occludes what is below. */
+		if (!weston_view_is_opaque(view, &clipped))
+			pixman_region32_intersect(&clipped, &clipped,
+						  &view->transform.opaque);
+		pixman_region32_union(&occluded, &occluded, &clipped);
+	}
+
+	pixman_region32_fini(&visible);
+	pixman_region32_fini(&clipped);
+	pixman_region32_fini(&occluded);
+}
+
+/* Whether to hold back the frame callbacks of a surface in this repaint.
+ *
+ * Surfaces that are fully occluded on every output they have paint nodes
+ * for get at most one wl_callback.done per occluded_frame_interval_msec,
+ * so that hidden clients do not keep rendering at the full refresh rate.
+ */
+static bool
+weston_surface_throttle_frame_callbacks(struct weston_surface *surface,
+					struct weston_output *output)
+{
+	struct weston_compositor *compositor = surface->compositor;
+	struct weston_paint_node *pnode;
+	int64_t msec;
+
+	if (compositor->occluded_frame_interval_msec == 0 ||
+	    wl_list_empty(&surface->frame_callback_list))
+		return false;
+
+	wl_list_for_each(pnode, &surface->paint_node_list, surface_link) {
+		if (!pnode->is_fully_occluded)
+			return false;
+	}
+
+	msec = timespec_sub_to_msec(&output->frame_time,
+				    &surface->frame_callback_time);
+	if (msec < 0 || msec >= compositor->occluded_frame_interval_msec)
+		return false;
+
+	/* Count each repaint once, even for surfaces with several views. */
+	if (!timespec_eq(&surface->frame_throttle_time, &output->frame_time)) {
+		surface->frame_throttle_time = output->frame_time;
+		surface->frame_callbacks_throttled++;
+	}
+
+	output->frame_callbacks_throttled = true;
+
+	return true;
+}
+
 static int
 weston_output_repaint(struct weston_output *output, void *repaint_data)
 {
@@ -2882,8 +3272,11 @@ weston_output_repaint(struct weston_output *output, void *repaint_data)
 
 	TL_POINT(ec, "core_repaint_begin", TLP_OUTPUT(output), TLP_END);
 
+	weston_frame_arena_reset(&output->frame_arena);
+
 	/* Rebuild the surface list and update surface transforms up front. */
 	weston_compositor_build_view_list(ec, output);
+	output_update_occlusion(output);
 
 	/* Find the highest protection desired for an output */
 	wl_list_for_each(pnode, &output->paint_node_z_order_list,
@@ -2915,20 +3308,34 @@ weston_output_repaint(struct weston_output *output, void *repaint_data)
 	}
 
 	wl_list_init(&frame_callback_list);
+	output->frame_callbacks_throttled = false;
 	wl_list_for_each(pnode, &output->paint_node_z_order_list,
 			 z_order_link) {
+		struct weston_surface *surface = pnode->surface;
+
 		/* Note: This operation is safe to do multiple times on the
 		 * same surface.
 		 */
-		if (pnode->surface->output == output) {
-			wl_list_insert_list(&frame_callback_list,
-					    &pnode->surface->frame_callback_list);
-			wl_list_init(&pnode->surface->frame_callback_list);
+		if (surface->output != output)
+			continue;
 
-			weston_output_take_feedback_list(output, pnode->surface);
+		if (!wl_list_empty(&surface->frame_callback_list) &&
+		    !weston_surface_throttle_frame_callbacks(surface, output)) {
+			wl_list_insert_list(&frame_callback_list,
+					    &surface->frame_callback_list);
+			wl_list_init(&surface->frame_callback_list);
+			surface->frame_callback_time = output->frame_time;
 		}
+
+		weston_output_take_feedback_list(output, surface);
 	}
 
+	/* Make sure held back callbacks get sent even if nothing else
+	 * causes a repaint. */
+	if (output->frame_callbacks_throttled)
+		wl_event_source_timer_update(ec->frame_throttle_timer,
+					     ec->occluded_frame_interval_msec);
+
 	output_accumulate_damage(output);
 
 	pixman_region32_init(&output_damage);
@@ -2936,11 +3343,14 @@ weston_output_repaint(struct weston_output *output, void *repaint_data)
 				  &ec->primary_plane.damage, &output->region);
 	pixman_region32_subtract(&output_damage,
 				 &output_damage, &ec->primary_plane.clip);
+	weston_compositor_simplify_damage(ec, &output_damage);
 
 	if (output->dirty)
 		weston_output_update_matrix(output);
 
+	TL_POINT(ec, "core_repaint_render_begin", TLP_OUTPUT(output), TLP_END);
 	r = output->repaint(output, &output_damage, repaint_data);
+	TL_POINT(ec, "core_repaint_render_end", TLP_OUTPUT(output), TLP_END);
 
 	pixman_region32_fini(&output_damage);
 
@@ -3007,6 +3417,7 @@ weston_output_maybe_repaint(struct weston_output *output, struct timespec *now,
 	 * something schedules a successful repaint later. As repainting may
 	 * take some time, re-read our clock as a courtesy to the next
 	 * output. */
+	output->repaint_history.current_seq++;
 	ret = weston_output_repaint(output, repaint_data);
 	weston_compositor_read_presentation_clock(compositor, now);
 	if (ret != 0)
@@ -3020,6 +3431,105 @@ err:
 	return ret;
 }
 
+static void
+weston_output_record_repaint_time(struct weston_output *output,
+				  const struct timespec *start,
+				  int64_t nsec)
+{
+	unsigned int next = output->repaint_history.next;
+
+	output->repaint_history.start[next] = *start;
+	output->repaint_history.seq[next] =
+		output->repaint_history.current_seq;
+	output->repaint_history.nsec[next] = nsec;
+	output->repaint_history.next = (next + 1) %
+				       WESTON_REPAINT_HISTORY_LENGTH;
+	if (output->repaint_history.count < WESTON_REPAINT_HISTORY_LENGTH)
+		output->repaint_history.count++;
+}
+
+/** Extend a repaint duration up to GPU completion
+ *
+ * \param output The output that was repainted.
+ * \param seq The repaint_history.current_seq of the repaint that
+ * submitted the GPU work.
+ * \param gpu_end When the GPU finished rendering, in CLOCK_MONOTONIC.
+ *
+ * The repaint cycle is timed until the backend flush returns, but a
+ * renderer may still be executing on the GPU by then. Renderers that can
+ * tell when the GPU finished call this, so that the adaptive repaint window
+ * covers the whole render time. The completion is charged to the repaint
+ * it belongs to, even when later repaints have started since. It is
+ * ignored if that repaint failed or has already left the history.
+ *
+ * \ingroup output
+ * \internal
+ */
+WL_EXPORT void
+weston_output_repaint_gpu_done(struct weston_output *output,
+			       uint64_t seq,
+			       const struct timespec *gpu_end)
+{
+	struct weston_compositor *compositor = output->compositor;
+	unsigned int count = output->repaint_history.count;
+	unsigned int slot;
+	unsigned int i;
+	struct timespec mono_now;
+	struct timespec now;
+	struct timespec end;
+	int64_t nsec;
+
+	for (i = 0; i < count; i++) {
+		slot = (output->repaint_history.next +
+			WESTON_REPAINT_HISTORY_LENGTH - 1 - i) %
+		       WESTON_REPAINT_HISTORY_LENGTH;
+		if (output->repaint_history.seq[slot] == seq)
+			break;
+	}
+	if (i == count)
+		return;
+
+	/* Convert from CLOCK_MONOTONIC to the presentation clock. */
+	clock_gettime(CLOCK_MONOTONIC, &mono_now);
+	weston_compositor_read_presentation_clock(compositor, &now);
+	timespec_add_nsec(&end, &now,
+			  timespec_sub_to_nsec(gpu_end, &mono_now));
+
+	nsec = timespec_sub_to_nsec(&end, &output->repaint_history.start[slot]);
+	if (nsec > output->repaint_history.nsec[slot])
+		output->repaint_history.nsec[slot] = nsec;
+}
+
+static int
+compare_int64(const void *a, const void *b)
+{
+	int64_t va = *(const int64_t *)a;
+	int64_t vb = *(const int64_t *)b;
+
+	return (va > vb) - (va < vb);
+}
+
+static int64_t
+weston_output_compute_repaint_window(struct weston_output *output)
+{
+	struct weston_compositor *compositor = output->compositor;
+	int64_t max_nsec = (int64_t)compositor->repaint_msec * 1000000;
+	int64_t sorted[WESTON_REPAINT_HISTORY_LENGTH];
+	unsigned int count = output->repaint_history.count;
+	unsigned int i;
+
+	if (!compositor->repaint_window_adaptive ||
+	    count < ADAPTIVE_REPAINT_MIN_SAMPLES)
+		return max_nsec;
+
+	memcpy(sorted, output->repaint_history.nsec, count * sizeof sorted[0]);
+	qsort(sorted, count, sizeof sorted[0], compare_int64);
+
+	i = (count * ADAPTIVE_REPAINT_PERCENTILE + 99) / 100 - 1;
+
+	return MIN(sorted[i] + ADAPTIVE_REPAINT_MARGIN_NSEC, max_nsec);
+}
+
 static void
 output_repaint_timer_arm(struct weston_compositor *compositor)
 {
@@ -3052,6 +3562,13 @@ output_repaint_timer_arm(struct weston_compositor *compositor)
 	 * particularly from weston_output_finish_frame()
 	 * into the same call, which would not happen if we called
 	 * output_repaint_timer_handler() directly.
+	 *
+	 * This does not shrink an adaptive repaint window below what
+	 * weston_output_compute_repaint_window() asked for, except by the
+	 * timer granularity already covered by ADAPTIVE_REPAINT_MARGIN_NSEC:
+	 * the floor applies only to a repaint that is already due and delays
+	 * it by at most 1 ms, and truncating a longer delay to whole
+	 * milliseconds fires the timer early, not late.
 	 */
 	if (msec_to_next < 1)
 		msec_to_next = 1;
@@ -3066,6 +3583,7 @@ output_repaint_timer_handler(void *data)
 	struct weston_output *output;
 	struct timespec now;
 	void *repaint_data = NULL;
+	int64_t repaint_nsec;
 	int ret = 0;
 
 	weston_compositor_read_presentation_clock(compositor, &now);
@@ -3081,9 +3599,12 @@ output_repaint_timer_handler(void *data)
 	}
 
 	if (ret == 0) {
-		if (compositor->backend->repaint_flush)
+		if (compositor->backend->repaint_flush) {
+			TL_POINT(compositor, "core_repaint_flush_begin", TLP_END);
 			ret = compositor->backend->repaint_flush(compositor,
 							 repaint_data);
+			TL_POINT(compositor, "core_repaint_flush_end", TLP_END);
+		}
 	} else {
 		if (compositor->backend->repaint_cancel)
 			compositor->backend->repaint_cancel(compositor,
@@ -3095,6 +3616,18 @@ output_repaint_timer_handler(void *data)
 			if (output->repainted)
 				weston_output_schedule_repaint_reset(output);
 		}
+	} else {
+		/* Outputs are repainted one after another and flushed
+		 * together, so each one has to wait for the whole cycle. */
+		weston_compositor_read_presentation_clock(compositor, &now);
+		repaint_nsec = timespec_sub_to_nsec(&now,
+						    &compositor->last_repaint_start);
+		wl_list_for_each(output, &compositor->output_list, link) {
+			if (output->repainted)
+				weston_output_record_repaint_time(output,
+						&compositor->last_repaint_start,
+						repaint_nsec);
+		}
 	}
 
 	wl_list_for_each(output, &compositor->output_list, link)
@@ -3150,6 +3683,7 @@ weston_output_finish_frame(struct weston_output *output,
 	int32_t refresh_nsec;
 	struct timespec now;
 	struct timespec vblank_monotonic;
+	struct timespec deadline_monotonic;
 	int64_t msec_rel;
 
 	assert(output->repaint_status == REPAINT_AWAITING_COMPLETION);
@@ -3187,9 +3721,11 @@ weston_output_finish_frame(struct weston_output *output,
 
 	output->frame_time = *stamp;
 
+	output->repaint_window_nsec =
+		weston_output_compute_repaint_window(output);
 	timespec_add_nsec(&output->next_repaint, stamp, refresh_nsec);
-	timespec_add_msec(&output->next_repaint, &output->next_repaint,
-			  -compositor->repaint_msec);
+	timespec_add_nsec(&output->next_repaint, &output->next_repaint,
+			  -output->repaint_window_nsec);
 	msec_rel = timespec_sub_to_msec(&output->next_repaint, &now);
 
 	if (msec_rel < -1000 || msec_rel > 1000) {
@@ -3217,6 +3753,13 @@ weston_output_finish_frame(struct weston_output *output,
 	}
 
 out:
+	deadline_monotonic = convert_presentation_time_now(compositor,
+							   &output->next_repaint,
+							   &now,
+							   CLOCK_MONOTONIC);
+	TL_POINT(compositor, "core_repaint_deadline", TLP_OUTPUT(output),
+		 TLP_DEADLINE(&deadline_monotonic), TLP_END);
+
 	output->repaint_status = REPAINT_SCHEDULED;
 	output_repaint_timer_arm(compositor);
 }
@@ -3241,11 +3784,16 @@ weston_layer_entry_insert(struct weston_layer_entry *list,
 {
 	wl_list_insert(&list->link, &entry->link);
 	entry->layer = list->layer;
+	if (entry->layer)
+		entry->layer->compositor->view_list_dirty = true;
 }
 
 WL_EXPORT void
 weston_layer_entry_remove(struct weston_layer_entry *entry)
 {
+	if (entry->layer)
+		entry->layer->compositor->view_list_dirty = true;
+
 	wl_list_remove(&entry->link);
 	wl_list_init(&entry->link);
 	entry->layer = NULL;
@@ -3275,6 +3823,7 @@ weston_layer_init(struct weston_layer *layer,
 WL_EXPORT void
 weston_layer_fini(struct weston_layer *layer)
 {
+	layer->compositor->view_list_dirty = true;
 	wl_list_remove(&layer->link);
 
 	if (!wl_list_empty(&layer->view_list.link))
@@ -3297,6 +3846,7 @@ weston_layer_set_position(struct weston_layer *layer,
 {
 	struct weston_layer *below;
 
+	layer->compositor->view_list_dirty = true;
 	wl_list_remove(&layer->link);
 
 	/* layer_list is ordered from top to bottom, the last layer being the
@@ -3320,6 +3870,7 @@ weston_layer_set_position(struct weston_layer *layer,
 WL_EXPORT void
 weston_layer_unset_position(struct weston_layer *layer)
 {
+	layer->compositor->view_list_dirty = true;
 	wl_list_remove(&layer->link);
 	wl_list_init(&layer->link);
 }
@@ -3569,8 +4120,10 @@ weston_surface_commit_subsurface_order(struct weston_surface *surface)
 		wl_list_remove(&sub->parent_link);
 		wl_list_insert(&surface->subsurface_list, &sub->parent_link);
 
-		if (sub->reordered)
+		if (sub->reordered) {
+			surface->compositor->view_list_dirty = true;
 			weston_surface_damage_subsurfaces(sub);
+		}
 	}
 }
 
@@ -3797,6 +4350,76 @@ weston_surface_set_protection_mode(struct weston_surface *surface,
 	}
 }
 
+static void
+region_reset_to_extents(pixman_region32_t *region)
+{
+	pixman_box32_t extents = *pixman_region32_extents(region);
+
+	pixman_region32_reset(region, &extents);
+}
+
+/* Bound the number of rectangles in a damage region
+ *
+ * The result always contains the original region. If the region has more
+ * than damage_max_rects rectangles, it is replaced by its extents when that
+ * wastes little enough area. Otherwise runs of consecutive rectangles,
+ * which pixman keeps sorted in y-x bands and are thus near each other, are
+ * merged into their bounding boxes. The extents are the fallback should
+ * the union of those boxes still be too fragmented.
+ */
+static void
+weston_compositor_simplify_damage(struct weston_compositor *compositor,
+				  pixman_region32_t *region)
+{
+	pixman_box32_t merged[DAMAGE_MAX_RECTS_LIMIT];
+	pixman_box32_t *rects;
+	pixman_box32_t *extents;
+	int max_rects = MIN(compositor->damage_max_rects,
+			    DAMAGE_MAX_RECTS_LIMIT);
+	int n_rects, n_merged, group;
+	int i, j;
+	uint64_t area = 0;
+	uint64_t extents_area;
+
+	rects = pixman_region32_rectangles(region, &n_rects);
+	if (max_rects <= 0 || n_rects <= max_rects)
+		return;
+
+	for (i = 0; i < n_rects; i++)
+		area += (uint64_t)(rects[i].x2 - rects[i].x1) *
+			(rects[i].y2 - rects[i].y1);
+
+	extents = pixman_region32_extents(region);
+	extents_area = (uint64_t)(extents->x2 - extents->x1) *
+		       (extents->y2 - extents->y1);
+
+	if (max_rects == 1 ||
+	    extents_area - area <= compositor->damage_max_waste * extents_area) {
+		region_reset_to_extents(region);
+		return;
+	}
+
+	group = (n_rects + max_rects - 1) / max_rects;
+	n_merged = 0;
+	for (i = 0; i < n_rects; i += group) {
+		pixman_box32_t *box = &merged[n_merged++];
+
+		*box = rects[i];
+		for (j = i + 1; j < n_rects && j < i + group; j++) {
+			box->x1 = MIN(box->x1, rects[j].x1);
+			box->y1 = MIN(box->y1, rects[j].y1);
+			box->x2 = MAX(box->x2, rects[j].x2);
+			box->y2 = MAX(box->y2, rects[j].y2);
+		}
+	}
+
+	pixman_region32_fini(region);
+	pixman_region32_init_rects(region, merged, n_merged);
+
+	if (pixman_region32_n_rects(region) > 2 * max_rects)
+		region_reset_to_extents(region);
+}
+
 static void
 weston_surface_commit_state(struct weston_surface *surface,
 			    struct weston_surface_state *state)
@@ -3852,6 +4475,8 @@ weston_surface_commit_state(struct weston_surface *surface,
 
 	pixman_region32_intersect_rect(&surface->damage, &surface->damage,
 				       0, 0, surface->width, surface->height);
+	weston_compositor_simplify_damage(surface->compositor,
+					  &surface->damage);
 	pixman_region32_clear(&state->damage_surface);
 
 	/* wl_surface.set_opaque_region */
@@ -4329,6 +4954,7 @@ subsurface_committed(struct weston_surface *surface, int32_t dx, int32_t dy)
 
 	if (!weston_surface_is_mapped(surface)) {
 		surface->is_mapped = true;
+		surface->compositor->view_list_dirty = true;
 
 		/* Cannot call weston_view_update_transform(),
 		 * because that would call it also for the parent surface,
@@ -4667,6 +5293,7 @@ subsurface_set_desync(struct wl_client *client, struct wl_resource *resource)
 static void
 weston_subsurface_unlink_parent(struct weston_subsurface *sub)
 {
+	sub->parent->compositor->view_list_dirty = true;
 	wl_list_remove(&sub->parent_link);
 	wl_list_remove(&sub->parent_link_pending);
 	wl_list_remove(&sub->parent_destroy_listener.link);
@@ -4726,6 +5353,7 @@ weston_subsurface_link_parent(struct weston_subsurface *sub,
 			      struct weston_surface *parent)
 {
 	sub->parent = parent;
+	parent->compositor->view_list_dirty = true;
 	sub->parent_destroy_listener.notify = subsurface_handle_parent_destroy;
 	wl_signal_add(&parent->destroy_signal,
 		      &sub->parent_destroy_listener);
@@ -4838,6 +5466,7 @@ weston_subsurface_create_for_parent(struct weston_surface *parent)
 
 	weston_subsurface_link_surface(sub, parent);
 	sub->parent = parent;
+	parent->compositor->view_list_dirty = true;
 	wl_list_insert(&parent->subsurface_list, &sub->parent_link);
 	wl_list_insert(&parent->subsurface_list_pending,
 		       &sub->parent_link_pending);
@@ -6327,6 +6956,7 @@ weston_compositor_remove_output(struct weston_output *output)
 		weston_paint_node_destroy(pnode);
 	}
 	assert(wl_list_empty(&output->paint_node_z_order_list));
+	output->z_order_list_serial = 0;
 
 	/*
 	 * Use view_list in case the output did not go through repaint
@@ -6505,6 +7135,119 @@ weston_output_init(struct weston_output *output,
 
 	pixman_region32_init(&output->region);
 	wl_list_init(&output->mode_list);
+	weston_frame_arena_init(&output->frame_arena);
+}
+
+/* Enough for any type the renderers and backends put in the arena. */
+#define FRAME_ARENA_ALIGN 16
+
+static size_t
+frame_arena_align(size_t size)
+{
+	return (size + FRAME_ARENA_ALIGN - 1) & ~(size_t)(FRAME_ARENA_ALIGN - 1);
+}
+
+static void
+weston_frame_arena_init(struct weston_frame_arena *arena)
+{
+	*arena = (struct weston_frame_arena) { 0 };
+}
+
+static void
+frame_arena_free_chunks(struct weston_frame_arena *arena)
+{
+	void *chunk, *next;
+
+	/* Each chunk starts with a pointer to the next one. */
+	for (chunk = arena->chunks; chunk; chunk = next) {
+		next = *(void **)chunk;
+		free(chunk);
+	}
+	arena->chunks = NULL;
+}
+
+static void
+weston_frame_arena_release(struct weston_frame_arena *arena)
+{
+	frame_arena_free_chunks(arena);
+	free(arena->data);
+	weston_frame_arena_init(arena);
+}
+
+/** Start a new frame
+ *
+ * Invalidates all memory handed out since the previous reset. If the last
+ * frame did not fit, the block is grown to hold all of it.
+ */
+static void
+weston_frame_arena_reset(struct weston_frame_arena *arena)
+{
+	size_t wanted = arena->used + arena->overflow;
+	char *data;
+
+	frame_arena_free_chunks(arena);
+
+	if (wanted > arena->size) {
+		/* Leave some room for the next frame to be a little bigger. */
+		wanted = frame_arena_align(wanted + wanted / 4);
+		data = malloc(wanted);
+		if (data) {
+			free(arena->data);
+			arena->data = data;
+			arena->size = wanted;
+			arena->frame_arena_mallocs++;
+			arena->total_arena_mallocs++;
+		}
+	}
+
+	arena->last_frame_arena_mallocs = arena->frame_arena_mallocs;
+	arena->frame_arena_mallocs = 0;
+	arena->used = 0;
+	arena->overflow = 0;
+}
+
+static void *
+weston_frame_arena_alloc(struct weston_frame_arena *arena, size_t size)
+{
+	size_t aligned = frame_arena_align(MAX(size, (size_t)1));
+	char *chunk;
+
+	if (aligned <= arena->size - arena->used) {
+		chunk = arena->data + arena->used;
+		arena->used += aligned;
+		return chunk;
+	}
+
+	chunk = malloc(FRAME_ARENA_ALIGN + aligned);
+	if (!chunk)
+		return NULL;
+
+	*(void **)chunk = arena->chunks;
+	arena->chunks = chunk;
+	arena->overflow += aligned;
+	arena->frame_arena_mallocs++;
+	arena->total_arena_mallocs++;
+
+	return chunk + FRAME_ARENA_ALIGN;
+}
+
+/** Allocate memory that lives until the next repaint of the output
+ *
+ * \param output The output being repainted.
+ * \param size Number of bytes.
+ * \return Pointer to uninitialized memory, or NULL on failure.
+ *
+ * The memory must not be freed; it is reclaimed when the next repaint of
+ * the output starts. Meant for temporary arrays in renderers and backends,
+ * which then stop hitting the heap once the arena has grown to fit them.
+ *
+ * \ingroup output
+ * \internal
+ */
+WL_EXPORT void *
+weston_output_frame_alloc(struct weston_output *output, size_t size)
+{
+	return weston_frame_arena_alloc(&output->frame_arena, size);
 }
 
 /** Adds weston_output object to pending output list.
@@ -6835,6 +7578,7 @@ weston_output_release(struct weston_output *output)
 	assert(wl_list_empty(&output->paint_node_list));
 
 	pixman_region32_fini(&output->region);
+	weston_frame_arena_release(&output->frame_arena);
 	wl_list_remove(&output->link);
 
 	wl_list_for_each_safe(head, tmp, &output->head_list, output_link)
@@ -7434,6 +8178,10 @@ debug_scene_view_print(FILE *fp, struct weston_view *view, int view_idx)
 	if (view->alpha < 1.0)
 		fprintf(fp, "\t\talpha: %f\n", view->alpha);
 
+	if (view->surface->frame_callbacks_throttled > 0)
+		fprintf(fp, "\t\tframe callbacks throttled: %u repaints\n",
+			view->surface->frame_callbacks_throttled);
+
 	if (view->output_mask != 0) {
 		bool first_output = true;
 		fprintf(fp, "\t\toutputs: ");
@@ -7528,6 +8276,11 @@ weston_compositor_print_scene_graph(struct weston_compositor *ec)
 
 		fprintf(fp, "\trepaint status: %s\n",
 			output_repaint_status_text(output));
+		fprintf(fp, "\tframe arena: %zu bytes, "
+			"%u arena mallocs last frame, %" PRIu64 " total\n",
+			output->frame_arena.size,
+			output->frame_arena.last_frame_arena_mallocs,
+			output->frame_arena.total_arena_mallocs);
 		if (output->repaint_status == REPAINT_SCHEDULED)
 			fprintf(fp, "\tnext repaint: %ld.%09ld\n",
 				output->next_repaint.tv_sec,
@@ -7663,6 +8416,9 @@ weston_compositor_create(struct wl_display *display,
 
 	ec->output_id_pool = 0;
 	ec->repaint_msec = DEFAULT_REPAINT_WINDOW;
+	ec->damage_max_rects = DEFAULT_DAMAGE_MAX_RECTS;
+	ec->damage_max_waste = DEFAULT_DAMAGE_MAX_WASTE;
+	ec->damage_history = DEFAULT_DAMAGE_HISTORY;
 
 	ec->activate_serial = 1;
 
@@ -7694,6 +8450,11 @@ weston_compositor_create(struct wl_display *display,
 		goto fail;
 
 	wl_list_init(&ec->view_list);
+	wl_list_init(&ec->transform_dirty_list);
+	ec->view_list_dirty = true;
+	wl_array_init(&ec->pick_grid.cells);
+	wl_array_init(&ec->pick_grid.views);
+	ec->pick_grid.dirty = true;
 	wl_list_init(&ec->plane_list);
 	wl_list_init(&ec->layer_list);
 	wl_list_init(&ec->seat_list);
@@ -7721,6 +8482,9 @@ weston_compositor_create(struct wl_display *display,
 	ec->repaint_timer =
 		wl_event_loop_add_timer(loop, output_repaint_timer_handler,
 					ec);
+	ec->frame_throttle_timer =
+		wl_event_loop_add_timer(loop, frame_throttle_timer_handler,
+					ec);
 
 	weston_layer_init(&ec->fade_layer, ec);
 	weston_layer_init(&ec->cursor_layer, ec);
@@ -7758,6 +8522,7 @@ weston_compositor_shutdown(struct weston_compositor *ec)
 
 	wl_event_source_remove(ec->idle_source);
 	wl_event_source_remove(ec->repaint_timer);
+	wl_event_source_remove(ec->frame_throttle_timer);
 
 	/* Destroy all outputs associated with this compositor */
 	wl_list_for_each_safe(output, next, &ec->output_list, link)
@@ -7792,6 +8557,38 @@ weston_compositor_shutdown(struct weston_compositor *ec)
 		weston_log("BUG: layer_list is not empty after shutdown. Calls to weston_layer_fini() are missing somwhere.\n");
 }
 
+static int
+frame_throttle_timer_handler(void *data)
+{
+	struct weston_compositor *compositor = data;
+	struct weston_output *output;
+
+	wl_list_for_each(output, &compositor->output_list, link) {
+		if (output->frame_callbacks_throttled)
+			weston_output_schedule_repaint(output);
+	}
+
+	return 0;
+}
+
+/** Throttle frame callbacks of fully occluded surfaces
+ *
+ * \param compositor The compositor.
+ * \param msec Minimum interval between wl_callback.done events sent to a
+ * surface that is completely covered by opaque views or off every output
+ * it is on, in milliseconds. 0 disables throttling, which is the default.
+ *
+ * This is a policy decision left to the shell.
+ *
+ * \ingroup compositor
+ */
+WL_EXPORT void
+weston_compositor_set_occluded_frame_interval(struct weston_compositor *compositor,
+					      uint32_t msec)
+{
+	compositor->occluded_frame_interval_msec = msec;
+}
+
 /** weston_compositor_exit_with_code
  * \ingroup compositor
  */
@@ -8122,6 +8919,9 @@ weston_compositor_destroy(struct weston_compositor *compositor)
 	weston_log_scope_destroy(compositor->timeline);
 	compositor->timeline = NULL;
 
+	wl_array_release(&compositor->pick_grid.cells);
+	wl_array_release(&compositor->pick_grid.views);
+
 	free(compositor);
 }
 
@@ -161,6 +161,11 @@ weston_output_disable_planes_incr(struct weston_output *output);
 void
 weston_output_disable_planes_decr(struct weston_output *output);
 
+void
+weston_output_repaint_gpu_done(struct weston_output *output,
+			       uint64_t seq,
+			       const struct timespec *gpu_end);
+
 /* weston_plane */
 
 void
@@ -419,12 +424,20 @@ struct weston_paint_node {
 
 	struct weston_surface_color_transform surf_xform;
 	bool surf_xform_valid;
+
+	/* Nothing of the view is visible on the output: it is either off
+	 * the output or covered by opaque views above it. Updated before
+	 * planes are assigned on each repaint. */
+	bool is_fully_occluded;
 };
 
 struct weston_paint_node *
 weston_view_find_paint_node(struct weston_view *view,
 			    struct weston_output *output);
 
+void *
+weston_output_frame_alloc(struct weston_output *output, size_t size);
+
 /* others */
 int
 wl_data_device_manager_init(struct wl_display *display);
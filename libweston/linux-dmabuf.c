@@ -143,6 +143,8 @@ destroy_linux_dmabuf_wl_buffer(struct wl_resource *resource)
 	assert(buffer->buffer_resource == resource);
 	assert(!buffer->params_resource);
 
+	if (buffer->backend_user_data_destroy_func)
+		buffer->backend_user_data_destroy_func(buffer);
 	if (buffer->user_data_destroy_func)
 		buffer->user_data_destroy_func(buffer);
 
@@ -293,6 +295,8 @@ avoid_gpu_import:
 	return;
 
 err_buffer:
+	if (buffer->backend_user_data_destroy_func)
+		buffer->backend_user_data_destroy_func(buffer);
 	if (buffer->user_data_destroy_func)
 		buffer->user_data_destroy_func(buffer);
 
@@ -467,6 +471,42 @@ linux_dmabuf_buffer_get_user_data(struct linux_dmabuf_buffer *buffer)
 	return buffer->user_data;
 }
 
+/** Set backend-private data
+ *
+ * Like linux_dmabuf_buffer_set_user_data(), but for the backend, so that
+ * it can keep its own imports of the buffer next to the renderer's.
+ *
+ * \param buffer The linux_dmabuf_buffer object to set for.
+ * \param data The new backend-private data pointer.
+ * \param func Destructor function to be called for the backend-private
+ *             data when the linux_dmabuf_buffer gets destroyed.
+ *
+ * \sa linux_dmabuf_buffer_set_user_data
+ */
+WL_EXPORT void
+linux_dmabuf_buffer_set_backend_user_data(struct linux_dmabuf_buffer *buffer,
+					  void *data,
+					  dmabuf_user_data_destroy_func func)
+{
+	assert(data == NULL || buffer->backend_user_data == NULL);
+
+	buffer->backend_user_data = data;
+	buffer->backend_user_data_destroy_func = func;
+}
+
+/** Get backend-private data
+ *
+ * \param buffer The linux_dmabuf_buffer to query.
+ * \return Backend-private data pointer.
+ *
+ * \sa linux_dmabuf_buffer_set_backend_user_data
+ */
+WL_EXPORT void *
+linux_dmabuf_buffer_get_backend_user_data(struct linux_dmabuf_buffer *buffer)
+{
+	return buffer->backend_user_data;
+}
+
 static const struct zwp_linux_dmabuf_v1_interface linux_dmabuf_implementation = {
 	linux_dmabuf_destroy,
 	linux_dmabuf_create_params
@@ -55,20 +55,11 @@ struct linux_dmabuf_buffer {
 	void *user_data;
 	dmabuf_user_data_destroy_func user_data_destroy_func;
 
-	/* XXX:
-	 *
-	 * Add backend private data. This would be for the backend
-	 * to do all additional imports it might ever use in advance.
-	 * The basic principle, even if not implemented in drivers today,
-	 * is that dmabufs are first attached, but the actual allocation
-	 * is deferred to first use. This would allow the exporter and all
-	 * attachers to agree on how to allocate.
-	 *
-	 * The DRM backend would use this to create drmFBs for each
-	 * dmabuf_buffer, just in case at some point it would become
-	 * feasible to scan it out directly. This would improve the
-	 * possibilities to successfully scan out, avoiding compositing.
-	 */
+	/* Backend private data, destroyed with the buffer. The DRM backend
+	 * keeps the framebuffers it imported from this dmabuf here, so that
+	 * scanning out the same buffer again needs no new import. */
+	void *backend_user_data;
+	dmabuf_user_data_destroy_func backend_user_data_destroy_func;
 
 	/**< marked as scan-out capable, avoids any composition */
 	bool direct_display;
@@ -90,6 +81,13 @@ linux_dmabuf_buffer_set_user_data(struct linux_dmabuf_buffer *buffer,
 void *
 linux_dmabuf_buffer_get_user_data(struct linux_dmabuf_buffer *buffer);
 
+void
+linux_dmabuf_buffer_set_backend_user_data(struct linux_dmabuf_buffer *buffer,
+					  void *data,
+					  dmabuf_user_data_destroy_func func);
+void *
+linux_dmabuf_buffer_get_backend_user_data(struct linux_dmabuf_buffer *buffer);
+
 void
 linux_dmabuf_buffer_send_server_error(struct linux_dmabuf_buffer *buffer,
 				      const char *msg);
@@ -31,7 +31,9 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <string.h>
 
+#include <libweston/weston-log.h>
 #include "pixman-renderer.h"
 #include "color.h"
 #include "shared/helpers.h"
@@ -57,6 +59,20 @@ struct pixman_surface_state {
 	struct wl_listener renderer_destroy_listener;
 };
 
+/** How repaint_region() painted */
+struct pixman_paint_stats {
+	uint32_t direct_copies; /* rectangles copied, see can_copy_direct() */
+	uint32_t composites; /* pixman_image_composite32() */
+};
+
+/** Where repaint_surfaces() paints to */
+struct pixman_paint_target {
+	/* The shadow or hardware buffer */
+	pixman_image_t *image;
+	pixman_image_t *debug_color;
+	struct pixman_paint_stats stats;
+};
+
 struct pixman_renderer {
 	struct weston_renderer base;
 
@@ -64,6 +80,8 @@ struct pixman_renderer {
 	pixman_image_t *debug_color;
 	struct weston_binding *debug_binding;
 
+	struct weston_log_scope *draw_scope;
+
 	struct wl_signal destroy_signal;
 };
 
@@ -308,10 +326,111 @@ composite_clipped(pixman_image_t *src,
 	}
 }
 
+/** Whether painting a region is a plain copy of source rows
+ *
+ * \param src The source image.
+ * \param dest The target image.
+ * \param transform From target to source coordinates.
+ * \param pixman_op Compositing operator, either SRC or OVER.
+ * \param region The region to be painted, in target coordinates.
+ * \param dx, dy Receive the offset from target to source coordinates.
+ *
+ * True when the view is translated by whole pixels only, the source has
+ * the pixel layout of the target and replaces what is below, and all of
+ * region lies within both images. The caller checks for opacity.
+ */
+static bool
+can_copy_direct(pixman_image_t *src, pixman_image_t *dest,
+		const pixman_transform_t *transform, pixman_op_t pixman_op,
+		pixman_region32_t *region, int *dx, int *dy)
+{
+	pixman_format_code_t src_format = pixman_image_get_format(src);
+	pixman_format_code_t dest_format = pixman_image_get_format(dest);
+	const pixman_fixed_t (*m)[3] = transform->matrix;
+	pixman_box32_t *extents;
+
+	/* solid fills are not bits images */
+	if (src_format == 0 || dest_format == 0)
+		return false;
+
+	/* a8r8g8b8 into x8r8g8b8 only loses alpha */
+	if (src_format != dest_format &&
+	    !(src_format == PIXMAN_a8r8g8b8 && dest_format == PIXMAN_x8r8g8b8))
+		return false;
+
+	if (pixman_op != PIXMAN_OP_SRC && PIXMAN_FORMAT_A(src_format) != 0)
+		return false;
+
+	if (m[0][0] != pixman_fixed_1 || m[0][1] != 0 ||
+	    m[1][0] != 0 || m[1][1] != pixman_fixed_1 ||
+	    m[2][0] != 0 || m[2][1] != 0 || m[2][2] != pixman_fixed_1 ||
+	    pixman_fixed_frac(m[0][2]) != 0 || pixman_fixed_frac(m[1][2]) != 0)
+		return false;
+
+	*dx = pixman_fixed_to_int(m[0][2]);
+	*dy = pixman_fixed_to_int(m[1][2]);
+
+	/* Outside the source, compositing would paint transparent black. */
+	extents = pixman_region32_extents(region);
+	if (extents->x1 < 0 || extents->y1 < 0 ||
+	    extents->x2 > pixman_image_get_width(dest) ||
+	    extents->y2 > pixman_image_get_height(dest) ||
+	    extents->x1 + *dx < 0 || extents->y1 + *dy < 0 ||
+	    extents->x2 + *dx > pixman_image_get_width(src) ||
+	    extents->y2 + *dy > pixman_image_get_height(src))
+		return false;
+
+	return true;
+}
+
+/** Copy the rows of region from src, offset by dx, dy, into dest
+ *
+ * Returns the number of rectangles copied.
+ */
+static int
+copy_direct(pixman_image_t *src, pixman_image_t *dest,
+	    pixman_region32_t *region, int dx, int dy)
+{
+	int bpp = PIXMAN_FORMAT_BPP(pixman_image_get_format(dest));
+	uint32_t *src_bits = pixman_image_get_data(src);
+	uint32_t *dest_bits = pixman_image_get_data(dest);
+	int src_stride = pixman_image_get_stride(src);
+	int dest_stride = pixman_image_get_stride(dest);
+	pixman_box32_t *rects;
+	int n, i, y;
+
+	rects = pixman_region32_rectangles(region, &n);
+	for (i = 0; i < n; i++) {
+		int width = rects[i].x2 - rects[i].x1;
+		int height = rects[i].y2 - rects[i].y1;
+		uint8_t *s, *d;
+
+		/* pixman picks the fastest blitter for the CPU, if any */
+		if (pixman_blt(src_bits, dest_bits,
+			       src_stride / 4, dest_stride / 4, bpp, bpp,
+			       rects[i].x1 + dx, rects[i].y1 + dy,
+			       rects[i].x1, rects[i].y1, width, height))
+			continue;
+
+		s = (uint8_t *) src_bits + (rects[i].y1 + dy) * src_stride +
+		    (rects[i].x1 + dx) * bpp / 8;
+		d = (uint8_t *) dest_bits + rects[i].y1 * dest_stride +
+		    rects[i].x1 * bpp / 8;
+		for (y = 0; y < height; y++) {
+			memcpy(d, s, width * bpp / 8);
+			s += src_stride;
+			d += dest_stride;
+		}
+	}
+
+	return n;
+}
+
 /** Paint an intersected region
  *
  * \param ev The view to be painted.
  * \param output The output being painted.
+ * \param target Where to paint.
  * \param repaint_output The region to be painted in output coordinates.
  * \param source_clip The region of the source image to use, in source image
  *                    coordinates. If NULL, use the whole source image.
@@ -319,25 +438,19 @@ composite_clipped(pixman_image_t *src,
  */
 static void
 repaint_region(struct weston_view *ev, struct weston_output *output,
+	       struct pixman_paint_target *target,
 	       pixman_region32_t *repaint_output,
 	       pixman_region32_t *source_clip,
 	       pixman_op_t pixman_op)
 {
-	struct pixman_renderer *pr =
-		(struct pixman_renderer *) output->compositor->renderer;
 	struct pixman_surface_state *ps = get_surface_state(ev->surface);
-	struct pixman_output_state *po = get_output_state(output);
 	struct weston_buffer_viewport *vp = &ev->surface->buffer_viewport;
-	pixman_image_t *target_image;
+	pixman_image_t *target_image = target->image;
 	pixman_transform_t transform;
 	pixman_filter_t filter;
 	pixman_image_t *mask_image;
 	pixman_color_t mask = { 0, };
-
-	if (po->shadow_image)
-		target_image = po->shadow_image;
-	else
-		target_image = po->hw_buffer;
+	int dx, dy;
 
  	/* Clip rendering to the damaged output region */
 	pixman_image_set_clip_region32(target_image, repaint_output);
@@ -359,12 +472,22 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 		mask_image = NULL;
 	}
 
-	if (source_clip)
-		composite_clipped(ps->image, mask_image, target_image,
-				  &transform, filter, source_clip);
-	else
-		composite_whole(pixman_op, ps->image, mask_image,
-				target_image, &transform, filter);
+	if (!source_clip && !mask_image &&
+	    can_copy_direct(ps->image, target_image, &transform, pixman_op,
+			    repaint_output, &dx, &dy)) {
+		target->stats.direct_copies +=
+			copy_direct(ps->image, target_image, repaint_output,
+				    dx, dy);
+	} else {
+		if (source_clip)
+			composite_clipped(ps->image, mask_image, target_image,
+					  &transform, filter, source_clip);
+		else
+			composite_whole(pixman_op, ps->image, mask_image,
+					target_image, &transform, filter);
+
+		target->stats.composites++;
+	}
 
 	if (mask_image)
 		pixman_image_unref(mask_image);
@@ -372,9 +495,9 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 	if (ps->buffer_ref.buffer)
 		wl_shm_buffer_end_access(ps->buffer_ref.buffer->shm_buffer);
 
-	if (pr->repaint_debug)
+	if (target->debug_color)
 		pixman_image_composite32(PIXMAN_OP_OVER,
-					 pr->debug_color, /* src */
+					 target->debug_color, /* src */
 					 NULL /* mask */,
 					 target_image, /* dest */
 					 0, 0, /* src_x, src_y */
@@ -388,6 +511,7 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 
 static void
 draw_view_translated(struct weston_view *view, struct weston_output *output,
+		     struct pixman_paint_target *target,
 		     pixman_region32_t *repaint_global)
 {
 	struct weston_surface *surface = view->surface;
@@ -416,8 +540,8 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 			weston_output_region_from_global(output,
 							 &repaint_output);
 
-			repaint_region(view, output, &repaint_output, NULL,
-				       PIXMAN_OP_SRC);
+			repaint_region(view, output, target, &repaint_output,
+				       NULL, PIXMAN_OP_SRC);
 		}
 	}
 
@@ -427,7 +551,7 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 						  &surface_blend, view);
 		weston_output_region_from_global(output, &repaint_output);
 
-		repaint_region(view, output, &repaint_output, NULL,
+		repaint_region(view, output, target, &repaint_output, NULL,
 			       PIXMAN_OP_OVER);
 	}
 
@@ -438,6 +562,7 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 static void
 draw_view_source_clipped(struct weston_view *view,
 			 struct weston_output *output,
+			 struct pixman_paint_target *target,
 			 pixman_region32_t *repaint_global)
 {
 	struct weston_surface *surface = view->surface;
@@ -463,7 +588,7 @@ draw_view_source_clipped(struct weston_view *view,
 	pixman_region32_copy(&repaint_output, repaint_global);
 	weston_output_region_from_global(output, &repaint_output);
 
-	repaint_region(view, output, &repaint_output, &buffer_region,
+	repaint_region(view, output, target, &repaint_output, &buffer_region,
 		       PIXMAN_OP_OVER);
 
 	pixman_region32_fini(&repaint_output);
@@ -473,6 +598,7 @@ draw_view_source_clipped(struct weston_view *view,
 
 static void
 draw_paint_node(struct weston_paint_node *pnode,
+		struct pixman_paint_target *target,
 		pixman_region32_t *damage /* in global coordinates */)
 {
 	struct pixman_surface_state *ps = get_surface_state(pnode->surface);
@@ -504,7 +630,8 @@ draw_paint_node(struct weston_paint_node *pnode,
 		 * Also the boundingbox is accurate rather than an
 		 * approximation.
 		 */
-		draw_view_translated(pnode->view, pnode->output, &repaint);
+		draw_view_translated(pnode->view, pnode->output, target,
+				     &repaint);
 	} else {
 		/* The complex case: the view transformation does not allow
 		 * converting opaque etc. regions into global coordinate space.
@@ -513,25 +640,38 @@ draw_paint_node(struct weston_paint_node *pnode,
 		 * to be used whole. Source clipping does not work with
 		 * PIXMAN_OP_SRC.
 		 */
-		draw_view_source_clipped(pnode->view, pnode->output, &repaint);
+		draw_view_source_clipped(pnode->view, pnode->output, target,
+					 &repaint);
 	}
 
 out:
 	pixman_region32_fini(&repaint);
 }
 static void
-repaint_surfaces(struct weston_output *output, pixman_region32_t *damage)
+repaint_surfaces(struct weston_output *output,
+		 struct pixman_paint_target *target,
+		 pixman_region32_t *damage)
 {
 	struct weston_compositor *compositor = output->compositor;
 	struct weston_paint_node *pnode;
 
 	wl_list_for_each_reverse(pnode, &output->paint_node_z_order_list,
 				 z_order_link) {
-		if (pnode->view->plane == &compositor->primary_plane)
-			draw_paint_node(pnode, damage);
+		if (pnode->view->plane == &compositor->primary_plane &&
+		    !pnode->is_fully_occluded)
+			draw_paint_node(pnode, target, damage);
 	}
 }
 
+static pixman_image_t *
+output_target_image(struct pixman_output_state *po)
+{
+	if (po->shadow_image)
+		return po->shadow_image;
+	else
+		return po->hw_buffer;
+}
+
 static void
 copy_to_hw_buffer(struct weston_output *output, pixman_region32_t *region)
 {
@@ -564,6 +704,8 @@ pixman_renderer_repaint_output(struct weston_output *output,
 			       pixman_region32_t *output_damage)
 {
 	struct pixman_output_state *po = get_output_state(output);
+	struct pixman_renderer *pr = get_renderer(output->compositor);
+	struct pixman_paint_target target = { 0 };
 	pixman_region32_t hw_damage;
 
 	assert(output->from_blend_to_output_by_backend ||
@@ -583,14 +725,24 @@ pixman_renderer_repaint_output(struct weston_output *output,
 		pixman_region32_copy(&hw_damage, output_damage);
 	}
 
+	target.image = output_target_image(po);
+	if (pr->repaint_debug)
+		target.debug_color = pr->debug_color;
+
 	if (po->shadow_image) {
-		repaint_surfaces(output, output_damage);
+		repaint_surfaces(output, &target, output_damage);
 		copy_to_hw_buffer(output, &hw_damage);
 	} else {
-		repaint_surfaces(output, &hw_damage);
+		repaint_surfaces(output, &target, &hw_damage);
 	}
 	pixman_region32_fini(&hw_damage);
 
+	if (weston_log_scope_is_enabled(pr->draw_scope))
+		weston_log_scope_printf(pr->draw_scope,
+					"%s: %u direct copies, %u composites\n",
+					output->name, target.stats.direct_copies,
+					target.stats.composites);
+
 	wl_signal_emit(&output->frame_signal, output_damage);
 
 	/* Actual flip should be done by caller */
@@ -785,6 +937,8 @@ pixman_renderer_destroy(struct weston_compositor *ec)
 {
 	struct pixman_renderer *pr = get_renderer(ec);
 
+	weston_log_scope_destroy(pr->draw_scope);
+
 	wl_signal_emit(&pr->destroy_signal, pr);
 	weston_binding_destroy(pr->debug_binding);
 	free(pr);
@@ -893,6 +1047,12 @@ pixman_renderer_init(struct weston_compositor *ec)
 
 	wl_signal_init(&renderer->destroy_signal);
 
+	renderer->draw_scope = weston_compositor_add_log_scope(ec,
+			"pixman-draw-stats",
+			"Pixman renderer direct copies and composites per output "
+			"repaint.\n",
+			NULL, NULL, renderer);
+
 	return 0;
 }
 
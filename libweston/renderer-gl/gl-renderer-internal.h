@@ -65,26 +65,51 @@ enum gl_shader_color_curve {
  *
  * Use 'pahole' from package 'dwarves' to inspect this structure.
  */
+#define GL_SHADER_REQ_VARIANT_BITS 4
+#define GL_SHADER_REQ_INPUT_IS_PREMULT_BITS 1
+#define GL_SHADER_REQ_GREEN_TINT_BITS 1
+#define GL_SHADER_REQ_COLOR_PRE_CURVE_BITS 1
+
+/* Total width of the bitfields above, without pad_bits_ */
+#define GL_SHADER_REQ_USED_BITS (GL_SHADER_REQ_VARIANT_BITS + \
+				 GL_SHADER_REQ_INPUT_IS_PREMULT_BITS + \
+				 GL_SHADER_REQ_GREEN_TINT_BITS + \
+				 GL_SHADER_REQ_COLOR_PRE_CURVE_BITS)
+
 struct gl_shader_requirements
 {
-	unsigned variant:4; /* enum gl_shader_texture_variant */
-	bool input_is_premult:1;
-	bool green_tint:1;
-	unsigned color_pre_curve:1; /* enum gl_shader_color_curve */
+	/* enum gl_shader_texture_variant */
+	unsigned variant:GL_SHADER_REQ_VARIANT_BITS;
+	bool input_is_premult:GL_SHADER_REQ_INPUT_IS_PREMULT_BITS;
+	bool green_tint:GL_SHADER_REQ_GREEN_TINT_BITS;
+	/* enum gl_shader_color_curve */
+	unsigned color_pre_curve:GL_SHADER_REQ_COLOR_PRE_CURVE_BITS;
 
 	/*
 	 * The total size of all bitfields plus pad_bits_ must fill up exactly
 	 * how many bytes the compiler allocates for them together.
 	 */
-	unsigned pad_bits_:25;
+	unsigned pad_bits_:32 - GL_SHADER_REQ_USED_BITS;
 };
 static_assert(sizeof(struct gl_shader_requirements) ==
 	      4 /* total bitfield size in bytes */,
 	      "struct gl_shader_requirements must not contain implicit padding");
 
+/* Number of distinct gl_shader_requirements */
+#define GL_SHADER_KEY_COUNT (1 << GL_SHADER_REQ_USED_BITS)
+
 struct gl_shader;
 struct weston_color_transform;
 
+/* Texture atlas for small SHM surfaces: a GL_ATLAS_SIZE square texture
+ * managed as a quadtree buddy allocator with blocks from
+ * GL_ATLAS_MIN_BLOCK to GL_ATLAS_MAX_BLOCK pixels. */
+#define GL_ATLAS_SIZE 1024
+#define GL_ATLAS_MIN_BLOCK 32
+#define GL_ATLAS_MAX_BLOCK 128
+/* quadtree nodes from GL_ATLAS_SIZE down to GL_ATLAS_MIN_BLOCK */
+#define GL_ATLAS_NODES (1 + 4 + 16 + 64 + 256 + 1024)
+
 #define GL_SHADER_INPUT_TEX_MAX 3
 struct gl_shader_config {
 	struct gl_shader_requirements req;
@@ -118,6 +143,15 @@ struct gl_renderer {
 
 	struct wl_array vertices;
 	struct wl_array vtxcnt;
+	struct wl_array indices;
+
+	/** Draw calls and vertices of the current output repaint,
+	 *  reported in draw_scope */
+	struct {
+		uint32_t draws;
+		uint32_t vertices;
+	} frame_stats;
+	struct weston_log_scope *draw_scope;
 
 	struct weston_drm_format_array supported_formats;
 
@@ -153,6 +187,24 @@ struct gl_renderer {
 
 	bool has_gl_texture_rg;
 
+	/* GL ES 3: stage SHM damage in pixel unpack buffers */
+	bool has_pbo_upload;
+
+	/** Texture shared by small ARGB8888/XRGB8888 SHM surfaces */
+	struct {
+		GLuint tex;
+		/* enum gl_atlas_node_state per quadtree node, root first,
+		 * children of node n at 4n+1 .. 4n+4 */
+		uint8_t nodes[GL_ATLAS_NODES];
+		int surfaces;
+	} atlas;
+
+	/* WESTON_GL_SUBTREE_CACHE: flatten static view subtrees into FBOs */
+	bool subtree_cache;
+	/* struct gl_subtree_cache::link */
+	struct wl_list subtree_cache_list;
+	uint32_t subtree_cache_frame;
+
 	struct gl_shader *current_shader;
 	struct gl_shader *fallback_shader;
 
@@ -178,6 +230,16 @@ struct gl_renderer {
 	 */
 	struct wl_list shader_list;
 	struct weston_log_scope *shader_scope;
+
+	/** The programs in shader_list, indexed by their requirements */
+	struct gl_shader *shader_table[GL_SHADER_KEY_COUNT];
+
+	/** On-disk program binary cache, NULL if disabled */
+	char *program_cache_dir;
+	/** Identifies the shader sources and driver the binaries are for */
+	uint32_t program_cache_id;
+	PFNGLGETPROGRAMBINARYOESPROC get_program_binary;
+	PFNGLPROGRAMBINARYOESPROC program_binary;
 };
 
 static inline struct gl_renderer *
@@ -225,6 +287,12 @@ gl_renderer_shader_list_destroy(struct gl_renderer *gr);
 struct gl_shader *
 gl_renderer_create_fallback_shader(struct gl_renderer *gr);
 
+void
+gl_renderer_program_cache_init(struct gl_renderer *gr);
+
+void
+gl_renderer_warm_up_programs(struct gl_renderer *gr);
+
 void
 gl_renderer_garbage_collect_programs(struct gl_renderer *gr);
 
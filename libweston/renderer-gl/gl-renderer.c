@@ -37,6 +37,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <float.h>
+#include <math.h>
 #include <assert.h>
 #include <linux/input.h>
 #include <unistd.h>
@@ -60,7 +61,8 @@
 #include "shared/weston-drm-fourcc.h"
 #include "shared/weston-egl-ext.h"
 
-#define BUFFER_DAMAGE_COUNT 2
+/* Upper limit of weston_compositor::damage_history */
+#define BUFFER_DAMAGE_COUNT 16
 
 enum gl_border_status {
 	BORDER_STATUS_CLEAN = 0,
@@ -86,11 +88,48 @@ struct gl_fbo_texture {
 	int32_t height;
 };
 
+/* A cached view and its content, compared on every repaint of a subtree */
+struct gl_subtree_member {
+	struct weston_view *view;
+	uint32_t xform_id; /* weston_color_transform::id, 0 for identity */
+	uint32_t content_serial;
+	float x, y; /* offset in root surface coordinates */
+	int32_t width, height;
+};
+
+/** A view subtree flattened into a texture
+ *
+ * The root view and its transform children (e.g. a window and its
+ * subsurfaces) are rendered into an FBO in root surface coordinates.
+ * While none of them change, only the root transform and alpha are
+ * applied and the subtree is drawn as a single textured quad.
+ */
+struct gl_subtree_cache {
+	struct gl_surface_state *owner; /* root surface */
+	struct wl_list link; /* gl_renderer::subtree_cache_list */
+
+	struct weston_output *output;
+	struct wl_array members; /* struct gl_subtree_member */
+	pixman_box32_t box; /* in root surface coordinates */
+	int scale;
+	unsigned int stable_frames;
+	uint32_t last_used;
+
+	struct gl_fbo_texture fbo;
+	bool fbo_valid;
+};
+
 struct gl_output_state {
 	EGLSurface egl_surface;
+	/* Ring of the damage of the last buffer_damage_count frames,
+	 * newest at buffer_damage_index */
 	pixman_region32_t buffer_damage[BUFFER_DAMAGE_COUNT];
+	int buffer_damage_count;
 	int buffer_damage_index;
 	enum gl_border_status border_damage[BUFFER_DAMAGE_COUNT];
+	/* Repaints, and those that had to redraw the whole output */
+	uint32_t repaint_count;
+	uint32_t full_repaint_count;
 	struct gl_border_image borders[4];
 	enum gl_border_status border_status;
 	bool swap_behavior_is_preserved;
@@ -102,6 +141,12 @@ struct gl_output_state {
 	/* struct timeline_render_point::link */
 	struct wl_list timeline_render_point_list;
 
+	/* struct gl_readback::link, oldest first */
+	struct wl_list readback_list;
+	/* Pixel pack buffer kept from the last completed readback */
+	GLuint readback_pbo;
+	size_t readback_pbo_size;
+
 	struct gl_fbo_texture shadow;
 };
 
@@ -175,6 +220,21 @@ struct gl_surface_state {
 	bool needs_full_upload;
 	pixman_region32_t texture_damage;
 
+	/* Pixel unpack buffer staging SHM damage, see upload_damage_pbo() */
+	GLuint pbo;
+
+	/* Node in gl_renderer::atlas holding the texture instead of
+	 * textures[0], or -1. The image starts at atlas_x, atlas_y and is
+	 * surrounded by a one pixel border repeating its edges, so linear
+	 * filtering behaves as GL_CLAMP_TO_EDGE. */
+	int atlas_node;
+	int atlas_x, atlas_y;
+
+	/* Bumped whenever the content may have changed */
+	uint32_t content_serial;
+	/* Cache of the subtree rooted at a view of this surface */
+	struct gl_subtree_cache *subtree_cache;
+
 	/* These are only used by SHM surfaces to detect when we need
 	 * to do a full upload to specify a new internal texture
 	 * format */
@@ -219,9 +279,26 @@ struct timeline_render_point {
 	enum timeline_render_point_type type;
 	int fd;
 	struct weston_output *output;
+	uint64_t repaint_seq; /* weston_output::repaint_history.current_seq */
 	struct wl_event_source *event_source;
 };
 
+/** Pending read_pixels_async: the pixels in a pixel pack buffer, the
+ * fence signalled once the GPU has written them */
+struct gl_readback {
+	struct wl_list link; /* gl_output_state::readback_list */
+
+	struct weston_output *output;
+	GLuint pbo;
+	size_t size;
+	EGLSyncKHR sync;
+	int fd;
+	struct wl_event_source *event_source;
+
+	weston_renderer_read_pixels_done_func_t done;
+	void *data;
+};
+
 static uint32_t
 gr_gl_version(uint16_t major, uint16_t minor)
 {
@@ -297,6 +374,12 @@ timeline_render_point_handler(int fd, uint32_t mask, void *data)
 							  &tspec) == 0) {
 			TL_POINT(trp->output->compositor, tp_name, TLP_GPU(&tspec),
 				 TLP_OUTPUT(trp->output), TLP_END);
+
+			if (trp->type == TIMELINE_RENDER_POINT_TYPE_END &&
+			    trp->output->compositor->repaint_window_adaptive)
+				weston_output_repaint_gpu_done(trp->output,
+							       trp->repaint_seq,
+							       &tspec);
 		}
 	}
 
@@ -327,8 +410,15 @@ timeline_submit_render_sync(struct gl_renderer *gr,
 	struct wl_event_loop *loop;
 	int fd;
 	struct timeline_render_point *trp;
+	bool wanted;
+
+	/* The adaptive repaint window needs the GPU end time even when
+	 * nobody is subscribed to the timeline. */
+	wanted = weston_log_scope_is_enabled(gr->compositor->timeline) ||
+		 (type == TIMELINE_RENDER_POINT_TYPE_END &&
+		  gr->compositor->repaint_window_adaptive);
 
-	if (!weston_log_scope_is_enabled(gr->compositor->timeline) ||
+	if (!wanted ||
 	    !gr->has_native_fence_sync ||
 	    sync == EGL_NO_SYNC_KHR)
 		return;
@@ -349,6 +439,7 @@ timeline_submit_render_sync(struct gl_renderer *gr,
 	trp->type = type;
 	trp->fd = fd;
 	trp->output = output;
+	trp->repaint_seq = output->repaint_history.current_seq;
 	trp->event_source = wl_event_loop_add_fd(loop, fd,
 						 WL_EVENT_READABLE,
 						 timeline_render_point_handler,
@@ -428,79 +519,28 @@ dmabuf_image_destroy(struct dmabuf_image *image)
 	free(image);
 }
 
-#define max(a, b) (((a) > (b)) ? (a) : (b))
-#define min(a, b) (((a) > (b)) ? (b) : (a))
+/* Clip rectangles handed to clip_quad_boxes() at a time */
+#define CLIP_BOXES_MAX 64
 
 /*
- * Compute the boundary vertices of the intersection of the global coordinate
- * aligned rectangle 'rect', and an arbitrary quadrilateral produced from
- * 'surf_rect' when transformed from surface coordinates into global coordinates.
- * The vertices are written to 'ex' and 'ey', and the return value is the
- * number of vertices. Vertices are produced in clockwise winding order.
- * Guarantees to produce either zero vertices, or 3-8 vertices with non-zero
- * polygon area.
+ * Transform the surface coordinate rectangle 'surf_rect' into the
+ * quadrilateral it covers in global coordinates.
  */
-static int
-calculate_edges(struct weston_view *ev, pixman_box32_t *rect,
-		pixman_box32_t *surf_rect, GLfloat *ex, GLfloat *ey)
+static void
+transform_surface_rect(struct weston_view *ev, pixman_box32_t *surf_rect,
+		       struct polygon8 *quad)
 {
+	int i;
 
-	struct clip_context ctx;
-	int i, n;
-	GLfloat min_x, max_x, min_y, max_y;
-	struct polygon8 surf = {
+	*quad = (struct polygon8) {
 		{ surf_rect->x1, surf_rect->x2, surf_rect->x2, surf_rect->x1 },
 		{ surf_rect->y1, surf_rect->y1, surf_rect->y2, surf_rect->y2 },
 		4
 	};
 
-	ctx.clip.x1 = rect->x1;
-	ctx.clip.y1 = rect->y1;
-	ctx.clip.x2 = rect->x2;
-	ctx.clip.y2 = rect->y2;
-
-	/* transform surface to screen space: */
-	for (i = 0; i < surf.n; i++)
-		weston_view_to_global_float(ev, surf.x[i], surf.y[i],
-					    &surf.x[i], &surf.y[i]);
-
-	/* find bounding box: */
-	min_x = max_x = surf.x[0];
-	min_y = max_y = surf.y[0];
-
-	for (i = 1; i < surf.n; i++) {
-		min_x = min(min_x, surf.x[i]);
-		max_x = max(max_x, surf.x[i]);
-		min_y = min(min_y, surf.y[i]);
-		max_y = max(max_y, surf.y[i]);
-	}
-
-	/* First, simple bounding box check to discard early transformed
-	 * surface rects that do not intersect with the clip region:
-	 */
-	if ((min_x >= ctx.clip.x2) || (max_x <= ctx.clip.x1) ||
-	    (min_y >= ctx.clip.y2) || (max_y <= ctx.clip.y1))
-		return 0;
-
-	/* Simple case, bounding box edges are parallel to surface edges,
-	 * there will be only four edges.  We just need to clip the surface
-	 * vertices to the clip rect bounds:
-	 */
-	if (!ev->transform.enabled)
-		return clip_simple(&ctx, &surf, ex, ey);
-
-	/* Transformed case: use a general polygon clipping algorithm to
-	 * clip the surface rectangle with each side of 'rect'.
-	 * The algorithm is Sutherland-Hodgman, as explained in
-	 * http://www.codeguru.com/cpp/misc/misc/graphics/article.php/c8965/Polygon-Clipping.htm
-	 * but without looking at any of that code.
-	 */
-	n = clip_transformed(&ctx, &surf, ex, ey);
-
-	if (n < 3)
-		return 0;
-
-	return n;
+	for (i = 0; i < quad->n; i++)
+		weston_view_to_global_float(ev, quad->x[i], quad->y[i],
+					    &quad->x[i], &quad->y[i]);
 }
 
 static bool
@@ -517,7 +557,8 @@ merge_down(pixman_box32_t *a, pixman_box32_t *b, pixman_box32_t *merge)
 }
 
 static int
-compress_bands(pixman_box32_t *inrects, int nrects, pixman_box32_t **outrects)
+compress_bands(struct weston_output *output,
+	       pixman_box32_t *inrects, int nrects, pixman_box32_t **outrects)
 {
 	bool merged = false;
 	pixman_box32_t *out, merge_rect;
@@ -531,7 +572,11 @@ compress_bands(pixman_box32_t *inrects, int nrects, pixman_box32_t **outrects)
 	/* nrects is an upper bound - we're not too worried about
 	 * allocating a little extra
 	 */
-	out = malloc(sizeof(pixman_box32_t) * nrects);
+	out = weston_output_frame_alloc(output, sizeof(pixman_box32_t) * nrects);
+	if (!out) {
+		*outrects = inrects;
+		return nrects;
+	}
 	out[0] = inrects[0];
 	nout = 1;
 	for (i = 1; i < nrects; i++) {
@@ -553,28 +598,34 @@ compress_bands(pixman_box32_t *inrects, int nrects, pixman_box32_t **outrects)
 
 static int
 texture_region(struct weston_view *ev,
+	       struct weston_output *output,
 	       pixman_region32_t *region,
-	       pixman_region32_t *surf_region)
+	       pixman_region32_t *surf_region,
+	       const pixman_box32_t *cache_box)
 {
 	struct gl_surface_state *gs = get_surface_state(ev->surface);
 	struct weston_compositor *ec = ev->surface->compositor;
 	struct gl_renderer *gr = get_renderer(ec);
-	GLfloat *v, inv_width, inv_height;
+	GLfloat *v, inv_width, inv_height, tex_x, tex_y;
 	unsigned int *vtxcnt, nvtx = 0;
 	pixman_box32_t *rects, *surf_rects;
 	pixman_box32_t *raw_rects;
-	int i, j, k, nrects, nsurf, raw_nrects;
-	bool used_band_compression;
+	GLfloat x1[CLIP_BOXES_MAX], y1[CLIP_BOXES_MAX];
+	GLfloat x2[CLIP_BOXES_MAX], y2[CLIP_BOXES_MAX];
+	/* edge points in screen space */
+	GLfloat ex[CLIP_BOXES_MAX * 8], ey[CLIP_BOXES_MAX * 8];
+	int counts[CLIP_BOXES_MAX];
+	struct clip_boxes boxes = { x1, y1, x2, y2, 0 };
+	bool axis_aligned;
+	int base, i, j, k, p, nrects, nsurf, raw_nrects, npolygons;
 	raw_rects = pixman_region32_rectangles(region, &raw_nrects);
 	surf_rects = pixman_region32_rectangles(surf_region, &nsurf);
 
 	if (raw_nrects < 4) {
-		used_band_compression = false;
 		nrects = raw_nrects;
 		rects = raw_rects;
 	} else {
-		nrects = compress_bands(raw_rects, raw_nrects, &rects);
-		used_band_compression = true;
+		nrects = compress_bands(output, raw_rects, raw_nrects, &rects);
 	}
 	/* worst case we can have 8 vertices per rect (ie. clipped into
 	 * an octagon):
@@ -582,16 +633,39 @@ texture_region(struct weston_view *ev,
 	v = wl_array_add(&gr->vertices, nrects * nsurf * 8 * 4 * sizeof *v);
 	vtxcnt = wl_array_add(&gr->vtxcnt, nrects * nsurf * sizeof *vtxcnt);
 
-	inv_width = 1.0 / gs->pitch;
-        inv_height = 1.0 / gs->height;
+	if (gs->atlas_node >= 0) {
+		inv_width = 1.0 / GL_ATLAS_SIZE;
+		inv_height = 1.0 / GL_ATLAS_SIZE;
+		tex_x = gs->atlas_x;
+		tex_y = gs->atlas_y;
+	} else {
+		inv_width = 1.0 / gs->pitch;
+		inv_height = 1.0 / gs->height;
+		tex_x = 0;
+		tex_y = 0;
+	}
+
+	/* Without rotation, the surface rectangles stay axis aligned and
+	 * clipping them only needs to clamp the vertices to the clip rect.
+	 */
+	axis_aligned = !ev->transform.enabled ||
+		       !(ev->transform.matrix.type &
+			 (WESTON_MATRIX_TRANSFORM_ROTATE |
+			  WESTON_MATRIX_TRANSFORM_OTHER));
+
+	for (base = 0; base < nrects; base += CLIP_BOXES_MAX) {
+		boxes.n = MIN(nrects - base, CLIP_BOXES_MAX);
+		for (i = 0; i < boxes.n; i++) {
+			x1[i] = rects[base + i].x1;
+			y1[i] = rects[base + i].y1;
+			x2[i] = rects[base + i].x2;
+			y2[i] = rects[base + i].y2;
+		}
 
-	for (i = 0; i < nrects; i++) {
-		pixman_box32_t *rect = &rects[i];
 		for (j = 0; j < nsurf; j++) {
-			pixman_box32_t *surf_rect = &surf_rects[j];
+			struct polygon8 quad;
 			GLfloat sx, sy, bx, by;
-			GLfloat ex[8], ey[8];          /* edge points in screen space */
-			int n;
+			GLfloat *px = ex, *py = ey;
 
 			/* The transformed surface, after clipping to the clip region,
 			 * can have as many as eight sides, emitted as a triangle-fan.
@@ -604,38 +678,47 @@ texture_region(struct weston_view *ev,
 			 * intersection point(s) between the surface and the clip region.
 			 *
 			 * To do this, we first calculate the (up to eight) points that
-			 * form the intersection of the clip rect and the transformed
+			 * form the intersection of each clip rect and the transformed
 			 * surface.
 			 */
-			n = calculate_edges(ev, rect, surf_rect, ex, ey);
-			if (n < 3)
-				continue;
-
-			/* emit edge points: */
-			for (k = 0; k < n; k++) {
-				weston_view_from_global_float(ev, ex[k], ey[k],
-							      &sx, &sy);
-				/* position: */
-				*(v++) = ex[k];
-				*(v++) = ey[k];
-				/* texcoord: */
-				weston_surface_to_buffer_float(ev->surface,
-							       sx, sy,
-							       &bx, &by);
-				*(v++) = bx * inv_width;
-				if (gs->y_inverted) {
-					*(v++) = by * inv_height;
-				} else {
-					*(v++) = (gs->height - by) * inv_height;
+			transform_surface_rect(ev, &surf_rects[j], &quad);
+			npolygons = clip_quad_boxes(&quad, axis_aligned, &boxes,
+						    ex, ey, counts);
+
+			for (p = 0; p < npolygons; p++) {
+				/* emit edge points: */
+				for (k = 0; k < counts[p]; k++) {
+					weston_view_from_global_float(ev, px[k], py[k],
+								      &sx, &sy);
+					/* position: */
+					*(v++) = px[k];
+					*(v++) = py[k];
+					/* texcoord: */
+					if (cache_box) {
+						*(v++) = (sx - cache_box->x1) /
+							 (cache_box->x2 - cache_box->x1);
+						*(v++) = (sy - cache_box->y1) /
+							 (cache_box->y2 - cache_box->y1);
+						continue;
+					}
+					weston_surface_to_buffer_float(ev->surface,
+								       sx, sy,
+								       &bx, &by);
+					*(v++) = (tex_x + bx) * inv_width;
+					if (gs->y_inverted) {
+						*(v++) = (tex_y + by) * inv_height;
+					} else {
+						*(v++) = (gs->height - by) * inv_height;
+					}
 				}
-			}
 
-			vtxcnt[nvtx++] = n;
+				px += counts[p];
+				py += counts[p];
+				vtxcnt[nvtx++] = counts[p];
+			}
 		}
 	}
 
-	if (used_band_compression)
-		free(rects);
 	return nvtx;
 }
 
@@ -757,7 +840,9 @@ triangle_fan_debug(struct gl_renderer *gr,
 
 	nelems = (count - 1 + count - 2) * 2;
 
-	buffer = malloc(sizeof(GLushort) * nelems);
+	buffer = weston_output_frame_alloc(output, sizeof(GLushort) * nelems);
+	if (!buffer)
+		return;
 	index = buffer;
 
 	for (i = 1; i < count; i++) {
@@ -772,18 +857,91 @@ triangle_fan_debug(struct gl_renderer *gr,
 
 	glDrawElements(GL_LINES, nelems, GL_UNSIGNED_SHORT, buffer);
 
-	free(buffer);
-
 	gl_renderer_use_program(gr, sconf);
 }
 
+static void
+set_vertex_pointers(const GLfloat *v, unsigned int base)
+{
+	/* position: */
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v,
+			      &v[base * 4]);
+	/* texcoord: */
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v,
+			      &v[base * 4 + 2]);
+}
+
+static void
+draw_triangles(struct gl_renderer *gr, const GLfloat *v, unsigned int base,
+	       const GLushort *indices, unsigned int count)
+{
+	if (count == 0)
+		return;
+
+	set_vertex_pointers(v, base);
+	glDrawElements(GL_TRIANGLES, count, GL_UNSIGNED_SHORT, indices);
+	gr->frame_stats.draws++;
+}
+
+/* Draw the triangle fans produced by texture_region() as indexed triangle
+ * lists: one draw call for up to 64k vertices instead of one per fan.
+ * The triangles are the same ones a fan would produce, so the result is
+ * identical.
+ */
+static void
+draw_triangle_fans(struct gl_renderer *gr, const GLfloat *v,
+		   const unsigned int *vtxcnt, int nfans)
+{
+	GLushort *indices, *index, *batch;
+	unsigned int ntris = 0;
+	unsigned int base = 0;
+	unsigned int first = 0;
+	unsigned int j;
+	int i;
+
+	for (i = 0; i < nfans; i++)
+		ntris += vtxcnt[i] - 2;
+
+	indices = wl_array_add(&gr->indices, ntris * 3 * sizeof *indices);
+	if (!indices) {
+		set_vertex_pointers(v, 0);
+		for (i = 0; i < nfans; i++) {
+			glDrawArrays(GL_TRIANGLE_FAN, first, vtxcnt[i]);
+			gr->frame_stats.draws++;
+			first += vtxcnt[i];
+		}
+		return;
+	}
+
+	batch = index = indices;
+	for (i = 0; i < nfans; i++) {
+		/* Indices are relative to base and must fit 16 bits. */
+		if (first + vtxcnt[i] - base > UINT16_MAX + 1u) {
+			draw_triangles(gr, v, base, batch, index - batch);
+			base = first;
+			batch = index;
+		}
+
+		for (j = 1; j + 1 < vtxcnt[i]; j++) {
+			*index++ = first - base;
+			*index++ = first - base + j;
+			*index++ = first - base + j + 1;
+		}
+		first += vtxcnt[i];
+	}
+	draw_triangles(gr, v, base, batch, index - batch);
+
+	gr->indices.size = 0;
+}
+
 static void
 repaint_region(struct gl_renderer *gr,
 	       struct weston_view *ev,
 	       struct weston_output *output,
 	       pixman_region32_t *region,
 	       pixman_region32_t *surf_region,
-	       const struct gl_shader_config *sconf)
+	       const struct gl_shader_config *sconf,
+	       const pixman_box32_t *cache_box)
 {
 	GLfloat *v;
 	unsigned int *vtxcnt;
@@ -796,18 +954,16 @@ repaint_region(struct gl_renderer *gr,
 	 * rectangles from both regions, compute the intersection
 	 * polygon for each pair, and store it as a triangle fan if
 	 * it has a non-zero area (at least 3 vertices, actually).
+	 *
+	 * With a cache_box, 'ev' is the root of a cached subtree and the
+	 * texture coordinates address the cache texture instead.
 	 */
-	nfans = texture_region(ev, region, surf_region);
+	nfans = texture_region(ev, output, region, surf_region, cache_box);
 
 	v = gr->vertices.data;
 	vtxcnt = gr->vtxcnt.data;
 
-	/* position: */
-	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v, &v[0]);
 	glEnableVertexAttribArray(0);
-
-	/* texcoord: */
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v, &v[2]);
 	glEnableVertexAttribArray(1);
 
 	if (!gl_renderer_use_program(gr, sconf)) {
@@ -815,13 +971,22 @@ repaint_region(struct gl_renderer *gr,
 		/* continue drawing with the fallback shader */
 	}
 
-	for (i = 0, first = 0; i < nfans; i++) {
-		glDrawArrays(GL_TRIANGLE_FAN, first, vtxcnt[i]);
-		if (gr->fan_debug)
+	if (gr->fan_debug) {
+		/* Fans are drawn one by one to outline each of them. */
+		set_vertex_pointers(v, 0);
+		for (i = 0, first = 0; i < nfans; i++) {
+			glDrawArrays(GL_TRIANGLE_FAN, first, vtxcnt[i]);
+			gr->frame_stats.draws++;
 			triangle_fan_debug(gr, sconf, output, first, vtxcnt[i]);
-		first += vtxcnt[i];
+			first += vtxcnt[i];
+		}
+	} else {
+		draw_triangle_fans(gr, v, vtxcnt, nfans);
 	}
 
+	for (i = 0; i < nfans; i++)
+		gr->frame_stats.vertices += vtxcnt[i];
+
 	glDisableVertexAttribArray(1);
 	glDisableVertexAttribArray(0);
 
@@ -995,6 +1160,9 @@ gl_shader_config_set_input_textures(struct gl_shader_config *sconf,
 		sconf->input_tex[i] = gs->textures[i];
 	for (; i < GL_SHADER_INPUT_TEX_MAX; i++)
 		sconf->input_tex[i] = 0;
+
+	if (gs->atlas_node >= 0)
+		sconf->input_tex[0] = get_renderer(gs->surface->compositor)->atlas.tex;
 }
 
 static bool
@@ -1024,9 +1192,12 @@ gl_shader_config_init_for_paint_node(struct gl_shader_config *sconf,
 	return true;
 }
 
+/* With a projection, the paint node is drawn unclipped and opaque into a
+ * subtree cache instead of the output, see gl_subtree_cache_render(). */
 static void
 draw_paint_node(struct weston_paint_node *pnode,
-		pixman_region32_t *damage /* in global coordinates */)
+		pixman_region32_t *damage /* in global coordinates */,
+		const struct weston_matrix *projection)
 {
 	struct gl_renderer *gr = get_renderer(pnode->surface->compositor);
 	struct gl_surface_state *gs = get_surface_state(pnode->surface);
@@ -1046,9 +1217,17 @@ draw_paint_node(struct weston_paint_node *pnode,
 		return;
 
 	pixman_region32_init(&repaint);
-	pixman_region32_intersect(&repaint,
-				  &pnode->view->transform.boundingbox, damage);
-	pixman_region32_subtract(&repaint, &repaint, &pnode->view->clip);
+	if (projection) {
+		/* transform.boundingbox is clipped to the layer mask, but
+		 * the cache must hold the whole view. */
+		pixman_region32_copy(&repaint, damage);
+	} else {
+		pixman_region32_intersect(&repaint,
+					  &pnode->view->transform.boundingbox,
+					  damage);
+		pixman_region32_subtract(&repaint, &repaint,
+					 &pnode->view->clip);
+	}
 
 	if (!pixman_region32_not_empty(&repaint))
 		goto out;
@@ -1058,7 +1237,8 @@ draw_paint_node(struct weston_paint_node *pnode,
 
 	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
 
-	if (pnode->view->transform.enabled || pnode->output->zoom.active ||
+	if ((!projection && (pnode->view->transform.enabled ||
+			     pnode->output->zoom.active)) ||
 	    pnode->output->current_scale != pnode->surface->buffer_viewport.buffer.scale)
 		filter = GL_LINEAR;
 	else
@@ -1067,6 +1247,11 @@ draw_paint_node(struct weston_paint_node *pnode,
 	if (!gl_shader_config_init_for_paint_node(&sconf, pnode, filter))
 		goto out;
 
+	if (projection) {
+		sconf.projection = *projection;
+		sconf.view_alpha = 1.0f;
+	}
+
 	/* blended region is whole surface minus opaque region: */
 	pixman_region32_init_rect(&surface_blend, 0, 0,
 				  pnode->surface->width, pnode->surface->height);
@@ -1099,20 +1284,20 @@ draw_paint_node(struct weston_paint_node *pnode,
 			alt.req.variant = SHADER_VARIANT_RGBX;
 		}
 
-		if (pnode->view->alpha < 1.0)
+		if (sconf.view_alpha < 1.0)
 			glEnable(GL_BLEND);
 		else
 			glDisable(GL_BLEND);
 
 		repaint_region(gr, pnode->view, pnode->output,
-			       &repaint, &surface_opaque, &alt);
+			       &repaint, &surface_opaque, &alt, NULL);
 		gs->used_in_output_repaint = true;
 	}
 
 	if (pixman_region32_not_empty(&surface_blend)) {
 		glEnable(GL_BLEND);
 		repaint_region(gr, pnode->view, pnode->output,
-			       &repaint, &surface_blend, &sconf);
+			       &repaint, &surface_blend, &sconf, NULL);
 		gs->used_in_output_repaint = true;
 	}
 
@@ -1123,16 +1308,424 @@ out:
 	pixman_region32_fini(&repaint);
 }
 
+/* A subtree has to be unchanged for this many repaints before it is
+ * flattened, so that content updated every frame is not rendered twice. */
+#define GL_SUBTREE_CACHE_MIN_STABLE 2
+/* Release caches that were not drawn for this many repaints */
+#define GL_SUBTREE_CACHE_IDLE_FRAMES 120
+#define GL_SUBTREE_CACHE_MAX_SIZE 4096
+
+static struct weston_paint_node *
+prev_paint_node(struct weston_paint_node *pnode)
+{
+	return container_of(pnode->z_order_link.prev,
+			    struct weston_paint_node, z_order_link);
+}
+
+static struct weston_view *
+subtree_root(struct weston_view *view)
+{
+	while (view->geometry.parent)
+		view = view->geometry.parent;
+
+	return view;
+}
+
+static bool
+gl_subtree_member_init(struct gl_subtree_member *member,
+		       struct weston_paint_node *pnode,
+		       struct weston_view *root)
+{
+	struct gl_surface_state *gs = get_surface_state(pnode->surface);
+	struct weston_view *view;
+
+	if (gs->shader_variant == SHADER_VARIANT_NONE ||
+	    gs->direct_display ||
+	    pnode->surface->desired_protection > WESTON_HDCP_DISABLE ||
+	    !pnode->surf_xform_valid ||
+	    pnode->view->geometry.scissor_enabled ||
+	    pnode->view->alpha != root->alpha)
+		return false;
+
+	/* Only translations may lie between a member and the root */
+	member->x = 0.0f;
+	member->y = 0.0f;
+	for (view = pnode->view; view != root; view = view->geometry.parent) {
+		/* transform.position is always in transformation_list */
+		if (view->geometry.transformation_list.next !=
+		    &view->transform.position.link ||
+		    view->geometry.transformation_list.prev !=
+		    &view->transform.position.link)
+			return false;
+
+		member->x += view->geometry.x;
+		member->y += view->geometry.y;
+	}
+
+	member->view = pnode->view;
+	member->xform_id = pnode->surf_xform.transform ?
+			   pnode->surf_xform.transform->id : 0;
+	member->content_serial = gs->content_serial;
+	member->width = pnode->surface->width;
+	member->height = pnode->surface->height;
+
+	return true;
+}
+
+static bool
+gl_subtree_members_equal(const struct gl_subtree_member *a,
+			 const struct gl_subtree_member *b, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (a[i].view != b[i].view ||
+		    a[i].xform_id != b[i].xform_id ||
+		    a[i].content_serial != b[i].content_serial ||
+		    a[i].x != b[i].x || a[i].y != b[i].y ||
+		    a[i].width != b[i].width || a[i].height != b[i].height)
+			return false;
+	}
+
+	return true;
+}
+
+static void
+gl_subtree_cache_destroy(struct gl_subtree_cache *cache)
+{
+	if (cache->fbo.tex)
+		gl_fbo_texture_fini(&cache->fbo);
+	wl_array_release(&cache->members);
+	wl_list_remove(&cache->link);
+	cache->owner->subtree_cache = NULL;
+	free(cache);
+}
+
+static void
+gl_renderer_garbage_collect_subtree_caches(struct gl_renderer *gr)
+{
+	struct gl_subtree_cache *cache, *tmp;
+
+	wl_list_for_each_safe(cache, tmp, &gr->subtree_cache_list, link) {
+		if (gr->subtree_cache_frame - cache->last_used >
+		    GL_SUBTREE_CACHE_IDLE_FRAMES)
+			gl_subtree_cache_destroy(cache);
+	}
+}
+
+/** Compare the subtree with the cached one and track how long it is stable
+ *
+ * \return true if the subtree should be drawn from the cache.
+ */
+static bool
+gl_subtree_cache_update(struct gl_renderer *gr, struct gl_surface_state *gs,
+			struct weston_output *output,
+			const struct gl_subtree_member *members, int count,
+			const pixman_box32_t *box)
+{
+	struct gl_subtree_cache *cache = gs->subtree_cache;
+	size_t size = count * sizeof *members;
+	void *copy;
+
+	if (!cache) {
+		cache = zalloc(sizeof *cache);
+		if (!cache)
+			return false;
+
+		cache->owner = gs;
+		wl_array_init(&cache->members);
+		wl_list_insert(&gr->subtree_cache_list, &cache->link);
+		gs->subtree_cache = cache;
+	}
+
+	cache->last_used = gr->subtree_cache_frame;
+
+	if (cache->output == output &&
+	    cache->members.size == size &&
+	    cache->scale == output->current_scale &&
+	    gl_subtree_members_equal(cache->members.data, members, count)) {
+		if (cache->stable_frames < GL_SUBTREE_CACHE_MIN_STABLE)
+			cache->stable_frames++;
+		return cache->stable_frames >= GL_SUBTREE_CACHE_MIN_STABLE;
+	}
+
+	cache->members.size = 0;
+	copy = wl_array_add(&cache->members, size);
+	if (!copy) {
+		cache->output = NULL;
+		return false;
+	}
+	memcpy(copy, members, size);
+
+	cache->output = output;
+	cache->box = *box;
+	cache->scale = output->current_scale;
+	cache->stable_frames = 0;
+	cache->fbo_valid = false;
+
+	return false;
+}
+
+/* The cache box of the root in global coordinates, ignoring the layer
+ * mask so that moving the root does not leave clipped content behind */
+static void
+gl_subtree_cache_global_region(struct gl_subtree_cache *cache,
+			       struct weston_view *root,
+			       pixman_region32_t *region)
+{
+	const pixman_box32_t *box = &cache->box;
+	float corners[4][2] = {
+		{ box->x1, box->y1 }, { box->x2, box->y1 },
+		{ box->x1, box->y2 }, { box->x2, box->y2 },
+	};
+	float min_x = HUGE_VALF, min_y = HUGE_VALF;
+	float max_x = -HUGE_VALF, max_y = -HUGE_VALF;
+	float x, y;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		weston_view_to_global_float(root, corners[i][0],
+					    corners[i][1], &x, &y);
+		min_x = MIN(min_x, x);
+		min_y = MIN(min_y, y);
+		max_x = MAX(max_x, x);
+		max_y = MAX(max_y, y);
+	}
+
+	pixman_region32_init_rect(region, floorf(min_x), floorf(min_y),
+				  ceilf(max_x) - floorf(min_x),
+				  ceilf(max_y) - floorf(min_y));
+}
+
+/* Render the views from first to last into the cache of the root */
+static bool
+gl_subtree_cache_render(struct gl_subtree_cache *cache,
+			struct weston_view *root,
+			struct weston_paint_node *first,
+			struct weston_paint_node *last)
+{
+	const pixman_box32_t *box = &cache->box;
+	struct weston_paint_node *pnode;
+	struct weston_matrix projection;
+	pixman_region32_t region;
+	GLint prev_fbo;
+	GLint viewport[4];
+	int32_t width = (box->x2 - box->x1) * cache->scale;
+	int32_t height = (box->y2 - box->y1) * cache->scale;
+
+	if (cache->fbo.tex &&
+	    (cache->fbo.width != width || cache->fbo.height != height))
+		gl_fbo_texture_fini(&cache->fbo);
+
+	if (!cache->fbo.tex) {
+		if (!gl_fbo_texture_init(&cache->fbo, width, height,
+					 GL_RGBA, GL_RGBA, GL_UNSIGNED_BYTE))
+			return false;
+
+		/* the quad may be sampled with GL_LINEAR */
+		glBindTexture(GL_TEXTURE_2D, cache->fbo.tex);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S,
+				GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T,
+				GL_CLAMP_TO_EDGE);
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+
+	/* global to root surface coordinates, then the box to clip space */
+	if (root->transform.enabled) {
+		projection = root->transform.inverse;
+	} else {
+		weston_matrix_init(&projection);
+		weston_matrix_translate(&projection, -root->geometry.x,
+					-root->geometry.y, 0);
+	}
+	weston_matrix_translate(&projection, -box->x1, -box->y1, 0);
+	weston_matrix_scale(&projection, 2.0 / (box->x2 - box->x1),
+			    2.0 / (box->y2 - box->y1), 1);
+	weston_matrix_translate(&projection, -1, -1, 0);
+
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &prev_fbo);
+	glGetIntegerv(GL_VIEWPORT, viewport);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, cache->fbo.fbo);
+	glViewport(0, 0, width, height);
+	glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	gl_subtree_cache_global_region(cache, root, &region);
+	for (pnode = first; ; pnode = prev_paint_node(pnode)) {
+		draw_paint_node(pnode, &region, &projection);
+		if (pnode == last)
+			break;
+	}
+	pixman_region32_fini(&region);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, prev_fbo);
+	glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+
+	cache->fbo_valid = true;
+
+	return true;
+}
+
+static void
+gl_subtree_cache_draw(struct gl_subtree_cache *cache,
+		      struct weston_view *root,
+		      struct weston_output *output,
+		      pixman_region32_t *repaint)
+{
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	struct gl_output_state *go = get_output_state(output);
+	struct gl_shader_config sconf = {
+		.req = {
+			.variant = SHADER_VARIANT_RGBA,
+			.input_is_premult = true,
+		},
+		.projection = go->output_matrix,
+		.view_alpha = root->alpha,
+		.input_tex[0] = cache->fbo.tex,
+	};
+	pixman_region32_t box;
+
+	if (root->transform.enabled || output->zoom.active)
+		sconf.input_tex_filter = GL_LINEAR;
+	else
+		sconf.input_tex_filter = GL_NEAREST;
+
+	/* the cache is already in blending space */
+	if (!gl_shader_config_set_color_transform(&sconf, NULL))
+		return;
+
+	pixman_region32_init_rect(&box, cache->box.x1, cache->box.y1,
+				  cache->box.x2 - cache->box.x1,
+				  cache->box.y2 - cache->box.y1);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	repaint_region(gr, root, output, repaint, &box, &sconf, &cache->box);
+	pixman_region32_fini(&box);
+}
+
+/** Draw the subtree whose bottom-most paint node on the primary plane is first
+ *
+ * Consecutive paint nodes of one subtree on the primary plane are drawn
+ * from its cache when all of them can be flattened and they have not
+ * changed for a few repaints, and one by one otherwise.
+ *
+ * \return The top-most paint node of the subtree that was drawn, or NULL
+ * if first is not part of a subtree.
+ */
+static struct weston_paint_node *
+repaint_subtree(struct weston_paint_node *first, pixman_region32_t *damage)
+{
+	struct weston_output *output = first->output;
+	struct weston_compositor *compositor = output->compositor;
+	struct gl_renderer *gr = get_renderer(compositor);
+	struct weston_view *root = subtree_root(first->view);
+	struct gl_surface_state *gs = get_surface_state(root->surface);
+	struct weston_paint_node *pnode, *last = NULL;
+	struct gl_subtree_member *members;
+	pixman_region32_t repaint;
+	pixman_box32_t box = { INT32_MAX, INT32_MAX, INT32_MIN, INT32_MIN };
+	bool cached = !gr->fan_debug;
+	bool has_root = false;
+	int count = 0;
+
+	if (first->view->plane != &compositor->primary_plane ||
+	    (root == first->view && wl_list_empty(&root->geometry.child_list)))
+		return NULL;
+
+	for (pnode = first;
+	     &pnode->z_order_link != &output->paint_node_z_order_list &&
+	     pnode->view->plane == &compositor->primary_plane &&
+	     subtree_root(pnode->view) == root;
+	     pnode = prev_paint_node(pnode)) {
+		last = pnode;
+		count++;
+	}
+
+	pixman_region32_init(&repaint);
+	members = weston_output_frame_alloc(output, count * sizeof *members);
+	if (!members || count < 2)
+		cached = false;
+
+	count = 0;
+	for (pnode = first; ; pnode = prev_paint_node(pnode)) {
+		struct gl_subtree_member *m = cached ? &members[count] : NULL;
+
+		pixman_region32_union(&repaint, &repaint,
+				      &pnode->view->transform.boundingbox);
+
+		if (m && gl_subtree_member_init(m, pnode, root)) {
+			box.x1 = MIN(box.x1, (int32_t)floorf(m->x));
+			box.y1 = MIN(box.y1, (int32_t)floorf(m->y));
+			box.x2 = MAX(box.x2, (int32_t)ceilf(m->x + m->width));
+			box.y2 = MAX(box.y2, (int32_t)ceilf(m->y + m->height));
+			has_root |= pnode->view == root;
+		} else {
+			cached = false;
+		}
+
+		count++;
+		if (pnode == last)
+			break;
+	}
+
+	pixman_region32_intersect(&repaint, &repaint, damage);
+	if (!pixman_region32_not_empty(&repaint))
+		goto out;
+
+	if (!has_root || box.x1 >= box.x2 || box.y1 >= box.y2 ||
+	    (box.x2 - box.x1) * output->current_scale > GL_SUBTREE_CACHE_MAX_SIZE ||
+	    (box.y2 - box.y1) * output->current_scale > GL_SUBTREE_CACHE_MAX_SIZE)
+		cached = false;
+
+	if (cached)
+		cached = gl_subtree_cache_update(gr, gs, output,
+						 members, count, &box);
+
+	if (cached && !gs->subtree_cache->fbo_valid &&
+	    !gl_subtree_cache_render(gs->subtree_cache, root, first, last)) {
+		gs->subtree_cache->stable_frames = 0;
+		cached = false;
+	}
+
+	if (cached) {
+		gl_subtree_cache_draw(gs->subtree_cache, root, output, &repaint);
+		goto out;
+	}
+
+	for (pnode = first; ; pnode = prev_paint_node(pnode)) {
+		if (!pnode->is_fully_occluded)
+			draw_paint_node(pnode, damage, NULL);
+		if (pnode == last)
+			break;
+	}
+
+out:
+	pixman_region32_fini(&repaint);
+	return last;
+}
+
 static void
 repaint_views(struct weston_output *output, pixman_region32_t *damage)
 {
 	struct weston_compositor *compositor = output->compositor;
-	struct weston_paint_node *pnode;
+	struct gl_renderer *gr = get_renderer(compositor);
+	struct weston_paint_node *pnode, *last;
 
 	wl_list_for_each_reverse(pnode, &output->paint_node_z_order_list,
 				 z_order_link) {
-		if (pnode->view->plane == &compositor->primary_plane)
-			draw_paint_node(pnode, damage);
+		if (gr->subtree_cache) {
+			last = repaint_subtree(pnode, damage);
+			if (last) {
+				pnode = last;
+				continue;
+			}
+		}
+
+		if (pnode->view->plane == &compositor->primary_plane &&
+		    !pnode->is_fully_occluded)
+			draw_paint_node(pnode, damage, NULL);
 	}
 }
 
@@ -1384,7 +1977,12 @@ output_get_border_damage(struct weston_output *output,
 					   full_width, bottom->height);
 }
 
-static void
+/** Compute the damage of the back buffer since it was last drawn
+ *
+ * \return NULL if only that damage needs to be redrawn, otherwise why the
+ * whole output has to be repainted.
+ */
+static const char *
 output_get_damage(struct weston_output *output,
 		  pixman_region32_t *buffer_damage, uint32_t *border_damage)
 {
@@ -1405,25 +2003,35 @@ output_get_damage(struct weston_output *output,
 		buffer_age = 1;
 	}
 
-	if (buffer_age == 0 || buffer_age - 1 > BUFFER_DAMAGE_COUNT) {
+	if (buffer_age == 0) {
 		pixman_region32_copy(buffer_damage, &output->region);
 		*border_damage = BORDER_ALL_DIRTY;
-	} else {
-		for (i = 0; i < buffer_age - 1; i++)
-			*border_damage |= go->border_damage[(go->buffer_damage_index + i) % BUFFER_DAMAGE_COUNT];
-
-		if (*border_damage & BORDER_SIZE_CHANGED) {
-			/* If we've had a resize, we have to do a full
-			 * repaint. */
-			*border_damage |= BORDER_ALL_DIRTY;
-			pixman_region32_copy(buffer_damage, &output->region);
-		} else {
-			for (i = 0; i < buffer_age - 1; i++)
-				pixman_region32_union(buffer_damage,
-						      buffer_damage,
-						      &go->buffer_damage[(go->buffer_damage_index + i) % BUFFER_DAMAGE_COUNT]);
-		}
+		return "unknown buffer contents";
 	}
+
+	if (buffer_age - 1 > go->buffer_damage_count) {
+		pixman_region32_copy(buffer_damage, &output->region);
+		*border_damage = BORDER_ALL_DIRTY;
+		return "buffer older than damage history";
+	}
+
+	for (i = 0; i < buffer_age - 1; i++)
+		*border_damage |= go->border_damage[(go->buffer_damage_index + i) % go->buffer_damage_count];
+
+	if (*border_damage & BORDER_SIZE_CHANGED) {
+		/* If we've had a resize, we have to do a full
+		 * repaint. */
+		*border_damage |= BORDER_ALL_DIRTY;
+		pixman_region32_copy(buffer_damage, &output->region);
+		return "border size changed";
+	}
+
+	for (i = 0; i < buffer_age - 1; i++)
+		pixman_region32_union(buffer_damage,
+				      buffer_damage,
+				      &go->buffer_damage[(go->buffer_damage_index + i) % go->buffer_damage_count]);
+
+	return NULL;
 }
 
 static void
@@ -1437,8 +2045,8 @@ output_rotate_damage(struct weston_output *output,
 	if (!gr->has_egl_buffer_age)
 		return;
 
-	go->buffer_damage_index += BUFFER_DAMAGE_COUNT - 1;
-	go->buffer_damage_index %= BUFFER_DAMAGE_COUNT;
+	go->buffer_damage_index += go->buffer_damage_count - 1;
+	go->buffer_damage_index %= go->buffer_damage_count;
 
 	pixman_region32_copy(&go->buffer_damage[go->buffer_damage_index], output_damage);
 	go->border_damage[go->buffer_damage_index] = border_status;
@@ -1457,12 +2065,15 @@ output_rotate_damage(struct weston_output *output,
  *
  * @param output The output whose co-ordinate space we are after
  * @param global_region The affected region in global co-ordinate space
- * @param[out] rects Y-inverted quads in {x,y,w,h} order; caller must free
+ * @param border_status The borders to add to the region
+ * @param[out] rects Y-inverted quads in {x,y,w,h} order, valid until the
+ *                   next repaint of the output; NULL on allocation failure
  * @param[out] nrects Number of quads (4x number of co-ordinates)
  */
 static void
 pixman_region_to_egl_y_invert(struct weston_output *output,
 			      struct pixman_region32 *global_region,
+			      enum gl_border_status border_status,
 			      EGLint **rects,
 			      EGLint *nrects)
 {
@@ -1489,14 +2100,19 @@ pixman_region_to_egl_y_invert(struct weston_output *output,
 		pixman_region32_translate(&transformed,
 					  go->borders[GL_RENDERER_BORDER_LEFT].width,
 					  go->borders[GL_RENDERER_BORDER_TOP].height);
-		output_get_border_damage(output, go->border_status,
+		output_get_border_damage(output, border_status,
 					 &transformed);
 	}
 
 	/* Convert from a Pixman region into {x,y,w,h} quads, flipping in the
 	 * Y axis to account for GL's lower-left-origin co-ordinate space. */
 	box = pixman_region32_rectangles(&transformed, nrects);
-	*rects = malloc(*nrects * 4 * sizeof(EGLint));
+	*rects = weston_output_frame_alloc(output, *nrects * 4 * sizeof(EGLint));
+	if (!*rects) {
+		*nrects = 0;
+		pixman_region32_fini(&transformed);
+		return;
+	}
 
 	buffer_height = go->borders[GL_RENDERER_BORDER_TOP].height +
 			output->current_mode->height +
@@ -1612,6 +2228,7 @@ gl_renderer_repaint_output(struct weston_output *output,
 	pixman_region32_t total_damage;
 	enum gl_border_status border_status = BORDER_STATUS_CLEAN;
 	struct weston_paint_node *pnode;
+	const char *full_repaint;
 
 	assert(output->from_blend_to_output_by_backend ||
 	       output->from_blend_to_output == NULL || shadow_exists(go));
@@ -1619,6 +2236,10 @@ gl_renderer_repaint_output(struct weston_output *output,
 	if (use_output(output) < 0)
 		return;
 
+	gr->frame_stats.draws = 0;
+	gr->frame_stats.vertices = 0;
+	gr->subtree_cache_frame++;
+
 	/* Clear the used_in_output_repaint flag, so that we can properly track
 	 * which surfaces were used in this output repaint. */
 	wl_list_for_each_reverse(pnode, &output->paint_node_z_order_list,
@@ -1684,9 +2305,14 @@ gl_renderer_repaint_output(struct weston_output *output,
 
 	/* Update previous_damage using buffer_age (if available), and store
 	 * current damaged region for future use. */
-	output_get_damage(output, &previous_damage, &border_status);
+	full_repaint = output_get_damage(output, &previous_damage,
+					 &border_status);
 	output_rotate_damage(output, output_damage, go->border_status);
 
+	go->repaint_count++;
+	if (full_repaint)
+		go->full_repaint_count++;
+
 	/* Redraw both areas which have changed since we last used this buffer,
 	 * as well as the areas we now want to repaint, to make sure the
 	 * buffer is up to date. */
@@ -1701,10 +2327,10 @@ gl_renderer_repaint_output(struct weston_output *output,
 		 * changed since we last rendered into this specific buffer;
 		 * this is total_damage. */
 		pixman_region_to_egl_y_invert(output, &total_damage,
+					      border_status,
 					      &egl_rects, &n_egl_rects);
 		gr->set_damage_region(gr->egl_display, go->egl_surface,
 				      egl_rects, n_egl_rects);
-		free(egl_rects);
 	}
 
 	if (shadow_exists(go)) {
@@ -1724,6 +2350,20 @@ gl_renderer_repaint_output(struct weston_output *output,
 		repaint_views(output, &total_damage);
 	}
 
+	if (weston_log_scope_is_enabled(gr->draw_scope)) {
+		weston_log_scope_printf(gr->draw_scope,
+					"%s: %u draw calls, %u vertices\n",
+					output->name, gr->frame_stats.draws,
+					gr->frame_stats.vertices);
+		if (full_repaint)
+			weston_log_scope_printf(gr->draw_scope,
+						"%s: full repaint, %s "
+						"(%u of %u repaints)\n",
+						output->name, full_repaint,
+						go->full_repaint_count,
+						go->repaint_count);
+	}
+
 	pixman_region32_fini(&total_damage);
 	pixman_region32_fini(&previous_damage);
 
@@ -1741,11 +2381,11 @@ gl_renderer_repaint_output(struct weston_output *output,
 		 * which has changed since the previous SwapBuffers on this
 		 * surface - this is output_damage. */
 		pixman_region_to_egl_y_invert(output, output_damage,
+					      go->border_status,
 					      &egl_rects, &n_egl_rects);
 		ret = gr->swap_buffers_with_damage(gr->egl_display,
 						   go->egl_surface,
 						   egl_rects, n_egl_rects);
-		free(egl_rects);
 	} else {
 		ret = eglSwapBuffers(gr->egl_display, go->egl_surface);
 	}
@@ -1769,6 +2409,22 @@ gl_renderer_repaint_output(struct weston_output *output,
 	update_buffer_release_fences(compositor, output);
 
 	gl_renderer_garbage_collect_programs(gr);
+	gl_renderer_garbage_collect_subtree_caches(gr);
+}
+
+static bool
+read_format_to_gl(pixman_format_code_t format, GLenum *gl_format)
+{
+	switch (format) {
+	case PIXMAN_a8r8g8b8:
+		*gl_format = GL_BGRA_EXT;
+		return true;
+	case PIXMAN_a8b8g8r8:
+		*gl_format = GL_RGBA;
+		return true;
+	default:
+		return false;
+	}
 }
 
 static int
@@ -1783,16 +2439,8 @@ gl_renderer_read_pixels(struct weston_output *output,
 	x += go->borders[GL_RENDERER_BORDER_LEFT].width;
 	y += go->borders[GL_RENDERER_BORDER_BOTTOM].height;
 
-	switch (format) {
-	case PIXMAN_a8r8g8b8:
-		gl_format = GL_BGRA_EXT;
-		break;
-	case PIXMAN_a8b8g8r8:
-		gl_format = GL_RGBA;
-		break;
-	default:
+	if (!read_format_to_gl(format, &gl_format))
 		return -1;
-	}
 
 	if (use_output(output) < 0)
 		return -1;
@@ -1804,6 +2452,185 @@ gl_renderer_read_pixels(struct weston_output *output,
 	return 0;
 }
 
+static void
+gl_readback_destroy(struct gl_readback *rb)
+{
+	struct gl_renderer *gr = get_renderer(rb->output->compositor);
+	struct gl_output_state *go = get_output_state(rb->output);
+
+	wl_list_remove(&rb->link);
+	if (rb->event_source)
+		wl_event_source_remove(rb->event_source);
+	if (rb->fd >= 0)
+		close(rb->fd);
+	if (rb->sync != EGL_NO_SYNC_KHR)
+		gr->destroy_sync(gr->egl_display, rb->sync);
+
+	/* Keep the largest buffer around for the next readback, a
+	 * screenshooter or recorder usually asks for the same size again. */
+	if (rb->size > go->readback_pbo_size) {
+		if (go->readback_pbo)
+			glDeleteBuffers(1, &go->readback_pbo);
+		go->readback_pbo = rb->pbo;
+		go->readback_pbo_size = rb->size;
+	} else {
+		glDeleteBuffers(1, &rb->pbo);
+	}
+
+	free(rb);
+}
+
+static void
+gl_readback_complete(struct gl_readback *rb)
+{
+	const void *pixels = NULL;
+
+	if (use_output(rb->output) == 0) {
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, rb->pbo);
+		pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, rb->size,
+					  GL_MAP_READ_BIT);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	}
+
+	rb->done(rb->data, pixels);
+
+	/* done may have queued another readback, rebinding the buffer */
+	if (pixels) {
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, rb->pbo);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	}
+
+	gl_readback_destroy(rb);
+}
+
+/* Complete rb and, before it, every readback queued earlier on its output */
+static void
+gl_readback_complete_through(struct gl_readback *rb)
+{
+	struct gl_output_state *go = get_output_state(rb->output);
+	struct gl_readback *first;
+	bool last;
+
+	do {
+		first = container_of(go->readback_list.next,
+				     struct gl_readback, link);
+		last = first == rb;
+		gl_readback_complete(first);
+	} while (!last);
+}
+
+static int
+gl_readback_handler(int fd, uint32_t mask, void *data)
+{
+	struct gl_readback *rb = data;
+
+	/* The GPU executes in order, so every readback queued before this
+	 * one is done as well. Completing them first keeps the order even
+	 * when the event loop reports several fences at once. */
+	gl_readback_complete_through(rb);
+
+	return 0;
+}
+
+/* A readback without a fence: mapping the buffers waits for the GPU */
+static void
+gl_readback_idle_handler(void *data)
+{
+	struct gl_readback *rb = data;
+
+	/* the event loop removes the idle source after this returns */
+	rb->event_source = NULL;
+	gl_readback_complete_through(rb);
+}
+
+static int
+gl_renderer_read_pixels_async(struct weston_output *output,
+			      pixman_format_code_t format,
+			      uint32_t x, uint32_t y,
+			      uint32_t width, uint32_t height,
+			      weston_renderer_read_pixels_done_func_t done,
+			      void *data)
+{
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	struct gl_output_state *go = get_output_state(output);
+	struct wl_event_loop *loop;
+	struct gl_readback *rb;
+	GLenum gl_format;
+
+	if (!read_format_to_gl(format, &gl_format))
+		return -1;
+
+	if (use_output(output) < 0)
+		return -1;
+
+	rb = zalloc(sizeof *rb);
+	if (!rb)
+		return -1;
+
+	rb->output = output;
+	rb->size = (size_t)width * height * (PIXMAN_FORMAT_BPP(format) / 8);
+	rb->sync = EGL_NO_SYNC_KHR;
+	rb->fd = -1;
+	rb->done = done;
+	rb->data = data;
+	wl_list_insert(go->readback_list.prev, &rb->link);
+
+	if (go->readback_pbo && go->readback_pbo_size >= rb->size) {
+		rb->pbo = go->readback_pbo;
+		rb->size = go->readback_pbo_size;
+		go->readback_pbo = 0;
+		go->readback_pbo_size = 0;
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, rb->pbo);
+	} else {
+		glGenBuffers(1, &rb->pbo);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, rb->pbo);
+		glBufferData(GL_PIXEL_PACK_BUFFER, rb->size, NULL,
+			     GL_STREAM_READ);
+	}
+
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(x + go->borders[GL_RENDERER_BORDER_LEFT].width,
+		     y + go->borders[GL_RENDERER_BORDER_BOTTOM].height,
+		     width, height, gl_format, GL_UNSIGNED_BYTE, NULL);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	/* The fence only gets a sync file after a flush. */
+	rb->sync = create_render_sync(gr);
+	if (rb->sync != EGL_NO_SYNC_KHR) {
+		glFlush();
+		rb->fd = gr->dup_native_fence_fd(gr->egl_display, rb->sync);
+	}
+	if (rb->fd == EGL_NO_NATIVE_FENCE_FD_ANDROID) {
+		rb->fd = -1;
+		goto err;
+	}
+
+	loop = wl_display_get_event_loop(gr->compositor->wl_display);
+	rb->event_source = wl_event_loop_add_fd(loop, rb->fd,
+						WL_EVENT_READABLE,
+						gl_readback_handler, rb);
+	if (!rb->event_source)
+		goto err;
+
+	return 0;
+
+err:
+	/* Without a fence, complete the readback from an idle callback
+	 * instead. It stays queued behind the earlier readbacks, so done
+	 * is still called in order and never from within this function. */
+	loop = wl_display_get_event_loop(gr->compositor->wl_display);
+	rb->event_source = wl_event_loop_add_idle(loop,
+						  gl_readback_idle_handler,
+						  rb);
+	if (!rb->event_source) {
+		gl_readback_destroy(rb);
+		return -1;
+	}
+
+	return 0;
+}
+
 static GLenum
 gl_format_from_internal(GLenum internal_format)
 {
@@ -1817,6 +2644,365 @@ gl_format_from_internal(GLenum internal_format)
 	}
 }
 
+/* Smaller uploads are cheaper straight from client memory. */
+#define PBO_UPLOAD_MIN_BYTES (64 * 1024)
+
+/* Start of each rectangle in the pixel unpack buffer */
+static size_t
+pbo_align(size_t size)
+{
+	return (size + 15) & ~(size_t)15;
+}
+
+static int
+gl_format_bytes_per_pixel(GLenum internal_format, GLenum type)
+{
+	if (type == GL_UNSIGNED_SHORT_5_6_5)
+		return 2;
+
+	switch (internal_format) {
+	case GL_R8_EXT:
+	case GL_LUMINANCE:
+		return 1;
+	case GL_RG8_EXT:
+	case GL_LUMINANCE_ALPHA:
+		return 2;
+	case GL_RGBA:
+	case GL_BGRA_EXT:
+		return 4;
+	default:
+		return 0;
+	}
+}
+
+/** Upload the texture damage of an SHM buffer through a pixel unpack buffer
+ *
+ * The damaged rectangles are copied out of client memory into a freshly
+ * orphaned buffer object and the texture updates are then sourced from it.
+ * glTexSubImage2D() returns without waiting for the GPU to finish with the
+ * texture, and the transfer overlaps with rendering. Once the copy is
+ * done, the wl_buffer can be released. Orphaning on every upload lets the
+ * driver rotate the storage while earlier uploads are still in flight.
+ *
+ * \return false if nothing was uploaded and the caller must upload directly.
+ */
+static bool
+upload_damage_pbo(struct gl_renderer *gr, struct gl_surface_state *gs,
+		  struct weston_surface *surface, struct weston_buffer *buffer,
+		  const uint8_t *data)
+{
+	pixman_box32_t *rectangles;
+	int bpp[3];
+	size_t size = 0;
+	size_t offset;
+	uint8_t *map;
+	int i, j, n, y;
+
+	if (!gr->has_pbo_upload)
+		return false;
+
+	for (j = 0; j < gs->num_textures; j++) {
+		bpp[j] = gl_format_bytes_per_pixel(gs->gl_format[j],
+						   gs->gl_pixel_type);
+		if (bpp[j] == 0)
+			return false;
+	}
+
+	rectangles = pixman_region32_rectangles(&gs->texture_damage, &n);
+	for (i = 0; i < n; i++) {
+		pixman_box32_t r;
+
+		r = weston_surface_to_buffer_rect(surface, rectangles[i]);
+		for (j = 0; j < gs->num_textures; j++)
+			size += pbo_align((size_t)(r.x2 - r.x1) / gs->hsub[j] *
+					  ((r.y2 - r.y1) / gs->vsub[j]) * bpp[j]);
+	}
+
+	if (size < PBO_UPLOAD_MIN_BYTES)
+		return false;
+
+	if (!gs->pbo)
+		glGenBuffers(1, &gs->pbo);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, gs->pbo);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+	map = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size,
+			       GL_MAP_WRITE_BIT |
+			       GL_MAP_INVALIDATE_BUFFER_BIT);
+	if (!map) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		return false;
+	}
+
+	wl_shm_buffer_begin_access(buffer->shm_buffer);
+	offset = 0;
+	for (i = 0; i < n; i++) {
+		pixman_box32_t r;
+
+		r = weston_surface_to_buffer_rect(surface, rectangles[i]);
+		for (j = 0; j < gs->num_textures; j++) {
+			size_t stride = (size_t)gs->pitch / gs->hsub[j] * bpp[j];
+			size_t row = (size_t)(r.x2 - r.x1) / gs->hsub[j] * bpp[j];
+			int height = (r.y2 - r.y1) / gs->vsub[j];
+			const uint8_t *src = data + gs->offset[j] +
+					     r.y1 / gs->vsub[j] * stride +
+					     r.x1 / gs->hsub[j] * bpp[j];
+
+			for (y = 0; y < height; y++)
+				memcpy(map + offset + y * row,
+				       src + y * stride, row);
+			offset += pbo_align(row * height);
+		}
+	}
+	wl_shm_buffer_end_access(buffer->shm_buffer);
+
+	if (!glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER)) {
+		/* contents were lost, e.g. on a mode switch */
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		return false;
+	}
+
+	/* rows are tightly packed in the buffer object */
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, 0);
+	glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, 0);
+	glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, 0);
+
+	offset = 0;
+	for (i = 0; i < n; i++) {
+		pixman_box32_t r;
+
+		r = weston_surface_to_buffer_rect(surface, rectangles[i]);
+		for (j = 0; j < gs->num_textures; j++) {
+			int width = (r.x2 - r.x1) / gs->hsub[j];
+			int height = (r.y2 - r.y1) / gs->vsub[j];
+
+			glBindTexture(GL_TEXTURE_2D, gs->textures[j]);
+			glTexSubImage2D(GL_TEXTURE_2D, 0,
+					r.x1 / gs->hsub[j],
+					r.y1 / gs->vsub[j],
+					width, height,
+					gl_format_from_internal(gs->gl_format[j]),
+					gs->gl_pixel_type,
+					(void *)(uintptr_t)offset);
+			offset += pbo_align((size_t)width * height * bpp[j]);
+		}
+	}
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	return true;
+}
+
+enum gl_atlas_node_state {
+	GL_ATLAS_NODE_FREE = 0,
+	GL_ATLAS_NODE_SPLIT,
+	GL_ATLAS_NODE_USED,
+};
+
+/* Find a free block of the given size below node, preferring quadrants
+ * that are already split so that large blocks stay available. */
+static int
+gl_atlas_alloc_node(struct gl_renderer *gr, int node, int node_size,
+		    int x, int y, int size, int *block_x, int *block_y)
+{
+	uint8_t *nodes = gr->atlas.nodes;
+	int half = node_size / 2;
+	int pass, i, child, ret;
+
+	if (nodes[node] == GL_ATLAS_NODE_USED)
+		return -1;
+
+	if (node_size == size) {
+		if (nodes[node] != GL_ATLAS_NODE_FREE)
+			return -1;
+		nodes[node] = GL_ATLAS_NODE_USED;
+		*block_x = x;
+		*block_y = y;
+		return node;
+	}
+
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < 4; i++) {
+			child = 4 * node + 1 + i;
+			if (nodes[node] == GL_ATLAS_NODE_SPLIT &&
+			    nodes[child] != (pass == 0 ? GL_ATLAS_NODE_SPLIT :
+							 GL_ATLAS_NODE_FREE))
+				continue;
+
+			ret = gl_atlas_alloc_node(gr, child, half,
+						  x + (i & 1) * half,
+						  y + (i >> 1) * half,
+						  size, block_x, block_y);
+			if (ret >= 0) {
+				nodes[node] = GL_ATLAS_NODE_SPLIT;
+				return ret;
+			}
+		}
+	}
+
+	return -1;
+}
+
+static void
+gl_atlas_free_node(struct gl_renderer *gr, int node)
+{
+	uint8_t *nodes = gr->atlas.nodes;
+	int parent, i;
+
+	nodes[node] = GL_ATLAS_NODE_FREE;
+
+	/* coalesce buddies */
+	while (node > 0) {
+		parent = (node - 1) / 4;
+		for (i = 0; i < 4; i++) {
+			if (nodes[4 * parent + 1 + i] != GL_ATLAS_NODE_FREE)
+				return;
+		}
+		nodes[parent] = GL_ATLAS_NODE_FREE;
+		node = parent;
+	}
+}
+
+/** Place a single plane BGRA SHM surface into the atlas
+ *
+ * Small surfaces such as cursors, icons and tooltips then share one
+ * texture, so consecutive draws of them need no texture rebinds and
+ * their textures do not have to be created and destroyed on resize.
+ *
+ * \return false if the surface must use textures of its own.
+ */
+static bool
+gl_atlas_acquire(struct gl_renderer *gr, struct gl_surface_state *gs)
+{
+	int need = MAX(gs->pitch, gs->height) + 2;
+	int size = GL_ATLAS_MIN_BLOCK;
+	int node, x, y;
+
+	if (gs->gl_format[0] != GL_BGRA_EXT ||
+	    gs->gl_pixel_type != GL_UNSIGNED_BYTE ||
+	    need > GL_ATLAS_MAX_BLOCK)
+		return false;
+
+	while (size < need)
+		size *= 2;
+
+	node = gl_atlas_alloc_node(gr, 0, GL_ATLAS_SIZE, 0, 0, size, &x, &y);
+	if (node < 0)
+		return false;
+
+	if (!gr->atlas.tex) {
+		glActiveTexture(GL_TEXTURE0);
+		glGenTextures(1, &gr->atlas.tex);
+		glBindTexture(GL_TEXTURE_2D, gr->atlas.tex);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S,
+				GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T,
+				GL_CLAMP_TO_EDGE);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_BGRA_EXT,
+			     GL_ATLAS_SIZE, GL_ATLAS_SIZE, 0,
+			     GL_BGRA_EXT, GL_UNSIGNED_BYTE, NULL);
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+
+	gs->atlas_node = node;
+	gs->atlas_x = x + 1;
+	gs->atlas_y = y + 1;
+	gr->atlas.surfaces++;
+
+	return true;
+}
+
+static void
+gl_atlas_release(struct gl_renderer *gr, struct gl_surface_state *gs)
+{
+	if (gs->atlas_node < 0)
+		return;
+
+	gl_atlas_free_node(gr, gs->atlas_node);
+	gs->atlas_node = -1;
+	gr->atlas.surfaces--;
+}
+
+/* Copy a rectangle of the SHM buffer to an offset from the atlas slot
+ * origin. GL_UNPACK_ROW_LENGTH must be set to the buffer pitch. */
+static void
+gl_atlas_upload_rect(struct gl_surface_state *gs, const uint8_t *data,
+		     int src_x, int src_y, int dst_x, int dst_y,
+		     int width, int height)
+{
+	glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, src_x);
+	glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, src_y);
+	glTexSubImage2D(GL_TEXTURE_2D, 0,
+			gs->atlas_x + dst_x, gs->atlas_y + dst_y,
+			width, height, GL_BGRA_EXT, GL_UNSIGNED_BYTE, data);
+}
+
+/* Repeat the outermost pixels into the one pixel border of the slot. */
+static void
+gl_atlas_upload_border(struct gl_surface_state *gs, const uint8_t *data)
+{
+	int w = gs->pitch;
+	int h = gs->height;
+
+	gl_atlas_upload_rect(gs, data, 0, 0, 0, -1, w, 1);
+	gl_atlas_upload_rect(gs, data, 0, h - 1, 0, h, w, 1);
+	gl_atlas_upload_rect(gs, data, 0, 0, -1, 0, 1, h);
+	gl_atlas_upload_rect(gs, data, w - 1, 0, w, 0, 1, h);
+
+	gl_atlas_upload_rect(gs, data, 0, 0, -1, -1, 1, 1);
+	gl_atlas_upload_rect(gs, data, w - 1, 0, w, -1, 1, 1);
+	gl_atlas_upload_rect(gs, data, 0, h - 1, -1, h, 1, 1);
+	gl_atlas_upload_rect(gs, data, w - 1, h - 1, w, h, 1, 1);
+}
+
+static void
+gl_atlas_upload(struct gl_renderer *gr, struct gl_surface_state *gs,
+		struct weston_surface *surface, struct weston_buffer *buffer,
+		const uint8_t *data, bool full)
+{
+	pixman_box32_t *rectangles;
+	bool border = full;
+	int i, n;
+
+	glBindTexture(GL_TEXTURE_2D, gr->atlas.tex);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, gs->pitch);
+
+	wl_shm_buffer_begin_access(buffer->shm_buffer);
+	if (full) {
+		gl_atlas_upload_rect(gs, data, 0, 0, 0, 0,
+				     gs->pitch, gs->height);
+	} else {
+		rectangles = pixman_region32_rectangles(&gs->texture_damage,
+							&n);
+		for (i = 0; i < n; i++) {
+			pixman_box32_t r;
+
+			r = weston_surface_to_buffer_rect(surface,
+							  rectangles[i]);
+			/* never write outside of the slot */
+			r.x1 = MAX(r.x1, 0);
+			r.y1 = MAX(r.y1, 0);
+			r.x2 = MIN(r.x2, gs->pitch);
+			r.y2 = MIN(r.y2, gs->height);
+			if (r.x1 >= r.x2 || r.y1 >= r.y2)
+				continue;
+
+			gl_atlas_upload_rect(gs, data, r.x1, r.y1, r.x1, r.y1,
+					     r.x2 - r.x1, r.y2 - r.y1);
+			if (r.x1 == 0 || r.y1 == 0 ||
+			    r.x2 == gs->pitch || r.y2 == gs->height)
+				border = true;
+		}
+	}
+	if (border)
+		gl_atlas_upload_border(gs, data);
+	wl_shm_buffer_end_access(buffer->shm_buffer);
+
+	glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, 0);
+	glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, 0);
+}
+
 static void
 gl_renderer_flush_damage(struct weston_surface *surface)
 {
@@ -1832,6 +3018,8 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 
 	pixman_region32_union(&gs->texture_damage,
 			      &gs->texture_damage, &surface->damage);
+	if (pixman_region32_not_empty(&surface->damage))
+		gs->content_serial++;
 
 	if (!buffer)
 		return;
@@ -1859,6 +3047,14 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 
 	glActiveTexture(GL_TEXTURE0);
 
+	if (gs->atlas_node >= 0) {
+		gl_atlas_upload(get_renderer(surface->compositor), gs,
+				surface, buffer, data,
+				gs->needs_full_upload ||
+				quirks->gl_force_full_upload);
+		goto done;
+	}
+
 	if (gs->needs_full_upload || quirks->gl_force_full_upload) {
 		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, 0);
 		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, 0);
@@ -1880,6 +3076,10 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 		goto done;
 	}
 
+	if (upload_damage_pbo(get_renderer(surface->compositor), gs,
+			      surface, buffer, data))
+		goto done;
+
 	rectangles = pixman_region32_rectangles(&gs->texture_damage, &n);
 	wl_shm_buffer_begin_access(buffer->shm_buffer);
 	for (i = 0; i < n; i++) {
@@ -2080,7 +3280,11 @@ gl_renderer_attach_shm(struct weston_surface *es, struct weston_buffer *buffer,
 
 		gs->surface = es;
 
-		ensure_textures(gs, GL_TEXTURE_2D, num_planes);
+		gl_atlas_release(gr, gs);
+		if (num_planes == 1 && gl_atlas_acquire(gr, gs))
+			ensure_textures(gs, GL_TEXTURE_2D, 0);
+		else
+			ensure_textures(gs, GL_TEXTURE_2D, num_planes);
 	}
 }
 
@@ -2911,6 +4115,7 @@ gl_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 	weston_buffer_reference(&gs->buffer_ref, buffer);
 	weston_buffer_release_reference(&gs->buffer_release_ref,
 					es->buffer_release_ref.buffer_release);
+	gs->content_serial++;
 
 	if (!buffer) {
 		for (i = 0; i < gs->num_images; i++) {
@@ -2920,6 +4125,7 @@ gl_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 		gs->num_images = 0;
 		glDeleteTextures(gs->num_textures, gs->textures);
 		gs->num_textures = 0;
+		gl_atlas_release(gr, gs);
 		gs->buffer_type = BUFFER_TYPE_NULL;
 		gs->y_inverted = true;
 		gs->direct_display = false;
@@ -2928,6 +4134,8 @@ gl_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 	}
 
 	shm_buffer = wl_shm_buffer_get(buffer->resource);
+	if (!shm_buffer)
+		gl_atlas_release(gr, gs);
 
 	if (shm_buffer)
 		gl_renderer_attach_shm(es, buffer, shm_buffer);
@@ -2959,6 +4167,9 @@ gl_renderer_surface_set_color(struct weston_surface *surface,
 {
 	struct gl_surface_state *gs = get_surface_state(surface);
 
+	gl_atlas_release(get_renderer(surface->compositor), gs);
+	gs->content_serial++;
+
 	gs->color[0] = red;
 	gs->color[1] = green;
 	gs->color[2] = blue;
@@ -3035,8 +4246,11 @@ gl_renderer_surface_copy_content(struct weston_surface *surface,
 	const GLenum gl_format = GL_RGBA; /* PIXMAN_a8b8g8r8 little-endian */
 	struct gl_renderer *gr = get_renderer(surface->compositor);
 	struct gl_surface_state *gs = get_surface_state(surface);
+	const GLfloat *texcoords = verts;
+	GLfloat atlas_texcoords[4 * 2];
 	int cw, ch;
 	GLuint fbo;
+	int i;
 	GLuint tex;
 	GLenum status;
 	int ret = -1;
@@ -3058,6 +4272,16 @@ gl_renderer_surface_copy_content(struct weston_surface *surface,
 
 	gl_shader_config_set_input_textures(&sconf, gs);
 
+	if (gs->atlas_node >= 0) {
+		for (i = 0; i < 4; i++) {
+			atlas_texcoords[2 * i] = (gs->atlas_x +
+				verts[2 * i] * cw) / GL_ATLAS_SIZE;
+			atlas_texcoords[2 * i + 1] = (gs->atlas_y +
+				verts[2 * i + 1] * ch) / GL_ATLAS_SIZE;
+		}
+		texcoords = atlas_texcoords;
+	}
+
 	glActiveTexture(GL_TEXTURE0);
 	glGenTextures(1, &tex);
 	glBindTexture(GL_TEXTURE_2D, tex);
@@ -3093,7 +4317,7 @@ gl_renderer_surface_copy_content(struct weston_surface *surface,
 	glEnableVertexAttribArray(0);
 
 	/* texcoord: */
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, verts);
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, texcoords);
 	glEnableVertexAttribArray(1);
 
 	glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
@@ -3124,6 +4348,11 @@ surface_state_destroy(struct gl_surface_state *gs, struct gl_renderer *gr)
 	gs->surface->renderer_state = NULL;
 
 	glDeleteTextures(gs->num_textures, gs->textures);
+	if (gs->pbo)
+		glDeleteBuffers(1, &gs->pbo);
+	gl_atlas_release(gr, gs);
+	if (gs->subtree_cache)
+		gl_subtree_cache_destroy(gs->subtree_cache);
 
 	for (i = 0; i < gs->num_images; i++)
 		egl_image_unref(gs->images[i]);
@@ -3179,6 +4408,7 @@ gl_renderer_create_surface(struct weston_surface *surface)
 	gs->pitch = 1;
 	gs->y_inverted = true;
 	gs->direct_display = false;
+	gs->atlas_node = -1;
 
 	gs->surface = surface;
 
@@ -3344,8 +4574,14 @@ gl_renderer_output_create(struct weston_output *output,
 
 	for (i = 0; i < BUFFER_DAMAGE_COUNT; i++)
 		pixman_region32_init(&go->buffer_damage[i]);
+	go->buffer_damage_count = output->compositor->damage_history;
+	if (go->buffer_damage_count < 1)
+		go->buffer_damage_count = 1;
+	if (go->buffer_damage_count > BUFFER_DAMAGE_COUNT)
+		go->buffer_damage_count = BUFFER_DAMAGE_COUNT;
 
 	wl_list_init(&go->timeline_render_point_list);
+	wl_list_init(&go->readback_list);
 
 	go->begin_render_sync = EGL_NO_SYNC_KHR;
 	go->end_render_sync = EGL_NO_SYNC_KHR;
@@ -3461,17 +4697,35 @@ gl_renderer_output_destroy(struct weston_output *output)
 	struct gl_renderer *gr = get_renderer(output->compositor);
 	struct gl_output_state *go = get_output_state(output);
 	struct timeline_render_point *trp, *tmp;
+	struct gl_subtree_cache *cache, *next;
+	struct gl_readback *rb;
 	int i;
 
-	for (i = 0; i < 2; i++)
+	for (i = 0; i < BUFFER_DAMAGE_COUNT; i++)
 		pixman_region32_fini(&go->buffer_damage[i]);
 
 	if (shadow_exists(go))
 		gl_fbo_texture_fini(&go->shadow);
 
+	wl_list_for_each_safe(cache, next, &gr->subtree_cache_list, link) {
+		if (cache->output == output)
+			gl_subtree_cache_destroy(cache);
+	}
+
+	/* Finish pending readbacks rather than failing the capture, mapping
+	 * the buffer waits for the GPU. */
+	while (!wl_list_empty(&go->readback_list)) {
+		rb = container_of(go->readback_list.next,
+				  struct gl_readback, link);
+		gl_readback_complete(rb);
+	}
+
 	eglMakeCurrent(gr->egl_display,
 		       gr->dummy_surface, gr->dummy_surface, gr->egl_context);
 
+	if (go->readback_pbo)
+		glDeleteBuffers(1, &go->readback_pbo);
+
 	weston_platform_destroy_egl_surface(gr->egl_display, go->egl_surface);
 
 	if (!wl_list_empty(&go->timeline_render_point_list))
@@ -3521,6 +4775,8 @@ gl_renderer_destroy(struct weston_compositor *ec)
 	gl_renderer_shader_list_destroy(gr);
 	if (gr->fallback_shader)
 		gl_shader_destroy(gr, gr->fallback_shader);
+	if (gr->atlas.tex)
+		glDeleteTextures(1, &gr->atlas.tex);
 
 	/* Work around crash in egl_dri2.c's dri2_make_current() - when does this apply? */
 	eglMakeCurrent(gr->egl_display,
@@ -3544,13 +4800,16 @@ gl_renderer_destroy(struct weston_compositor *ec)
 
 	wl_array_release(&gr->vertices);
 	wl_array_release(&gr->vtxcnt);
+	wl_array_release(&gr->indices);
 
 	if (gr->fragment_binding)
 		weston_binding_destroy(gr->fragment_binding);
 	if (gr->fan_binding)
 		weston_binding_destroy(gr->fan_binding);
 
+	weston_log_scope_destroy(gr->draw_scope);
 	weston_log_scope_destroy(gr->shader_scope);
+	free(gr->program_cache_dir);
 	free(gr);
 }
 
@@ -3599,12 +4858,20 @@ gl_renderer_display_create(struct weston_compositor *ec,
 
 	gr->compositor = ec;
 	wl_list_init(&gr->shader_list);
+	wl_list_init(&gr->subtree_cache_list);
+	gr->subtree_cache = getenv("WESTON_GL_SUBTREE_CACHE") != NULL;
 	gr->platform = options->egl_platform;
 
 	gr->shader_scope = gl_shader_scope_create(gr);
 	if (!gr->shader_scope)
 		goto fail;
 
+	gr->draw_scope = weston_compositor_add_log_scope(ec, "gl-draw-stats",
+			"GL renderer draw calls and vertices per output repaint.\n",
+			NULL, NULL, gr);
+	if (!gr->draw_scope)
+		goto fail;
+
 	if (gl_renderer_setup_egl_client_extensions(gr) < 0)
 		goto fail;
 
@@ -3653,6 +4920,14 @@ gl_renderer_display_create(struct weston_compositor *ec,
 	if (gr->has_native_fence_sync && gr->has_wait_sync)
 		ec->capabilities |= WESTON_CAP_EXPLICIT_SYNC;
 
+	/* Without fences the repaint time would not include the GPU work,
+	 * and an adaptive repaint window would be too short. */
+	if (ec->repaint_window_adaptive && !gr->has_native_fence_sync) {
+		weston_log("warning: Disabling adaptive repaint window due to "
+			   "missing EGL_ANDROID_native_fence_sync extension\n");
+		ec->repaint_window_adaptive = false;
+	}
+
 	wl_list_init(&gr->dmabuf_images);
 	if (gr->has_dmabuf_import) {
 		gr->base.import_dmabuf = gl_renderer_import_dmabuf;
@@ -3700,6 +4975,7 @@ fail_terminate:
 	weston_drm_format_array_fini(&gr->supported_formats);
 	eglTerminate(gr->egl_display);
 fail:
+	weston_log_scope_destroy(gr->draw_scope);
 	weston_log_scope_destroy(gr->shader_scope);
 	free(gr);
 	ec->renderer = NULL;
@@ -3854,6 +5130,13 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 	    weston_check_egl_extension(extensions, "GL_EXT_texture_rg"))
 		gr->has_gl_texture_rg = true;
 
+	if (gr->gl_version >= gr_gl_version(3, 0)) {
+		gr->has_pbo_upload = true;
+		if (gr->has_native_fence_sync)
+			gr->base.read_pixels_async =
+				gl_renderer_read_pixels_async;
+	}
+
 	if (weston_check_egl_extension(extensions, "GL_OES_EGL_image_external"))
 		gr->has_egl_image_external = true;
 
@@ -3863,6 +5146,9 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 		gr->gl_supports_color_transforms = true;
 	}
 
+	if (weston_check_egl_extension(extensions, "GL_OES_get_program_binary"))
+		gl_renderer_program_cache_init(gr);
+
 	glActiveTexture(GL_TEXTURE0);
 
 	gr->fallback_shader = gl_renderer_create_fallback_shader(gr);
@@ -3871,6 +5157,8 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 		return -1;
 	}
 
+	gl_renderer_warm_up_programs(gr);
+
 	gr->fragment_binding =
 		weston_compositor_add_debug_binding(ec, KEY_S,
 						    fragment_debug_binding,
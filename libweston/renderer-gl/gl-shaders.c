@@ -30,8 +30,11 @@
 #include "config.h"
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <unistd.h>
 
 #include <libweston/libweston.h>
 #include <libweston/weston-log.h>
@@ -156,6 +159,228 @@ compile_shader(GLenum type, int count, const char **sources)
 	return s;
 }
 
+/* Bit positions of the gl_shader_requirements fields in a key index */
+#define KEY_VARIANT_SHIFT 0
+#define KEY_INPUT_IS_PREMULT_SHIFT \
+	(KEY_VARIANT_SHIFT + GL_SHADER_REQ_VARIANT_BITS)
+#define KEY_GREEN_TINT_SHIFT \
+	(KEY_INPUT_IS_PREMULT_SHIFT + GL_SHADER_REQ_INPUT_IS_PREMULT_BITS)
+#define KEY_COLOR_PRE_CURVE_SHIFT \
+	(KEY_GREEN_TINT_SHIFT + GL_SHADER_REQ_GREEN_TINT_BITS)
+static_assert(KEY_COLOR_PRE_CURVE_SHIFT + GL_SHADER_REQ_COLOR_PRE_CURVE_BITS ==
+	      GL_SHADER_REQ_USED_BITS,
+	      "every gl_shader_requirements field needs a place in the key index");
+
+static unsigned
+gl_shader_key_index(const struct gl_shader_requirements *req)
+{
+	return req->variant << KEY_VARIANT_SHIFT |
+	       req->input_is_premult << KEY_INPUT_IS_PREMULT_SHIFT |
+	       req->green_tint << KEY_GREEN_TINT_SHIFT |
+	       req->color_pre_curve << KEY_COLOR_PRE_CURVE_SHIFT;
+}
+
+#define KEY_FIELD(index, name) \
+	(((index) >> KEY_##name##_SHIFT) & \
+	 ((1u << GL_SHADER_REQ_##name##_BITS) - 1))
+
+static struct gl_shader_requirements
+gl_shader_key_from_index(unsigned index)
+{
+	return (struct gl_shader_requirements) {
+		.variant = KEY_FIELD(index, VARIANT),
+		.input_is_premult = KEY_FIELD(index, INPUT_IS_PREMULT),
+		.green_tint = KEY_FIELD(index, GREEN_TINT),
+		.color_pre_curve = KEY_FIELD(index, COLOR_PRE_CURVE),
+	};
+}
+
+/*
+ * Program binary cache file layout: this header followed by the binary
+ * from glGetProgramBinaryOES(). id must match gl_renderer::program_cache_id,
+ * otherwise the binary was built from other sources or by another driver.
+ */
+struct gl_program_cache_header {
+	uint32_t magic;
+	uint32_t id;
+	uint32_t format;
+	uint32_t length;
+};
+
+#define GL_PROGRAM_CACHE_MAGIC 0x50474c57 /* "WLGP" */
+
+static uint32_t
+fnv1a_hash(uint32_t hash, const char *str)
+{
+	for (; str && *str; str++) {
+		hash ^= (unsigned char)*str;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static char *
+program_cache_path(struct gl_renderer *gr, unsigned index)
+{
+	char *path;
+
+	if (asprintf(&path, "%s/weston-gl-program-%02x.bin",
+		     gr->program_cache_dir, index) < 0)
+		return NULL;
+
+	return path;
+}
+
+/** Enable the on-disk program binary cache
+ *
+ * The cache lives in the directory named by WESTON_GL_PROGRAM_CACHE_DIR;
+ * the caller checks for GL_OES_get_program_binary. Binaries are tied to
+ * the shader sources and the GL vendor, renderer and version strings;
+ * stale files are ignored and replaced.
+ */
+void
+gl_renderer_program_cache_init(struct gl_renderer *gr)
+{
+	const char *dir = getenv("WESTON_GL_PROGRAM_CACHE_DIR");
+	GLint nformats = 0;
+	uint32_t id = 2166136261u;
+
+	if (!dir || !*dir)
+		return;
+
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &nformats);
+	if (nformats <= 0) {
+		weston_log("GL program cache disabled: "
+			   "driver has no program binary formats.\n");
+		return;
+	}
+
+	gr->get_program_binary =
+		(void *) eglGetProcAddress("glGetProgramBinaryOES");
+	gr->program_binary = (void *) eglGetProcAddress("glProgramBinaryOES");
+	if (!gr->get_program_binary || !gr->program_binary)
+		return;
+
+	id = fnv1a_hash(id, vertex_shader);
+	id = fnv1a_hash(id, fragment_shader);
+	id = fnv1a_hash(id, (const char *) glGetString(GL_VENDOR));
+	id = fnv1a_hash(id, (const char *) glGetString(GL_RENDERER));
+	id = fnv1a_hash(id, (const char *) glGetString(GL_VERSION));
+
+	gr->program_cache_id = id;
+	gr->program_cache_dir = strdup(dir);
+	if (gr->program_cache_dir)
+		weston_log("GL program cache: %s\n", gr->program_cache_dir);
+}
+
+static GLuint
+gl_program_cache_load(struct gl_renderer *gr,
+		      const struct gl_shader_requirements *req)
+{
+	struct gl_program_cache_header header;
+	GLuint program = GL_NONE;
+	GLint status;
+	void *binary = NULL;
+	char *path;
+	FILE *fp;
+
+	if (!gr->program_cache_dir)
+		return GL_NONE;
+
+	path = program_cache_path(gr, gl_shader_key_index(req));
+	if (!path)
+		return GL_NONE;
+
+	fp = fopen(path, "rb");
+	free(path);
+	if (!fp)
+		return GL_NONE;
+
+	if (fread(&header, sizeof header, 1, fp) != 1 ||
+	    header.magic != GL_PROGRAM_CACHE_MAGIC ||
+	    header.id != gr->program_cache_id ||
+	    header.length == 0)
+		goto out;
+
+	binary = malloc(header.length);
+	if (!binary || fread(binary, header.length, 1, fp) != 1)
+		goto out;
+
+	program = glCreateProgram();
+	gr->program_binary(program, header.format, binary, header.length);
+	glGetProgramiv(program, GL_LINK_STATUS, &status);
+	if (!status) {
+		/* e.g. a driver update; fall back to compiling */
+		glDeleteProgram(program);
+		program = GL_NONE;
+	}
+
+out:
+	free(binary);
+	fclose(fp);
+	return program;
+}
+
+static void
+gl_program_cache_store(struct gl_renderer *gr, struct gl_shader *shader)
+{
+	struct gl_program_cache_header header = {
+		.magic = GL_PROGRAM_CACHE_MAGIC,
+		.id = gr->program_cache_id,
+	};
+	GLint length = 0;
+	GLenum format;
+	void *binary;
+	char *path, *tmp_path = NULL;
+	FILE *fp;
+	bool ok;
+
+	if (!gr->program_cache_dir)
+		return;
+
+	glGetProgramiv(shader->program, GL_PROGRAM_BINARY_LENGTH_OES, &length);
+	if (length <= 0)
+		return;
+
+	binary = malloc(length);
+	if (!binary)
+		return;
+
+	gr->get_program_binary(shader->program, length, &length,
+			       &format, binary);
+	header.format = format;
+	header.length = length;
+
+	path = program_cache_path(gr, gl_shader_key_index(&shader->key));
+	if (!path || asprintf(&tmp_path, "%s.tmp", path) < 0) {
+		tmp_path = NULL;
+		goto out;
+	}
+
+	/* Write a temporary file first so readers never see a partial one. */
+	fp = fopen(tmp_path, "wb");
+	if (!fp)
+		goto out;
+
+	ok = fwrite(&header, sizeof header, 1, fp) == 1 &&
+	     fwrite(binary, length, 1, fp) == 1;
+	if (fclose(fp) != 0)
+		ok = false;
+
+	if (!ok || rename(tmp_path, path) < 0) {
+		weston_log_scope_printf(gr->shader_scope,
+					"Could not write %s: %s\n",
+					path, strerror(errno));
+		unlink(tmp_path);
+	}
+
+out:
+	free(tmp_path);
+	free(path);
+	free(binary);
+}
+
 static char *
 create_shader_description_string(const struct gl_shader_requirements *req)
 {
@@ -222,6 +447,13 @@ gl_shader_create(struct gl_renderer *gr,
 		free(desc);
 	}
 
+	shader->program = gl_program_cache_load(gr, requirements);
+	if (shader->program != GL_NONE) {
+		weston_log_scope_printf(gr->shader_scope,
+					"Loaded program binary from cache.\n");
+		goto program_ready;
+	}
+
 	sources[0] = vertex_shader;
 	shader->vertex_shader = compile_shader(GL_VERTEX_SHADER, 1, sources);
 	if (shader->vertex_shader == GL_NONE)
@@ -256,6 +488,9 @@ gl_shader_create(struct gl_renderer *gr,
 	glDeleteShader(shader->vertex_shader);
 	glDeleteShader(shader->fragment_shader);
 
+	gl_program_cache_store(gr, shader);
+
+program_ready:
 	shader->proj_uniform = glGetUniformLocation(shader->program, "proj");
 	shader->tex_uniforms[0] = glGetUniformLocation(shader->program, "tex");
 	shader->tex_uniforms[1] = glGetUniformLocation(shader->program, "tex1");
@@ -271,6 +506,7 @@ gl_shader_create(struct gl_renderer *gr,
 	free(conf);
 
 	wl_list_insert(&gr->shader_list, &shader->link);
+	gr->shader_table[gl_shader_key_index(&shader->key)] = shader;
 
 	return shader;
 
@@ -300,6 +536,9 @@ gl_shader_destroy(struct gl_renderer *gr, struct gl_shader *shader)
 		free(desc);
 	}
 
+	if (gr->shader_table[gl_shader_key_index(&shader->key)] == shader)
+		gr->shader_table[gl_shader_key_index(&shader->key)] = NULL;
+
 	glDeleteProgram(shader->program);
 	wl_list_remove(&shader->link);
 	free(shader);
@@ -389,10 +628,47 @@ gl_renderer_create_fallback_shader(struct gl_renderer *gr)
 	 */
 	wl_list_remove(&shader->link);
 	wl_list_init(&shader->link);
+	gr->shader_table[gl_shader_key_index(&shader->key)] = NULL;
 
 	return shader;
 }
 
+/** Load the programs of previous runs from the program binary cache
+ *
+ * Every variant that has a binary in the cache directory is created up
+ * front, so that variants used before do not cost a compile in the first
+ * frames that need them.
+ */
+void
+gl_renderer_warm_up_programs(struct gl_renderer *gr)
+{
+	struct gl_shader_requirements reqs;
+	unsigned index;
+	char *path;
+	int count = 0;
+
+	if (!gr->program_cache_dir)
+		return;
+
+	for (index = 0; index < GL_SHADER_KEY_COUNT; index++) {
+		if (gr->shader_table[index])
+			continue;
+
+		path = program_cache_path(gr, index);
+		if (!path)
+			continue;
+
+		if (access(path, R_OK) == 0) {
+			reqs = gl_shader_key_from_index(index);
+			if (gl_shader_create(gr, &reqs))
+				count++;
+		}
+		free(path);
+	}
+
+	weston_log("GL program cache: %d programs preloaded.\n", count);
+}
+
 static struct gl_shader *
 gl_renderer_get_program(struct gl_renderer *gr,
 			const struct gl_shader_requirements *requirements)
@@ -409,10 +685,9 @@ gl_renderer_get_program(struct gl_renderer *gr,
 	    gl_shader_requirements_cmp(&reqs, &gr->current_shader->key) == 0)
 		return gr->current_shader;
 
-	wl_list_for_each(shader, &gr->shader_list, link) {
-		if (gl_shader_requirements_cmp(&reqs, &shader->key) == 0)
-			return shader;
-	}
+	shader = gr->shader_table[gl_shader_key_index(&reqs)];
+	if (shader)
+		return shader;
 
 	shader = gl_shader_create(gr, &reqs);
 	if (shader)
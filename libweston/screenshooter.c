@@ -45,37 +45,33 @@
 
 struct screenshooter_frame_listener {
 	struct wl_listener listener;
-	struct weston_buffer *buffer;
+	struct weston_buffer *buffer;	/**< NULL once destroyed */
+	struct wl_listener buffer_destroy_listener;
 	struct weston_output *output;
 	weston_screenshooter_done_func_t done;
 	void *data;
 };
 
+/* Copy height rows of bytes each. The strides may differ, and a negative
+ * src_stride walks the source bottom-up. */
 static void
-copy_bgra_yflip(uint8_t *dst, uint8_t *src, int height, int stride)
+copy_bgra(uint8_t *dst, int dst_stride,
+	  const uint8_t *src, int src_stride, int bytes, int height)
 {
-	uint8_t *end;
+	int y;
 
-	end = dst + height * stride;
-	while (dst < end) {
-		memcpy(dst, src, stride);
-		dst += stride;
-		src -= stride;
+	for (y = 0; y < height; y++) {
+		memcpy(dst, src, bytes);
+		dst += dst_stride;
+		src += src_stride;
 	}
 }
 
 static void
-copy_bgra(uint8_t *dst, uint8_t *src, int height, int stride)
-{
-	/* TODO: optimize this out */
-	memcpy(dst, src, height * stride);
-}
-
-static void
-copy_row_swap_RB(void *vdst, void *vsrc, int bytes)
+copy_row_swap_RB(void *vdst, const void *vsrc, int bytes)
 {
 	uint32_t *dst = vdst;
-	uint32_t *src = vsrc;
+	const uint32_t *src = vsrc;
 	uint32_t *end = dst + bytes / 4;
 
 	while (dst < end) {
@@ -89,79 +85,120 @@ copy_row_swap_RB(void *vdst, void *vsrc, int bytes)
 }
 
 static void
-copy_rgba_yflip(uint8_t *dst, uint8_t *src, int height, int stride)
+copy_rgba(uint8_t *dst, int dst_stride,
+	  const uint8_t *src, int src_stride, int bytes, int height)
 {
-	uint8_t *end;
+	int y;
 
-	end = dst + height * stride;
-	while (dst < end) {
-		copy_row_swap_RB(dst, src, stride);
-		dst += stride;
-		src -= stride;
+	for (y = 0; y < height; y++) {
+		copy_row_swap_RB(dst, src, bytes);
+		dst += dst_stride;
+		src += src_stride;
 	}
 }
 
-static void
-copy_rgba(uint8_t *dst, uint8_t *src, int height, int stride)
+/* Read pixels without waiting for the renderer if it can, calling done
+ * once they are available. Returns -1 without calling done on failure. */
+static int
+read_pixels_async(struct weston_output *output, pixman_format_code_t format,
+		  uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+		  weston_renderer_read_pixels_done_func_t done, void *data)
 {
-	uint8_t *end;
+	struct weston_renderer *renderer = output->compositor->renderer;
+	void *pixels;
 
-	end = dst + height * stride;
-	while (dst < end) {
-		copy_row_swap_RB(dst, src, stride);
-		dst += stride;
-		src += stride;
+	if (renderer->read_pixels_async)
+		return renderer->read_pixels_async(output, format,
+						   x, y, width, height,
+						   done, data);
+
+	pixels = malloc(width * height * (PIXMAN_FORMAT_BPP(format) / 8));
+	if (pixels == NULL)
+		return -1;
+
+	if (renderer->read_pixels(output, format, pixels,
+				  x, y, width, height) < 0) {
+		free(pixels);
+		return -1;
 	}
+
+	done(data, pixels);
+	free(pixels);
+
+	return 0;
 }
 
 static void
-screenshooter_frame_notify(struct wl_listener *listener, void *data)
+screenshooter_frame_listener_finish(struct screenshooter_frame_listener *l,
+				    enum weston_screenshooter_outcome outcome)
+{
+	if (l->buffer)
+		wl_list_remove(&l->buffer_destroy_listener.link);
+
+	l->done(l->data, outcome);
+	free(l);
+}
+
+static void
+screenshooter_buffer_destroy(struct wl_listener *listener, void *data)
 {
 	struct screenshooter_frame_listener *l =
-		container_of(listener,
-			     struct screenshooter_frame_listener, listener);
-	struct weston_output *output = l->output;
-	struct weston_compositor *compositor = output->compositor;
-	int32_t stride;
-	uint8_t *pixels, *d, *s;
+		container_of(listener, struct screenshooter_frame_listener,
+			     buffer_destroy_listener);
 
-	weston_output_disable_planes_decr(output);
 	wl_list_remove(&listener->link);
-	stride = l->buffer->width * (PIXMAN_FORMAT_BPP(compositor->read_format) / 8);
-	pixels = malloc(stride * l->buffer->height);
+	l->buffer = NULL;
+}
+
+static void
+screenshooter_read_done(void *data, const void *pixels)
+{
+	struct screenshooter_frame_listener *l = data;
+	struct weston_output *output = l->output;
+	struct weston_compositor *compositor = output->compositor;
+	int32_t width = output->current_mode->width;
+	int32_t height = output->current_mode->height;
+	int32_t src_stride, dst_stride, bytes;
+	const uint8_t *s;
+	uint8_t *d;
 
 	if (pixels == NULL) {
-		l->done(l->data, WESTON_SCREENSHOOTER_NO_MEMORY);
-		free(l);
+		screenshooter_frame_listener_finish(l,
+				WESTON_SCREENSHOOTER_NO_MEMORY);
 		return;
 	}
 
-	compositor->renderer->read_pixels(output,
-			     compositor->read_format, pixels,
-			     0, 0, output->current_mode->width,
-			     output->current_mode->height);
+	/* The client destroyed the buffer while the pixels were read. */
+	if (l->buffer == NULL) {
+		screenshooter_frame_listener_finish(l,
+				WESTON_SCREENSHOOTER_BAD_BUFFER);
+		return;
+	}
 
-	stride = wl_shm_buffer_get_stride(l->buffer->shm_buffer);
+	/* pixels holds exactly the output mode, which may be narrower than
+	 * the buffer, so source and destination rows have their own
+	 * strides. */
+	bytes = width * (PIXMAN_FORMAT_BPP(compositor->read_format) / 8);
+	src_stride = bytes;
+	dst_stride = wl_shm_buffer_get_stride(l->buffer->shm_buffer);
 
 	d = wl_shm_buffer_get_data(l->buffer->shm_buffer);
-	s = pixels + stride * (l->buffer->height - 1);
+	s = pixels;
+	if (compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP) {
+		s += src_stride * (height - 1);
+		src_stride = -src_stride;
+	}
 
 	wl_shm_buffer_begin_access(l->buffer->shm_buffer);
 
 	switch (compositor->read_format) {
 	case PIXMAN_a8r8g8b8:
 	case PIXMAN_x8r8g8b8:
-		if (compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP)
-			copy_bgra_yflip(d, s, output->current_mode->height, stride);
-		else
-			copy_bgra(d, pixels, output->current_mode->height, stride);
+		copy_bgra(d, dst_stride, s, src_stride, bytes, height);
 		break;
 	case PIXMAN_x8b8g8r8:
 	case PIXMAN_a8b8g8r8:
-		if (compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP)
-			copy_rgba_yflip(d, s, output->current_mode->height, stride);
-		else
-			copy_rgba(d, pixels, output->current_mode->height, stride);
+		copy_rgba(d, dst_stride, s, src_stride, bytes, height);
 		break;
 	default:
 		break;
@@ -169,9 +206,33 @@ screenshooter_frame_notify(struct wl_listener *listener, void *data)
 
 	wl_shm_buffer_end_access(l->buffer->shm_buffer);
 
-	l->done(l->data, WESTON_SCREENSHOOTER_SUCCESS);
-	free(pixels);
-	free(l);
+	screenshooter_frame_listener_finish(l, WESTON_SCREENSHOOTER_SUCCESS);
+}
+
+static void
+screenshooter_frame_notify(struct wl_listener *listener, void *data)
+{
+	struct screenshooter_frame_listener *l =
+		container_of(listener,
+			     struct screenshooter_frame_listener, listener);
+	struct weston_output *output = l->output;
+	struct weston_compositor *compositor = output->compositor;
+
+	weston_output_disable_planes_decr(output);
+	wl_list_remove(&listener->link);
+
+	if (l->buffer == NULL) {
+		screenshooter_frame_listener_finish(l,
+				WESTON_SCREENSHOOTER_BAD_BUFFER);
+		return;
+	}
+
+	if (read_pixels_async(output, compositor->read_format,
+			      0, 0, output->current_mode->width,
+			      output->current_mode->height,
+			      screenshooter_read_done, l) < 0)
+		screenshooter_frame_listener_finish(l,
+				WESTON_SCREENSHOOTER_NO_MEMORY);
 }
 
 WL_EXPORT int
@@ -208,6 +269,8 @@ weston_screenshooter_shoot(struct weston_output *output,
 	l->data = data;
 	l->listener.notify = screenshooter_frame_notify;
 	wl_signal_add(&output->frame_signal, &l->listener);
+	l->buffer_destroy_listener.notify = screenshooter_buffer_destroy;
+	wl_signal_add(&buffer->destroy_signal, &l->buffer_destroy_listener);
 	weston_output_disable_planes_incr(output);
 	weston_output_schedule_repaint(output);
 
@@ -217,11 +280,19 @@ weston_screenshooter_shoot(struct weston_output *output,
 struct weston_recorder {
 	struct weston_output *output;
 	uint32_t *frame, *rect;
-	uint32_t *tmpbuf;
 	uint32_t total;
 	int fd;
 	struct wl_listener frame_listener;
 	int count, destroying;
+	/* frames still being read back */
+	int pending;
+};
+
+/* A frame whose pixels are being read back */
+struct weston_recorder_frame {
+	struct weston_recorder *recorder;
+	uint32_t msecs;
+	pixman_region32_t damage; /* in output buffer coordinates */
 };
 
 static uint32_t *
@@ -259,48 +330,33 @@ static void
 weston_recorder_destroy(struct weston_recorder *recorder);
 
 static void
-weston_recorder_frame_notify(struct wl_listener *listener, void *data)
+weston_recorder_write_frame(struct weston_recorder *recorder,
+			    struct weston_recorder_frame *frame,
+			    const uint32_t *pixels)
 {
-	struct weston_recorder *recorder =
-		container_of(listener, struct weston_recorder, frame_listener);
 	struct weston_output *output = recorder->output;
 	struct weston_compositor *compositor = output->compositor;
-	uint32_t msecs = timespec_to_msec(&output->frame_time);
-	pixman_box32_t *r;
-	pixman_region32_t damage, transformed_damage;
-	int i, j, k, n, width, height, run, stride;
-	uint32_t delta, prev, *d, *s, *p, next;
+	pixman_box32_t *r, *extents;
+	int i, j, k, n, width, height, run, stride, pixels_stride;
+	uint32_t delta, prev, *d, *p, next;
+	const uint32_t *s;
 	struct {
 		uint32_t msecs;
 		uint32_t nrects;
 	} header;
 	struct iovec v[2];
 	int do_yflip;
-	int y_orig;
-	uint32_t *outbuf;
+	int y_orig, row;
 
 	do_yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
-	if (do_yflip)
-		outbuf = recorder->rect;
-	else
-		outbuf = recorder->tmpbuf;
 
-	pixman_region32_init(&damage);
-	pixman_region32_init(&transformed_damage);
-	pixman_region32_intersect(&damage, &output->region, data);
-	pixman_region32_translate(&damage, -output->x, -output->y);
-	weston_transformed_region(output->width, output->height,
-				 output->transform, output->current_scale,
-				 &damage, &transformed_damage);
-	pixman_region32_fini(&damage);
+	/* pixels covers the extents of the damage */
+	extents = pixman_region32_extents(&frame->damage);
+	pixels_stride = extents->x2 - extents->x1;
 
-	r = pixman_region32_rectangles(&transformed_damage, &n);
-	if (n == 0) {
-		pixman_region32_fini(&transformed_damage);
-		return;
-	}
+	r = pixman_region32_rectangles(&frame->damage, &n);
 
-	header.msecs = msecs;
+	header.msecs = frame->msecs;
 	header.nrects = n;
 	v[0].iov_base = &header;
 	v[0].iov_len = sizeof header;
@@ -313,23 +369,15 @@ weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 		width = r[i].x2 - r[i].x1;
 		height = r[i].y2 - r[i].y1;
 
-		if (do_yflip)
-			y_orig = output->current_mode->height - r[i].y2;
-		else
-			y_orig = r[i].y1;
-
-		compositor->renderer->read_pixels(output,
-				compositor->read_format, recorder->rect,
-				r[i].x1, y_orig, width, height);
-
-		p = outbuf;
+		p = recorder->rect;
 		run = prev = 0; /* quiet gcc */
 		for (j = 0; j < height; j++) {
+			y_orig = r[i].y2 - j - 1;
 			if (do_yflip)
-				s = recorder->rect + width * j;
+				row = extents->y2 - y_orig - 1;
 			else
-				s = recorder->rect + width * (height - j - 1);
-			y_orig = r[i].y2 - j - 1;
+				row = y_orig - extents->y1;
+			s = pixels + pixels_stride * row + r[i].x1 - extents->x1;
 			d = recorder->frame + stride * y_orig + r[i].x1;
 
 			for (k = 0; k < width; k++) {
@@ -349,22 +397,103 @@ weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 		p = output_run(p, prev, run);
 
 		recorder->total += write(recorder->fd,
-					 outbuf, (p - outbuf) * 4);
+					 recorder->rect,
+					 (p - recorder->rect) * 4);
 
 #if 0
 		fprintf(stderr,
 			"%dx%d at %d,%d rle from %d to %d bytes (%f) total %dM\n",
 			width, height, r[i].x1, r[i].y1,
-			width * height * 4, (int) (p - outbuf) * 4,
-			(float) (p - outbuf) / (width * height),
+			width * height * 4, (int) (p - recorder->rect) * 4,
+			(float) (p - recorder->rect) / (width * height),
 			recorder->total / 1024 / 1024);
 #endif
 	}
+}
+
+static void
+weston_recorder_read_done(void *data, const void *pixels)
+{
+	struct weston_recorder_frame *frame = data;
+	struct weston_recorder *recorder = frame->recorder;
+
+	if (pixels)
+		weston_recorder_write_frame(recorder, frame, pixels);
+
+	pixman_region32_fini(&frame->damage);
+	free(frame);
+
+	recorder->pending--;
+	if (recorder->destroying && recorder->pending == 0)
+		weston_recorder_destroy(recorder);
+}
+
+static void
+weston_recorder_frame_notify(struct wl_listener *listener, void *data)
+{
+	struct weston_recorder *recorder =
+		container_of(listener, struct weston_recorder, frame_listener);
+	struct weston_output *output = recorder->output;
+	struct weston_compositor *compositor = output->compositor;
+	struct weston_recorder_frame *frame;
+	pixman_region32_t damage;
+	pixman_box32_t *extents;
+	int do_yflip;
+	int y_orig;
+
+	do_yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
+
+	frame = zalloc(sizeof *frame);
+	if (frame == NULL) {
+		weston_log("%s: out of memory\n", __func__);
+		return;
+	}
+
+	frame->recorder = recorder;
+	frame->msecs = timespec_to_msec(&output->frame_time);
+
+	pixman_region32_init(&damage);
+	pixman_region32_init(&frame->damage);
+	pixman_region32_intersect(&damage, &output->region, data);
+	pixman_region32_translate(&damage, -output->x, -output->y);
+	weston_transformed_region(output->width, output->height,
+				 output->transform, output->current_scale,
+				 &damage, &frame->damage);
+	pixman_region32_fini(&damage);
+
+	if (!pixman_region32_not_empty(&frame->damage)) {
+		pixman_region32_fini(&frame->damage);
+		free(frame);
+		return;
+	}
+
+	/* Read the extents of the damage in one go, so that the renderer
+	 * does not have to wait for this frame. The frame is encoded once
+	 * the pixels arrive; reads complete in order. */
+	extents = pixman_region32_extents(&frame->damage);
+	if (do_yflip)
+		y_orig = output->current_mode->height - extents->y2;
+	else
+		y_orig = extents->y1;
 
-	pixman_region32_fini(&transformed_damage);
 	recorder->count++;
+	recorder->pending++;
+
+	/* On success, weston_recorder_read_done() takes over, possibly
+	 * before this returns. */
+	if (read_pixels_async(output, compositor->read_format,
+			      extents->x1, y_orig,
+			      extents->x2 - extents->x1,
+			      extents->y2 - extents->y1,
+			      weston_recorder_read_done, frame) == 0)
+		return;
 
-	if (recorder->destroying)
+	weston_log("%s: failed to read frame\n", __func__);
+	pixman_region32_fini(&frame->damage);
+	free(frame);
+	recorder->pending--;
+
+	if (recorder->destroying && recorder->pending == 0)
 		weston_recorder_destroy(recorder);
 }
 
@@ -374,7 +503,6 @@ weston_recorder_free(struct weston_recorder *recorder)
 	if (recorder == NULL)
 		return;
 
-	free(recorder->tmpbuf);
 	free(recorder->rect);
 	free(recorder->frame);
 	free(recorder);
@@ -387,9 +515,6 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 	struct weston_recorder *recorder;
 	int stride, size;
 	struct { uint32_t magic, format, width, height; } header;
-	int do_yflip;
-
-	do_yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
 
 	recorder = zalloc(sizeof *recorder);
 	if (recorder == NULL) {
@@ -408,14 +533,6 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 		goto err_recorder;
 	}
 
-	if (!do_yflip) {
-		recorder->tmpbuf = malloc(size);
-		if (recorder->tmpbuf == NULL) {
-			weston_log("%s: out of memory\n", __func__);
-			goto err_recorder;
-		}
-	}
-
 	header.magic = WCAP_HEADER_MAGIC;
 
 	switch (compositor->read_format) {
@@ -41,6 +41,7 @@ enum timeline_type {
 	TLT_SURFACE,
 	TLT_VBLANK,
 	TLT_GPU,
+	TLT_DEADLINE,
 };
 
 /** Timeline subscription created for each subscription
@@ -80,6 +81,7 @@ struct weston_timeline_subscription_object {
 #define TLP_SURFACE(s) TLT_SURFACE, TYPEVERIFY(struct weston_surface *, (s))
 #define TLP_VBLANK(t) TLT_VBLANK, TYPEVERIFY(const struct timespec *, (t))
 #define TLP_GPU(t) TLT_GPU, TYPEVERIFY(const struct timespec *, (t))
+#define TLP_DEADLINE(t) TLT_DEADLINE, TYPEVERIFY(const struct timespec *, (t))
 
 /** This macro is used to add timeline points.
  *
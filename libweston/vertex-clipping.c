@@ -284,7 +284,7 @@ clip_polygon_bottom(struct clip_context *ctx, const struct polygon8 *src,
 
 int
 clip_simple(struct clip_context *ctx,
-	    struct polygon8 *surf,
+	    const struct polygon8 *surf,
 	    float *ex,
 	    float *ey)
 {
@@ -328,3 +328,149 @@ clip_transformed(struct clip_context *ctx,
 
 	return n;
 }
+
+/* Boxes classified against the quad in one pass */
+#define CLIP_BOXES_CHUNK 64
+
+enum clip_box_class {
+	CLIP_BOX_OUTSIDE = 0,	/* disjoint bounding boxes */
+	CLIP_BOX_OVERLAP = 1,	/* needs clipping */
+	CLIP_BOX_INSIDE = 3,	/* box lies inside the quad */
+};
+
+/** Clip one quadrilateral against many rectangles
+ *
+ * \param quad The convex quadrilateral, four vertices in winding order.
+ * \param axis_aligned True if the edges of quad are parallel to the axes.
+ * \param boxes The clip rectangles.
+ * \param ex, ey Receive the vertices of the clipped polygons, back to
+ * back. Room for 8 vertices per box is required.
+ * \param vtxcnt Receives the number of vertices of each polygon. Room for
+ * one count per box is required.
+ * \return The number of polygons, each with 3 to 8 vertices.
+ *
+ * Produces the same polygons as clip_simple() or clip_transformed() on
+ * each box in turn, skipping boxes that do not overlap. The boxes are
+ * first classified against the bounding box and the edges of the quad in
+ * a branchless loop over the coordinate arrays, which the compiler can
+ * vectorise. Boxes inside the quad, and quads that are axis aligned or
+ * inside a box, then need no polygon clipping at all.
+ */
+int
+clip_quad_boxes(const struct polygon8 *quad,
+		bool axis_aligned,
+		const struct clip_boxes *boxes,
+		float *ex,
+		float *ey,
+		int *vtxcnt)
+{
+	unsigned char class[CLIP_BOXES_CHUNK];
+	struct clip_context ctx;
+	struct polygon8 polygon;
+	float min_x, max_x, min_y, max_y;
+	float ea[4], eb[4], ec[4];
+	float area = 0.0f;
+	int base, count, i, j, k, n;
+	int npolygons = 0;
+
+	assert(quad->n == 4);
+
+	min_x = max_x = quad->x[0];
+	min_y = max_y = quad->y[0];
+	for (i = 1; i < 4; i++) {
+		min_x = min(min_x, quad->x[i]);
+		max_x = max(max_x, quad->x[i]);
+		min_y = min(min_y, quad->y[i]);
+		max_y = max(max_y, quad->y[i]);
+	}
+
+	/* Edge functions ea * x + eb * y + ec, positive inside the quad */
+	for (i = 0; i < 4; i++) {
+		j = (i + 1) % 4;
+		area += quad->x[i] * quad->y[j] - quad->x[j] * quad->y[i];
+	}
+	for (i = 0; i < 4; i++) {
+		j = (i + 1) % 4;
+		ea[i] = quad->y[i] - quad->y[j];
+		eb[i] = quad->x[j] - quad->x[i];
+		ec[i] = quad->x[i] * quad->y[j] - quad->x[j] * quad->y[i];
+		if (area < 0.0f) {
+			ea[i] = -ea[i];
+			eb[i] = -eb[i];
+			ec[i] = -ec[i];
+		}
+	}
+
+	for (base = 0; base < boxes->n; base += CLIP_BOXES_CHUNK) {
+		const float *x1 = boxes->x1 + base;
+		const float *y1 = boxes->y1 + base;
+		const float *x2 = boxes->x2 + base;
+		const float *y2 = boxes->y2 + base;
+
+		count = min(boxes->n - base, CLIP_BOXES_CHUNK);
+
+		for (i = 0; i < count; i++) {
+			int inside = 1;
+
+			/* The corner closest to the outside of each edge */
+			for (k = 0; k < 4; k++)
+				inside &= ec[k] +
+					  min(ea[k] * x1[i], ea[k] * x2[i]) +
+					  min(eb[k] * y1[i], eb[k] * y2[i]) > 0.0f;
+
+			class[i] = ((min_x < x2[i]) & (max_x > x1[i]) &
+				    (min_y < y2[i]) & (max_y > y1[i])) |
+				   (inside << 1);
+		}
+
+		for (i = 0; i < count; i++) {
+			if (class[i] == CLIP_BOX_OUTSIDE)
+				continue;
+
+			ctx.clip.x1 = x1[i];
+			ctx.clip.y1 = y1[i];
+			ctx.clip.x2 = x2[i];
+			ctx.clip.y2 = y2[i];
+
+			if (axis_aligned) {
+				n = clip_simple(&ctx, quad, ex, ey);
+			} else if (class[i] == CLIP_BOX_INSIDE) {
+				/* same winding as the quad */
+				ex[0] = x1[i];
+				ey[0] = y1[i];
+				ex[2] = x2[i];
+				ey[2] = y2[i];
+				if (area > 0.0f) {
+					ex[1] = x2[i];
+					ey[1] = y1[i];
+					ex[3] = x1[i];
+					ey[3] = y2[i];
+				} else {
+					ex[1] = x1[i];
+					ey[1] = y2[i];
+					ex[3] = x2[i];
+					ey[3] = y1[i];
+				}
+				n = 4;
+			} else if (min_x >= x1[i] && max_x < x2[i] &&
+				   min_y >= y1[i] && max_y < y2[i]) {
+				for (k = 0; k < 4; k++) {
+					ex[k] = quad->x[k];
+					ey[k] = quad->y[k];
+				}
+				n = 4;
+			} else {
+				polygon = *quad;
+				n = clip_transformed(&ctx, &polygon, ex, ey);
+				if (n < 3)
+					continue;
+			}
+
+			ex += n;
+			ey += n;
+			vtxcnt[npolygons++] = n;
+		}
+	}
+
+	return npolygons;
+}
@@ -25,6 +25,8 @@
 #ifndef _WESTON_VERTEX_CLIPPING_H
 #define _WESTON_VERTEX_CLIPPING_H
 
+#include <stdbool.h>
+
 struct polygon8 {
 	float x[8];
 	float y[8];
@@ -53,7 +55,7 @@ float_difference(float a, float b);
 
 int
 clip_simple(struct clip_context *ctx,
-	    struct polygon8 *surf,
+	    const struct polygon8 *surf,
 	    float *ex,
 	    float *ey);
 
@@ -61,6 +63,23 @@ int
 clip_transformed(struct clip_context *ctx,
 		 struct polygon8 *surf,
 		 float *ex,
-		 float *ey);\
+		 float *ey);
+
+/* Clip rectangles in structure-of-arrays form */
+struct clip_boxes {
+	const float *x1;
+	const float *y1;
+	const float *x2;
+	const float *y2;
+	int n;
+};
+
+int
+clip_quad_boxes(const struct polygon8 *quad,
+		bool axis_aligned,
+		const struct clip_boxes *boxes,
+		float *ex,
+		float *ey,
+		int *vtxcnt);
 
 #endif
@@ -27,6 +27,7 @@
 #include "config.h"
 
 #include <float.h>
+#include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
@@ -59,22 +60,46 @@ weston_matrix_init(struct weston_matrix *matrix)
 	memcpy(matrix, &identity, sizeof identity);
 }
 
+/*
+ * True if the matrix only scales and translates:
+ *  sx  0  0 tx
+ *   0 sy  0 ty
+ *   0  0 sz tz
+ *   0  0  0  1
+ * The type flags rule out most other matrices cheaply, but matrices
+ * filled in by hand may carry no flags at all, so check the layout too.
+ */
+static inline bool
+matrix_is_scale_translate(const struct weston_matrix *m)
+{
+	if (m->type & ~(WESTON_MATRIX_TRANSFORM_TRANSLATE |
+			WESTON_MATRIX_TRANSFORM_SCALE))
+		return false;
+
+	return m->d[1] == 0.0f && m->d[2] == 0.0f && m->d[3] == 0.0f &&
+	       m->d[4] == 0.0f && m->d[6] == 0.0f && m->d[7] == 0.0f &&
+	       m->d[8] == 0.0f && m->d[9] == 0.0f && m->d[11] == 0.0f &&
+	       m->d[15] == 1.0f;
+}
+
 /* m <- n * m, that is, m is multiplied on the LEFT. */
 WL_EXPORT void
 weston_matrix_multiply(struct weston_matrix *m, const struct weston_matrix *n)
 {
 	struct weston_matrix tmp;
-	const float *row, *column;
-	div_t d;
-	int i, j;
-
-	for (i = 0; i < 16; i++) {
-		tmp.d[i] = 0;
-		d = div(i, 4);
-		row = m->d + d.quot * 4;
-		column = n->d + d.rem;
-		for (j = 0; j < 4; j++)
-			tmp.d[i] += row[j] * column[j * 4];
+	const float *col;
+	int c, r;
+
+	/* Each column of the result is a linear combination of the columns
+	 * of n. Written this way the inner loop works on four consecutive
+	 * floats, which compilers turn into SSE or NEON vector code. */
+	for (c = 0; c < 4; c++) {
+		col = m->d + c * 4;
+		for (r = 0; r < 4; r++)
+			tmp.d[c * 4 + r] = n->d[r] * col[0] +
+					   n->d[4 + r] * col[1] +
+					   n->d[8 + r] * col[2] +
+					   n->d[12 + r] * col[3];
 	}
 	tmp.type = m->type | n->type;
 	memcpy(m, &tmp, sizeof tmp);
@@ -117,14 +142,14 @@ weston_matrix_rotate_xy(struct weston_matrix *matrix, float cos, float sin)
 WL_EXPORT void
 weston_matrix_transform(struct weston_matrix *matrix, struct weston_vector *v)
 {
-	int i, j;
+	int i;
 	struct weston_vector t;
 
-	for (i = 0; i < 4; i++) {
-		t.f[i] = 0;
-		for (j = 0; j < 4; j++)
-			t.f[i] += v->f[j] * matrix->d[i + j * 4];
-	}
+	for (i = 0; i < 4; i++)
+		t.f[i] = v->f[0] * matrix->d[i] +
+			 v->f[1] * matrix->d[i + 4] +
+			 v->f[2] * matrix->d[i + 8] +
+			 v->f[3] * matrix->d[i + 12];
 
 	*v = t;
 }
@@ -264,6 +289,31 @@ weston_matrix_invert(struct weston_matrix *inverse,
 	unsigned perm[4];	/* permutation */
 	unsigned c;
 
+	if (matrix_is_scale_translate(matrix)) {
+		/* inverse may alias matrix */
+		double sx = matrix->d[0];
+		double sy = matrix->d[5];
+		double sz = matrix->d[10];
+		double tx = matrix->d[12];
+		double ty = matrix->d[13];
+		double tz = matrix->d[14];
+		unsigned int type = matrix->type;
+
+		if (fabs(sx) < 1e-9 || fabs(sy) < 1e-9 || fabs(sz) < 1e-9)
+			return -1;
+
+		weston_matrix_init(inverse);
+		inverse->d[0] = 1.0 / sx;
+		inverse->d[5] = 1.0 / sy;
+		inverse->d[10] = 1.0 / sz;
+		inverse->d[12] = -tx / sx;
+		inverse->d[13] = -ty / sy;
+		inverse->d[14] = -tz / sz;
+		inverse->type = type;
+
+		return 0;
+	}
+
 	if (matrix_invert(LU, perm, matrix) < 0)
 		return -1;
 
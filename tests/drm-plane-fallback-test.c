@@ -0,0 +1,255 @@
+/*
+ * Copyright © 2026 ClearCode Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "shared/helpers.h"
+#include "weston-test-client-helper.h"
+#include "weston-debug-client-protocol.h"
+#include "weston-test-fixture-compositor.h"
+
+/* The first repaint has no renderer framebuffer to propose mixed mode
+ * with, so leave a few more for the fallbacks to show. */
+#define FRAME_COUNT 8
+
+struct setup_args {
+	struct fixture_metadata meta;
+	/* value of WESTON_DRM_TEST_MAX_PLANES */
+	const char *max_planes;
+	/* whether the renderer framebuffer alone fits the limit */
+	bool expect_mixed;
+};
+
+/*
+ * The test surface uses a wl_shm buffer, which the DRM-backend cannot scan
+ * out with the Pixman renderer, so planes-only composition always fails.
+ * Mixed mode scans out the renderer framebuffer on the primary plane. A
+ * limit of one plane lets that through, a limit of none rejects it too and
+ * leaves renderer-only composition.
+ */
+static const struct setup_args my_setup_args[] = {
+	{
+		.meta.name = "one plane",
+		.max_planes = "1",
+		.expect_mixed = true,
+	},
+	{
+		.meta.name = "no planes",
+		.max_planes = "0",
+		.expect_mixed = false,
+	},
+};
+
+static enum test_result_code
+fixture_setup(struct weston_test_harness *harness, const struct setup_args *arg)
+{
+	struct compositor_setup setup;
+
+#if !TEST_DRM_PLANE_LIMIT
+	fprintf(stderr, "DRM plane limit not built, skipping.\n");
+	return RESULT_SKIP;
+#endif
+
+	compositor_setup_defaults(&setup);
+	setup.shell = SHELL_TEST_DESKTOP;
+	setup.backend = WESTON_BACKEND_DRM;
+	setup.renderer = RENDERER_PIXMAN;
+
+	/* the compositor runs in this process */
+	setenv("WESTON_DRM_TEST_MAX_PLANES", arg->max_planes, 1);
+
+	return weston_test_harness_execute_as_client(harness, &setup);
+}
+DECLARE_FIXTURE_SETUP_WITH_ARG(fixture_setup, my_setup_args, meta);
+
+struct debug_reader {
+	int fd;
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+static void
+debug_reader_drain(struct debug_reader *reader)
+{
+	ssize_t n;
+
+	for (;;) {
+		if (reader->size - reader->len < 4096) {
+			reader->size = reader->size * 2 + 4096;
+			reader->data = realloc(reader->data, reader->size);
+			assert(reader->data);
+		}
+
+		n = read(reader->fd, reader->data + reader->len,
+			 reader->size - reader->len - 1);
+		if (n > 0) {
+			reader->len += n;
+			continue;
+		}
+
+		assert(n == 0 || errno == EAGAIN || errno == EINTR);
+		if (n < 0 && errno == EINTR)
+			continue;
+		break;
+	}
+
+	reader->data[reader->len] = '\0';
+}
+
+struct fallback_counts {
+	/* repaints by the composition they settled on */
+	int planes_only;
+	int mixed;
+	int renderer_only;
+	/* fallbacks out of a failed proposal */
+	int planes_only_failed;
+	int mixed_failed;
+	/* test commits rejected by WESTON_DRM_TEST_MAX_PLANES */
+	int rejected;
+	/* a planes-only failure was followed by a mixed repaint */
+	bool mixed_after_planes_only;
+	/* the composition of the last repaint */
+	const char *last;
+};
+
+static void
+count_fallbacks(const char *data, struct fallback_counts *counts)
+{
+	const char *line = data;
+	bool planes_only_failed = false;
+
+	memset(counts, 0, sizeof *counts);
+
+	while (line && *line) {
+		if (strstr(line, "could not build planes-only state")) {
+			counts->planes_only_failed++;
+			planes_only_failed = true;
+		} else if (strstr(line, "could not build mixed-mode state")) {
+			counts->mixed_failed++;
+		} else if (strstr(line, "rejecting test commit")) {
+			counts->rejected++;
+		} else if (strstr(line, "Using plane-only state composition")) {
+			counts->planes_only++;
+			counts->last = "planes-only";
+		} else if (strstr(line, "Using mixed state composition")) {
+			counts->mixed++;
+			counts->last = "mixed";
+			if (planes_only_failed)
+				counts->mixed_after_planes_only = true;
+		} else if (strstr(line, "Using render-only state composition")) {
+			counts->renderer_only++;
+			counts->last = "renderer-only";
+		}
+
+		line = strchr(line, '\n');
+		if (line)
+			line++;
+	}
+}
+
+TEST(drm_plane_limit_fallback)
+{
+	const struct setup_args *args;
+	struct debug_reader reader = { 0 };
+	struct fallback_counts counts;
+	struct weston_debug_v1 *debug;
+	struct weston_debug_stream_v1 *stream;
+	struct client *client;
+	struct wl_surface *surface;
+	int fds[2];
+	int done;
+	int i;
+
+	args = &my_setup_args[get_test_fixture_index()];
+
+	client = create_client_and_test_surface(0, 0, 200, 200);
+	assert(client);
+	surface = client->surface->wl_surface;
+
+	debug = bind_to_singleton_global(client, &weston_debug_v1_interface, 1);
+
+	assert(pipe2(fds, O_CLOEXEC) == 0);
+	assert(fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0);
+	reader.fd = fds[0];
+
+	stream = weston_debug_v1_subscribe(debug, "drm-backend", fds[1]);
+	close(fds[1]);
+	client_roundtrip(client);
+
+	for (i = 0; i < FRAME_COUNT; i++) {
+		wl_surface_attach(surface, client->surface->buffer->proxy,
+				  0, 0);
+		wl_surface_damage(surface, 0, 0, 200, 200);
+		frame_callback_set(surface, &done);
+		wl_surface_commit(surface);
+		frame_callback_wait(client, &done);
+
+		/* Keep the pipe from filling up and stalling the
+		 * compositor. */
+		debug_reader_drain(&reader);
+	}
+
+	weston_debug_stream_v1_destroy(stream);
+	weston_debug_v1_destroy(debug);
+	client_roundtrip(client);
+	debug_reader_drain(&reader);
+	close(reader.fd);
+
+	count_fallbacks(reader.data, &counts);
+	testlog("%s: %d planes-only, %d mixed, %d renderer-only repaints; "
+		"%d planes-only and %d mixed fallbacks, %d rejected tests\n",
+		args->meta.name, counts.planes_only, counts.mixed,
+		counts.renderer_only, counts.planes_only_failed,
+		counts.mixed_failed, counts.rejected);
+
+	/* planes-only is always tried first and never fits */
+	assert(counts.planes_only == 0);
+	assert(counts.planes_only_failed > 0);
+	assert(counts.last);
+
+	if (args->expect_mixed) {
+		assert(counts.mixed > 0);
+		assert(counts.mixed_after_planes_only);
+		assert(strcmp(counts.last, "mixed") == 0);
+	} else {
+		assert(counts.mixed == 0);
+		assert(counts.rejected > 0);
+		assert(counts.mixed_failed > 0);
+		assert(strcmp(counts.last, "renderer-only") == 0);
+	}
+
+	free(reader.data);
+	client_destroy(client);
+}
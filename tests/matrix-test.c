@@ -354,9 +354,14 @@ test_loop_speed_invert_explicit(void)
 	unsigned long count = 0;
 	double t;
 
-	printf("\nRunning 3 s test on weston_matrix_invert()...\n");
+	printf("\nRunning 3 s test on weston_matrix_invert(), general...\n");
 
+	/* Rotation keeps this off the scale-translate fast path. Inverting
+	 * in place alternates between the matrix and its inverse. */
 	weston_matrix_init(&m);
+	weston_matrix_rotate_xy(&m, cos(0.3), sin(0.3));
+	weston_matrix_scale(&m, 2.0, 0.5, 1.0);
+	weston_matrix_translate(&m, 10.0, 20.0, 0.0);
 
 	running = 1;
 	alarm(3);
@@ -371,8 +376,116 @@ test_loop_speed_invert_explicit(void)
 	       count, t, 1e9 * t / count);
 }
 
+static void
+randomize_scale_translate(struct weston_matrix *m)
+{
+	weston_matrix_init(m);
+	weston_matrix_scale(m, frand() * 4.0, frand() * 4.0, 1.0);
+	weston_matrix_translate(m, frand() * 4096.0, frand() * 4096.0, 0.0);
+}
+
+/* Compare the scale-translate fast path of weston_matrix_invert() with
+ * the general LU inversion. Return the largest absolute difference.
+ */
+static double
+test_scale_translate(void)
+{
+	struct weston_matrix m, fast;
+	struct inverse_matrix q;
+	double errsup = 0.0;
+	unsigned i;
+
+	randomize_scale_translate(&m);
+
+	if (weston_matrix_invert(&fast, &m) < 0 ||
+	    matrix_invert(q.LU, q.perm, &m) < 0)
+		return 0.0;
+
+	weston_matrix_init(&m);
+	for (i = 0; i < 4; ++i)
+		inverse_transform(q.LU, q.perm, &m.d[i * 4]);
+
+	for (i = 0; i < 16; ++i) {
+		double err = fabs(m.d[i] - fast.d[i]) /
+			     fmax(1.0, fabs(m.d[i]));
+		if (err > errsup)
+			errsup = err;
+	}
+
+	return errsup;
+}
+
+static void
+test_loop_scale_translate(void)
+{
+	double errsup = 0.0;
+	int i;
+
+	printf("\nComparing scale-translate inversion with LU...\n");
+
+	for (i = 0; i < 100000; i++)
+		errsup = fmax(errsup, test_scale_translate());
+
+	printf("max relative error: %g\n", errsup);
+}
+
+static void __attribute__((noinline))
+test_loop_speed_multiply(const char *name, struct weston_matrix *n)
+{
+	struct weston_matrix m;
+	unsigned long count = 0;
+	double t;
+
+	printf("\nRunning 3 s test on weston_matrix_multiply(), %s...\n",
+	       name);
+
+	weston_matrix_init(&m);
+
+	running = 1;
+	alarm(3);
+	reset_timer();
+	while (running) {
+		weston_matrix_multiply(&m, n);
+		/* keep the values bounded */
+		if ((count & 0xff) == 0)
+			m = *n;
+		count++;
+	}
+	t = read_timer();
+
+	printf("%lu iterations in %f seconds, avg. %.1f ns/iter.\n",
+	       count, t, 1e9 * t / count);
+}
+
+static void __attribute__((noinline))
+test_loop_speed_invert_scale_translate(void)
+{
+	struct weston_matrix m, inverse;
+	unsigned long count = 0;
+	double t;
+
+	printf("\nRunning 3 s test on weston_matrix_invert(), "
+	       "scale and translation...\n");
+
+	randomize_scale_translate(&m);
+
+	running = 1;
+	alarm(3);
+	reset_timer();
+	while (running) {
+		weston_matrix_invert(&inverse, &m);
+		m.d[12] = inverse.d[12];
+		count++;
+	}
+	t = read_timer();
+
+	printf("%lu iterations in %f seconds, avg. %.1f ns/iter.\n",
+	       count, t, 1e9 * t / count);
+}
+
 int main(void)
 {
+	struct weston_matrix R, ST;
 	struct sigaction ding;
 	struct weston_matrix M;
 	struct inverse_matrix Q;
@@ -420,5 +533,19 @@ int main(void)
 	test_loop_speed_invert();
 	test_loop_speed_invert_explicit();
 
+	test_loop_scale_translate();
+
+	weston_matrix_init(&R);
+	weston_matrix_rotate_xy(&R, cos(0.3), sin(0.3));
+	weston_matrix_translate(&R, 10.0, 20.0, 0.0);
+	test_loop_speed_multiply("general", &R);
+
+	weston_matrix_init(&ST);
+	weston_matrix_scale(&ST, 0.999, 1.001, 1.0);
+	weston_matrix_translate(&ST, 10.0, 20.0, 0.0);
+	test_loop_speed_multiply("scale and translation", &ST);
+
+	test_loop_speed_invert_scale_translate();
+
 	return 0;
 }
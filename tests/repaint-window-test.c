@@ -0,0 +1,230 @@
+/*
+ * Copyright © 2026 ClearCode Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "shared/helpers.h"
+#include "shared/timespec-util.h"
+#include "weston-test-client-helper.h"
+#include "weston-debug-client-protocol.h"
+#include "weston-test-fixture-compositor.h"
+
+/* Synthetic headless repaint time, and the upper bound of the window */
+#define RENDER_COST_USEC 3000
+#define REPAINT_WINDOW_MSEC 15
+
+/* Headless outputs run at 60 Hz */
+#define REFRESH_NSEC 16666666
+
+/* Enough frames to fill the adaptive history past its minimum */
+#define FRAME_COUNT 24
+
+static enum test_result_code
+fixture_setup(struct weston_test_harness *harness)
+{
+	struct compositor_setup setup;
+
+	compositor_setup_defaults(&setup);
+	setup.shell = SHELL_TEST_DESKTOP;
+
+	weston_ini_setup(&setup,
+			 cfgln("[core]"),
+			 cfgln("repaint-window=%d", REPAINT_WINDOW_MSEC),
+			 cfgln("adaptive-repaint-window=true"),
+			 cfgln("render-cost=%d", RENDER_COST_USEC));
+
+	return weston_test_harness_execute_as_client(harness, &setup);
+}
+DECLARE_FIXTURE_SETUP(fixture_setup);
+
+struct timeline_reader {
+	int fd;
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+static void
+timeline_reader_drain(struct timeline_reader *reader)
+{
+	ssize_t n;
+
+	for (;;) {
+		if (reader->size - reader->len < 4096) {
+			reader->size = reader->size * 2 + 4096;
+			reader->data = realloc(reader->data, reader->size);
+			assert(reader->data);
+		}
+
+		n = read(reader->fd, reader->data + reader->len,
+			 reader->size - reader->len - 1);
+		if (n > 0) {
+			reader->len += n;
+			continue;
+		}
+
+		assert(n == 0 || errno == EAGAIN || errno == EINTR);
+		if (n < 0 && errno == EINTR)
+			continue;
+		break;
+	}
+
+	reader->data[reader->len] = '\0';
+}
+
+static bool
+timeline_line_get_stamp(const char *line, const char *key,
+			struct timespec *ts)
+{
+	const char *p = strstr(line, key);
+	int64_t sec;
+	long nsec;
+
+	if (!p)
+		return false;
+
+	if (sscanf(p + strlen(key), "%" SCNd64 ", %ld", &sec, &nsec) != 2)
+		return false;
+
+	ts->tv_sec = sec;
+	ts->tv_nsec = nsec;
+
+	return true;
+}
+
+/* The repaint window is how long before the predicted vblank the repaint
+ * deadline was set. core_repaint_finished carries the vblank and the
+ * core_repaint_deadline right after it carries the deadline. */
+static int
+timeline_collect_windows(const char *data, int64_t *windows, int max)
+{
+	const char *line = data;
+	struct timespec vblank;
+	struct timespec deadline;
+	bool have_vblank = false;
+	int count = 0;
+
+	while (line && *line && count < max) {
+		if (strstr(line, "\"N\":\"core_repaint_finished\"")) {
+			have_vblank = timeline_line_get_stamp(line,
+						"\"vblank_monotonic\":[",
+						&vblank);
+		} else if (strstr(line, "\"N\":\"core_repaint_deadline\"")) {
+			if (have_vblank &&
+			    timeline_line_get_stamp(line,
+						    "\"deadline_monotonic\":[",
+						    &deadline)) {
+				windows[count++] = REFRESH_NSEC -
+					timespec_sub_to_nsec(&deadline,
+							     &vblank);
+			}
+			have_vblank = false;
+		}
+
+		line = strchr(line, '\n');
+		if (line)
+			line++;
+	}
+
+	return count;
+}
+
+TEST(adaptive_repaint_window_fits_render_cost)
+{
+	struct timeline_reader reader = { 0 };
+	struct weston_debug_v1 *debug;
+	struct weston_debug_stream_v1 *stream;
+	struct client *client;
+	struct wl_surface *surface;
+	int64_t windows[FRAME_COUNT * 2];
+	int64_t window;
+	int fds[2];
+	int count;
+	int done;
+	int i;
+
+	client = create_client_and_test_surface(0, 0, 100, 100);
+	assert(client);
+	surface = client->surface->wl_surface;
+
+	debug = bind_to_singleton_global(client, &weston_debug_v1_interface, 1);
+
+	assert(pipe2(fds, O_CLOEXEC) == 0);
+	assert(fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0);
+	reader.fd = fds[0];
+
+	stream = weston_debug_v1_subscribe(debug, "timeline", fds[1]);
+	close(fds[1]);
+	client_roundtrip(client);
+
+	for (i = 0; i < FRAME_COUNT; i++) {
+		wl_surface_attach(surface, client->surface->buffer->proxy,
+				  0, 0);
+		wl_surface_damage(surface, 0, 0, 100, 100);
+		frame_callback_set(surface, &done);
+		wl_surface_commit(surface);
+		frame_callback_wait(client, &done);
+
+		/* Keep the pipe from filling up and stalling the
+		 * compositor. */
+		timeline_reader_drain(&reader);
+	}
+
+	weston_debug_stream_v1_destroy(stream);
+	weston_debug_v1_destroy(debug);
+	client_roundtrip(client);
+	timeline_reader_drain(&reader);
+	close(reader.fd);
+
+	count = timeline_collect_windows(reader.data, windows,
+					 ARRAY_LENGTH(windows));
+	testlog("%d repaint windows recorded\n", count);
+	assert(count > 8);
+
+	window = windows[count - 1];
+	testlog("last repaint window %" PRId64 " us\n", window / 1000);
+
+	/* The window must cover the render cost plus the 2 ms margin, and
+	 * it must have shrunk well below the configured maximum. Both
+	 * timestamps are converted to CLOCK_MONOTONIC separately, so allow
+	 * a little slack. */
+	assert(window >= (RENDER_COST_USEC + 2000 - 200) * 1000LL);
+	assert(window < (REPAINT_WINDOW_MSEC - 2) * 1000000LL);
+
+	free(reader.data);
+	client_destroy(client);
+}
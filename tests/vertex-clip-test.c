@@ -26,11 +26,15 @@
 #include "config.h"
 
 #include <assert.h>
+#include <math.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "weston-test-runner.h"
 
 #include "shared/helpers.h"
+#include "shared/timespec-util.h"
 #include "vertex-clipping.h"
 
 #define BOUNDING_BOX_TOP_Y 100.0f
@@ -221,3 +225,270 @@ TEST(float_difference_same)
 	assert(float_difference(1.0f, 1.0f) == 0.0f);
 }
 
+
+TEST_P(clip_quad_boxes_matches_clip_transformed, test_data)
+{
+	struct vertex_clip_test_data *tdata = data;
+	struct clip_context ctx;
+	struct polygon8 polygon;
+	float x1 = BOUNDING_BOX_LEFT_X, y1 = BOUNDING_BOX_BOTTOM_Y;
+	float x2 = BOUNDING_BOX_RIGHT_X, y2 = BOUNDING_BOX_TOP_Y;
+	struct clip_boxes boxes = { &x1, &y1, &x2, &y2, 1 };
+	float vertices_x[8], expected_x[8];
+	float vertices_y[8], expected_y[8];
+	int vtxcnt;
+	int emitted;
+	int i;
+
+	deep_copy_polygon8(&tdata->surface, &polygon);
+	emitted = clip_polygon(&ctx, &polygon, expected_x, expected_y);
+
+	assert(clip_quad_boxes(&tdata->surface, false, &boxes,
+			       vertices_x, vertices_y, &vtxcnt) == 1);
+	assert(vtxcnt == emitted);
+	for (i = 0; i < emitted; i++) {
+		assert(vertices_x[i] == expected_x[i]);
+		assert(vertices_y[i] == expected_y[i]);
+	}
+}
+
+TEST(clip_quad_boxes_box_inside_quad)
+{
+	/* a diamond around the bounding box */
+	const struct polygon8 diamond = {
+		{ 0.0f, 75.0f, 150.0f, 75.0f },
+		{ 75.0f, 0.0f, 75.0f, 150.0f },
+		4
+	};
+	float x1 = 60.0f, y1 = 60.0f, x2 = 90.0f, y2 = 90.0f;
+	struct clip_boxes boxes = { &x1, &y1, &x2, &y2, 1 };
+	float vertices_x[8];
+	float vertices_y[8];
+	int vtxcnt;
+
+	assert(clip_quad_boxes(&diamond, false, &boxes,
+			       vertices_x, vertices_y, &vtxcnt) == 1);
+	assert(vtxcnt == 4);
+
+	/* the box itself, in the winding of the diamond */
+	assert(vertices_x[0] == x1 && vertices_y[0] == y1);
+	assert(vertices_x[1] == x2 && vertices_y[1] == y1);
+	assert(vertices_x[2] == x2 && vertices_y[2] == y2);
+	assert(vertices_x[3] == x1 && vertices_y[3] == y2);
+}
+
+TEST(clip_quad_boxes_axis_aligned)
+{
+	const struct polygon8 quad = {
+		{ INSIDE_X1, OUTSIDE_X2, OUTSIDE_X2, INSIDE_X1 },
+		{ INSIDE_Y1, INSIDE_Y1, OUTSIDE_Y2, OUTSIDE_Y2 },
+		4
+	};
+	/* the second box is disjoint from the quad */
+	const float x1[] = { BOUNDING_BOX_LEFT_X, 0.0f, INSIDE_X2 };
+	const float y1[] = { BOUNDING_BOX_BOTTOM_Y, 0.0f, INSIDE_Y2 };
+	const float x2[] = { BOUNDING_BOX_RIGHT_X, 10.0f, 200.0f };
+	const float y2[] = { BOUNDING_BOX_TOP_Y, 10.0f, 200.0f };
+	struct clip_boxes boxes = { x1, y1, x2, y2, 3 };
+	float vertices_x[3 * 8];
+	float vertices_y[3 * 8];
+	int vtxcnt[3];
+
+	assert(clip_quad_boxes(&quad, true, &boxes,
+			       vertices_x, vertices_y, vtxcnt) == 2);
+	assert(vtxcnt[0] == 4);
+	assert(vtxcnt[1] == 4);
+
+	assert(vertices_x[0] == INSIDE_X1);
+	assert(vertices_y[0] == INSIDE_Y1);
+	assert(vertices_x[2] == BOUNDING_BOX_RIGHT_X);
+	assert(vertices_y[2] == BOUNDING_BOX_TOP_Y);
+
+	assert(vertices_x[4] == INSIDE_X2);
+	assert(vertices_y[4] == INSIDE_Y2);
+	assert(vertices_x[6] == OUTSIDE_X2);
+	assert(vertices_y[6] == OUTSIDE_Y2);
+}
+
+#define RANDOM_BOXES 64
+
+static float
+frand(float max)
+{
+	return (float)random() / RAND_MAX * max;
+}
+
+/* A rectangle rotated by a random angle, or not at all when axis_aligned
+ * is set, in either winding order. */
+static void
+random_quad(struct polygon8 *quad, bool axis_aligned)
+{
+	float cx = frand(200.0f), cy = frand(200.0f);
+	float w = 1.0f + frand(100.0f), h = 1.0f + frand(100.0f);
+	float angle = axis_aligned ? 0.0f : frand(2.0f * M_PI);
+	float c = cosf(angle), s = sinf(angle);
+	const float u[] = { -1.0f, 1.0f, 1.0f, -1.0f };
+	const float v[] = { -1.0f, -1.0f, 1.0f, 1.0f };
+	bool flip = random() & 1;
+	int i, k;
+
+	quad->n = 4;
+	for (i = 0; i < 4; i++) {
+		k = flip ? 3 - i : i;
+		quad->x[i] = cx + c * u[k] * w - s * v[k] * h;
+		quad->y[i] = cy + s * u[k] * w + c * v[k] * h;
+	}
+}
+
+static void
+random_boxes(float *x1, float *y1, float *x2, float *y2, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		x1[i] = frand(200.0f);
+		y1[i] = frand(200.0f);
+		x2[i] = x1[i] + 1.0f + frand(60.0f);
+		y2[i] = y1[i] + 1.0f + frand(60.0f);
+	}
+}
+
+static float
+polygon_area(const float *x, const float *y, int n)
+{
+	float area = 0.0f;
+	int i;
+
+	for (i = 0; i < n; i++)
+		area += x[i] * y[(i + 1) % n] - x[(i + 1) % n] * y[i];
+
+	return fabsf(area) / 2.0f;
+}
+
+/* Compare clip_quad_boxes() with clipping the quad against each box that
+ * overlaps its bounding box in turn. When it takes a shortcut,
+ * clip_quad_boxes() may start a polygon at another vertex, so compare
+ * the polygons by area. */
+static void
+compare_clip_quad_boxes(bool axis_aligned)
+{
+	float x1[RANDOM_BOXES], y1[RANDOM_BOXES];
+	float x2[RANDOM_BOXES], y2[RANDOM_BOXES];
+	struct clip_boxes boxes = { x1, y1, x2, y2, RANDOM_BOXES };
+	float ex[RANDOM_BOXES * 8], ey[RANDOM_BOXES * 8];
+	int vtxcnt[RANDOM_BOXES];
+	struct clip_context ctx;
+	struct polygon8 quad, polygon;
+	float expected_x[8], expected_y[8];
+	float min_x, max_x, min_y, max_y;
+	float expected, area;
+	int npolygons, emitted;
+	int offset = 0;
+	int i, p = 0;
+
+	random_quad(&quad, axis_aligned);
+	random_boxes(x1, y1, x2, y2, RANDOM_BOXES);
+
+	npolygons = clip_quad_boxes(&quad, axis_aligned, &boxes,
+				    ex, ey, vtxcnt);
+
+	min_x = fminf(fminf(quad.x[0], quad.x[1]), fminf(quad.x[2], quad.x[3]));
+	max_x = fmaxf(fmaxf(quad.x[0], quad.x[1]), fmaxf(quad.x[2], quad.x[3]));
+	min_y = fminf(fminf(quad.y[0], quad.y[1]), fminf(quad.y[2], quad.y[3]));
+	max_y = fmaxf(fmaxf(quad.y[0], quad.y[1]), fmaxf(quad.y[2], quad.y[3]));
+
+	for (i = 0; i < RANDOM_BOXES; i++) {
+		/* clip_simple() would clamp the quad onto a disjoint box */
+		if (x2[i] <= min_x || x1[i] >= max_x ||
+		    y2[i] <= min_y || y1[i] >= max_y)
+			continue;
+
+		ctx.clip.x1 = x1[i];
+		ctx.clip.y1 = y1[i];
+		ctx.clip.x2 = x2[i];
+		ctx.clip.y2 = y2[i];
+		if (axis_aligned) {
+			emitted = clip_simple(&ctx, &quad,
+					      expected_x, expected_y);
+		} else {
+			polygon = quad;
+			emitted = clip_transformed(&ctx, &polygon,
+						   expected_x, expected_y);
+		}
+		if (emitted < 3)
+			continue;
+
+		assert(p < npolygons);
+		expected = polygon_area(expected_x, expected_y, emitted);
+		area = polygon_area(ex + offset, ey + offset, vtxcnt[p]);
+		assert(fabsf(area - expected) <= 1e-3f * fmaxf(1.0f, expected));
+
+		offset += vtxcnt[p];
+		p++;
+	}
+
+	assert(p == npolygons);
+}
+
+TEST(clip_quad_boxes_matches_clip_transformed_random)
+{
+	int i;
+
+	srandom(13);
+
+	for (i = 0; i < 10000; i++) {
+		compare_clip_quad_boxes(false);
+		compare_clip_quad_boxes(true);
+	}
+}
+
+static void
+time_clip(const char *name, bool batched)
+{
+	float x1[RANDOM_BOXES], y1[RANDOM_BOXES];
+	float x2[RANDOM_BOXES], y2[RANDOM_BOXES];
+	struct clip_boxes boxes = { x1, y1, x2, y2, RANDOM_BOXES };
+	float ex[RANDOM_BOXES * 8], ey[RANDOM_BOXES * 8];
+	int vtxcnt[RANDOM_BOXES];
+	struct clip_context ctx;
+	struct polygon8 quad, polygon;
+	struct timespec begin, end;
+	unsigned long count;
+	int sink = 0;
+	double t;
+	int i;
+
+	srandom(13);
+	random_quad(&quad, false);
+	random_boxes(x1, y1, x2, y2, RANDOM_BOXES);
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (count = 0; count < 20000; count++) {
+		if (batched) {
+			sink += clip_quad_boxes(&quad, false, &boxes,
+						ex, ey, vtxcnt);
+			continue;
+		}
+
+		for (i = 0; i < RANDOM_BOXES; i++) {
+			ctx.clip.x1 = x1[i];
+			ctx.clip.y1 = y1[i];
+			ctx.clip.x2 = x2[i];
+			ctx.clip.y2 = y2[i];
+			polygon = quad;
+			sink += clip_transformed(&ctx, &polygon, ex, ey);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	t = timespec_sub_to_nsec(&end, &begin) / 1e9;
+
+	testlog("%s: %lu iterations of %d boxes in %f seconds, "
+		"avg. %.1f ns/iter (%d)\n", name, count, RANDOM_BOXES, t,
+		1e9 * t / count, sink);
+}
+
+TEST(clip_quad_boxes_speed)
+{
+	time_clip("clip_transformed() per box", false);
+	time_clip("clip_quad_boxes()", true);
+}